@@ -26,7 +26,9 @@ class IMAGE(Structure):
 class TENSOR(Structure):
     _fields_ = [("n", c_size_t),
                 ("size", POINTER(c_size_t)),
-                ("data", POINTER(c_float))]
+                ("stride", POINTER(c_size_t)),
+                ("data", POINTER(c_float)),
+                ("storage", c_void_p)]
 
 class DATA(Structure):
     _fields_ = [("x", TENSOR),
@@ -48,7 +50,10 @@ LAYER._fields_ = [("x",  TENSOR),
 
                 ("forward", CFUNCTYPE(TENSOR, POINTER(LAYER), TENSOR)),
                 ("backward", CFUNCTYPE(TENSOR, POINTER(LAYER), TENSOR)),
-                ("update", CFUNCTYPE(None, POINTER(LAYER), c_float, c_float, c_float))]
+                ("update", CFUNCTYPE(None, POINTER(LAYER), c_float, c_float, c_float)),
+                ("scratch", c_void_p),
+                ("sw", c_void_p),
+                ("wg", c_void_p)]
 
 class NET(Structure):
     _fields_ = [("n", c_int), ("layers", POINTER(LAYER))]
@@ -128,6 +133,10 @@ train_image_classifier = lib.train_image_classifier
 train_image_classifier.argtypes = [NET, DATA, c_int, c_int, c_float, c_float, c_float]
 train_image_classifier.restype = None
 
+fit_final_layer = lib.fit_final_layer
+fit_final_layer.argtypes = [NET, DATA, c_int, c_float]
+fit_final_layer.restype = c_int
+
 accuracy_net = lib.accuracy_net
 accuracy_net.argtypes = [NET, DATA]
 accuracy_net.restype = c_float
@@ -147,6 +156,14 @@ make_connected_layer = lib.make_connected_layer
 make_connected_layer.argtypes = [c_int, c_int]
 make_connected_layer.restype = LAYER
 
+prune_connected_layer = lib.prune_connected_layer
+prune_connected_layer.argtypes = [POINTER(LAYER), c_float]
+prune_connected_layer.restype = None
+
+compress_connected_layer = lib.compress_connected_layer
+compress_connected_layer.argtypes = [NET, c_int, c_size_t, c_float]
+compress_connected_layer.restype = NET
+
 make_activation_layer = lib.make_activation_layer
 make_activation_layer.argtypes = [c_int]
 make_activation_layer.restype = LAYER
@@ -155,10 +172,21 @@ make_convolutional_layer_lib = lib.make_convolutional_layer
 make_convolutional_layer_lib.argtypes = [c_size_t, c_size_t, c_size_t, c_size_t, c_size_t]
 make_convolutional_layer_lib.restype = LAYER
 
-def make_convolutional_layer(c, n, size=3, stride=1, pad=None):
+conv_set_implicit = lib.conv_set_implicit
+conv_set_implicit.argtypes = [POINTER(LAYER), c_int]
+conv_set_implicit.restype = None
+
+conv_set_winograd = lib.conv_set_winograd
+conv_set_winograd.argtypes = [POINTER(LAYER), c_size_t]
+conv_set_winograd.restype = None
+
+def make_convolutional_layer(c, n, size=3, stride=1, pad=None, implicit=False):
     if not pad:
         pad = (size-1) // 2
-    return make_convolutional_layer_lib(c, n, size, stride, pad)
+    l = make_convolutional_layer_lib(c, n, size, stride, pad)
+    if implicit:
+        conv_set_implicit(byref(l), 1)
+    return l
 
 make_maxpool_layer = lib.make_maxpool_layer
 make_maxpool_layer.argtypes = [c_size_t, c_size_t]
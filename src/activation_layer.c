@@ -60,7 +60,7 @@ tensor forward_activation_layer(layer *l, tensor x)
     // Saving our input
     // Probably don't change this
     tensor_free(l->x);
-    l->x = tensor_copy(x);
+    l->x = tensor_ref(x);
 
     ACTIVATION a = l->activation;
     tensor y = tensor_copy(x);
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "arena.h"
+
+#define ARENA_ALIGN 64
+
+size_t arena_align(size_t bytes)
+{
+    return (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+// Make a new arena
+// size_t size: initial capacity in bytes, the arena grows if it runs out
+// returns: pointer to the arena, free with free_arena
+arena *make_arena(size_t size)
+{
+    arena *a = calloc(1, sizeof(arena));
+    a->size = arena_align(size);
+    a->data = a->size ? aligned_alloc(ARENA_ALIGN, a->size) : 0;
+    return a;
+}
+
+// Allocate uninitialized memory from an arena
+// Allocations that don't fit get their own block until the next reset,
+// which then grows the arena so the same sequence fits next time.
+// arena *a: arena to allocate from
+// size_t bytes: number of bytes
+// returns: 64-byte aligned pointer, valid until arena_reset
+void *arena_alloc(arena *a, size_t bytes)
+{
+    bytes = arena_align(bytes ? bytes : 1);
+    a->used += bytes;
+    if(a->used > a->peak) a->peak = a->used;
+    if(a->used <= a->size){
+        return a->data + a->used - bytes;
+    }
+    size_t header = arena_align(sizeof(arena_block));
+    arena_block *b = aligned_alloc(ARENA_ALIGN, header + bytes);
+    assert(b);
+    b->size = bytes;
+    b->next = a->overflow;
+    a->overflow = b;
+    return (char *)b + header;
+}
+
+// Release everything allocated from an arena
+// arena *a: arena to reset
+void arena_reset(arena *a)
+{
+    if(a->overflow){
+        while(a->overflow){
+            arena_block *next = a->overflow->next;
+            free(a->overflow);
+            a->overflow = next;
+        }
+        free(a->data);
+        a->size = arena_align(a->peak);
+        a->data = aligned_alloc(ARENA_ALIGN, a->size);
+    }
+    a->used = 0;
+}
+
+void free_arena(arena *a)
+{
+    if(!a) return;
+    while(a->overflow){
+        arena_block *next = a->overflow->next;
+        free(a->overflow);
+        a->overflow = next;
+    }
+    free(a->data);
+    free(a);
+}
@@ -0,0 +1,32 @@
+// Include guards and C++ compatibility
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bump-pointer allocator for short-lived scratch memory
+// Everything allocated from an arena is released at once by arena_reset
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+} arena_block;
+
+typedef struct arena {
+    char *data;
+    size_t size;
+    size_t used;
+    size_t peak;
+    arena_block *overflow;
+} arena;
+
+arena *make_arena(size_t size);
+void *arena_alloc(arena *a, size_t bytes);
+void arena_reset(arena *a);
+void free_arena(arena *a);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -10,50 +10,22 @@
 // returns: (1 x groups) tensor with means
 tensor mean2d(tensor x)
 {
-    int n = x.size[0];
-    int c = x.size[1];
-    int h = x.size[2];
-    int w = x.size[3];
-    tensor m = tensor_vmake(1, c);
-
     // TODO: 7.0 - Calculate mean - Already done!
-
-    int i, j, k, b;
-    for(b = 0; b < n; ++b){
-        for(k = 0; k < c; ++k){
-            for(j = 0; j < h; ++j){
-                for(i = 0; i < w; ++i){
-                    m.data[k] += x.data[i + w*(j + h*(k + b*c))];
-                }
-            }
-        }
-    }
-    tensor_scale_(1.0/(n*h*w), m);
-    return m;
+    size_t axes[3] = {0, 2, 3};
+    return tensor_mean_axes(x, 3, axes);
 }
 
 // Take variance over tensor x given mean m
 tensor variance2d(tensor x, tensor m)
 {
-    int n = x.size[0];
-    int c = x.size[1];
-    int h = x.size[2];
-    int w = x.size[3];
-    tensor v = tensor_vmake(1, c);
-
     // TODO: 7.1 - Calculate variance
-
-    int i, j, k, b;
-    for(b = 0; b < n; ++b){
-        for(k = 0; k < c; ++k){
-            for(j = 0; j < h; ++j){
-                for(i = 0; i < w; ++i){
-                    v.data[k] += pow(x.data[i + w*(j + h*(k + b*c))] - m.data[k], 2);
-                }
-            }
-        }
-    }
-    tensor_scale_(1.0/(n*h*w), v);
+    size_t axes[3] = {0, 2, 3};
+    tensor m4 = tensor_vview(m, 4, 1, x.size[1], 1, 1);
+    tensor d = tensor_sub(x, m4);
+    tensor_mul_(d, d);
+    tensor v = tensor_mean_axes(d, 3, axes);
+    tensor_free(m4);
+    tensor_free(d);
     return v;
 }
 
@@ -93,7 +65,9 @@ tensor forward_batchnorm2d_layer(layer *l, tensor x)
     // Saving our input
     // Probably don't change this
     tensor_free(l->x);
-    l->x = tensor_copy(x);
+    l->x = tensor_ref(x);
+    // the rolling statistics are updated in place below
+    tensor_unshare(&l->w);
     tensor rolling_mean = tensor_get_(l->w, 0);
     tensor rolling_variance = tensor_get_(l->w, 1);
 
@@ -119,48 +93,32 @@ tensor forward_batchnorm2d_layer(layer *l, tensor x)
 
 tensor delta_mean2d(tensor dy, tensor v)
 {
-    int n = dy.size[0];
-    int c = dy.size[1];
-    int h = dy.size[2];
-    int w = dy.size[3];
-    tensor dm = tensor_vmake(1, c);
-
     // TODO: 7.3
     float eps = 0.00001f;
-    int i, j, k, b;
-    for(b = 0; b < n; ++b){
-        for(k = 0; k < c; ++k){
-            for(j = 0; j < h; ++j){
-                for(i = 0; i < w; ++i){
-                    dm.data[k] += -1 * dy.data[i + w*(j + h*(k + b*c))] / sqrt(v.data[k] + eps);
-                }
-            }
-        }
+    size_t axes[3] = {0, 2, 3};
+    tensor dm = tensor_sum_axes(dy, 3, axes);
+    size_t k;
+    for(k = 0; k < tensor_len(dm); ++k){
+        dm.data[k] *= -1 / sqrt(v.data[k] + eps);
     }
     return dm;
 }
 
-
 tensor delta_variance2d(tensor dy, tensor x, tensor m, tensor v)
 {
-    int n = dy.size[0];
-    int c = dy.size[1];
-    int h = dy.size[2];
-    int w = dy.size[3];
-    tensor dv = tensor_vmake(1, c);
-
     // TODO 7.4 - Calculate dL/dv
     float eps = 0.00001f;
-    int i, j, k, b;
-    for(b = 0; b < n; ++b){
-        for(k = 0; k < c; ++k){
-            for(j = 0; j < h; ++j){
-                for(i = 0; i < w; ++i){
-                    dv.data[k] += -0.5 * pow(v.data[k] + eps, -1.5) * (x.data[i + w*(j + h*(k + b*c))] - m.data[k]) * dy.data[i + w*(j + h*(k + b*c))];
-                }
-            }
-        }
+    size_t axes[3] = {0, 2, 3};
+    tensor m4 = tensor_vview(m, 4, 1, x.size[1], 1, 1);
+    tensor d = tensor_sub(x, m4);
+    tensor_mul_(d, dy);
+    tensor dv = tensor_sum_axes(d, 3, axes);
+    size_t k;
+    for(k = 0; k < tensor_len(dv); ++k){
+        dv.data[k] *= -0.5 * pow(v.data[k] + eps, -1.5);
     }
+    tensor_free(m4);
+    tensor_free(d);
     return dv;
 }
 
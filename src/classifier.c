@@ -1,37 +1,30 @@
 #include <math.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 #include "dubnet.h"
 #include "tensor.h"
-
-int max_index(float *a, int n)
-{
-    if(n <= 0) return -1;
-    int i;
-    int max_i = 0;
-    float max = a[0];
-    for (i = 1; i < n; ++i) {
-        if (a[i] > max){
-            max = a[i];
-            max_i = i;
-        }
-    }
-    return max_i;
-}
+#include "matrix.h"
+#include "sparse.h"
 
 float accuracy_net(net m, data d)
 {
     tensor p = forward_net(m, d.x);
-    int i;
+    size_t n = d.y.size[0];
+    size_t i;
+    size_t axis = 1; // classes
+    size_t *guess = calloc(n, sizeof(size_t));
+    size_t *truth = calloc(n, sizeof(size_t));
+    tensor_argmax_axes(guess, p, 1, &axis);
+    tensor_argmax_axes(truth, d.y, 1, &axis);
     int correct = 0;
-    for (i = 0; i < d.y.size[0]; ++i) {
-        tensor guess = tensor_get_(p, i);
-        tensor truth = tensor_get(d.y, i);
-        size_t len = tensor_len(guess);
-        if (max_index(guess.data, len) == max_index(truth.data, len)) ++correct;
+    for (i = 0; i < n; ++i) {
+        if (guess[i] == truth[i]) ++correct;
     }
+    free(guess);
+    free(truth);
     tensor_free(p);
-    return (float)correct / d.y.size[0];
+    return (float)correct / n;
 }
 
 float cross_entropy_loss(tensor x, tensor y)
@@ -54,17 +47,97 @@ tensor cross_entropy_derivative(tensor x, tensor y)
 
 void train_image_classifier(net m, data d, int batch, int iters, float rate, float momentum, float decay)
 {
-    int e;
+    int e, i;
+    // Layers take their per-iteration temporaries from one arena,
+    // it settles at the size of the largest iteration after the first
+    arena *scratch = make_arena(0);
+    for(i = 0; i < m.n; ++i){
+        m.layers[i].scratch = scratch;
+    }
     for(e = 0; e < iters; ++e){
+        arena_reset(scratch);
         data b = random_batch(d, batch);
         tensor yhat = forward_net(m, b.x);
         float err = cross_entropy_loss(yhat, b.y);
-        tensor dy = cross_entropy_derivative(yhat, b.y);
         fprintf(stderr, "%06d: Loss: %f\n", e, err);
-        backward_net(m, dy);
+        // yhat isn't needed after the loss, turn it into dL/dyhat in place
+        // (this is cross_entropy_derivative without the extra buffer)
+        tensor_unshare(&yhat);
+        tensor_sub_(yhat, b.y);
+        backward_net(m, yhat);
         update_net(m, rate/batch, momentum, decay);
         free_data(b);
         tensor_free(yhat);
-        tensor_free(dy);
     }
+    for(i = 0; i < m.n; ++i){
+        m.layers[i].scratch = 0;
+    }
+    free_arena(scratch);
+}
+
+// Fit the last connected layer in closed form by ridge regression
+// The layers before it are kept frozen and run over the whole dataset once,
+// batch by batch, accumulating [h 1]^T [h 1] and [h 1]^T y for their
+// outputs h. The weights are then the solution of
+// ([h 1]^T [h 1] + n*lambda*I) [w; b] = [h 1]^T y, with the bias left out
+// of the penalty. This replaces SGD for linear probes on fixed features.
+// net m: network whose last connected layer is refit
+// data d: training data
+// int batch: examples run through the frozen layers at a time
+// float lambda: l2 penalty on the weights, per example like decay
+// returns: 1 on success, 0 if the net has no connected layer or the
+// system is singular
+int fit_final_layer(net m, data d, int batch, float lambda)
+{
+    int f;
+    for(f = m.n - 1; f >= 0; --f){
+        tensor (*fw)(layer *, tensor) = m.layers[f].forward;
+        if(fw == forward_connected_layer || fw == forward_sparse_connected_layer) break;
+    }
+    if(f < 0) return 0;
+    layer *l = &m.layers[f];
+    net frozen = {f, m.layers};
+    size_t inputs = l->w.size[0];
+    size_t outputs = l->w.size[1];
+    size_t n = d.x.size[0];
+    size_t start, i;
+
+    tensor xtx = tensor_vmake(2, inputs + 1, inputs + 1);
+    tensor xty = tensor_vmake(2, inputs + 1, outputs);
+    for(start = 0; start < n; start += batch){
+        data b = get_batch(d, start, batch);
+        size_t rows = b.x.size[0];
+        tensor h = forward_net(frozen, b.x);
+        assert(tensor_len(h) == rows*inputs);
+        tensor a = tensor_vempty(2, rows, inputs + 1);
+        for(i = 0; i < rows; ++i){
+            memcpy(a.data + i*(inputs + 1), h.data + i*inputs, inputs*sizeof(float));
+            a.data[i*(inputs + 1) + inputs] = 1;
+        }
+        gemm(1, 0, 1, a, a, 1, xtx);
+        gemm(1, 0, 1, a, b.y, 1, xty);
+        tensor_free(a);
+        tensor_free(h);
+        free_data(b);
+    }
+    for(i = 0; i < inputs; ++i){
+        xtx.data[i*(inputs + 2)] += n*lambda;
+    }
+
+    tensor wb = solve_system_spd(xtx, xty);
+    tensor_free(xtx);
+    tensor_free(xty);
+    if(!wb.data) return 0;
+
+    // the old weights, and the momentum built up for them, are gone
+    tensor_unshare(&l->w);
+    tensor_unshare(&l->b);
+    memcpy(l->w.data, wb.data, inputs*outputs*sizeof(float));
+    memcpy(l->b.data, wb.data + inputs*outputs, outputs*sizeof(float));
+    tensor_scale_(0, l->dw);
+    tensor_scale_(0, l->db);
+    tensor_free(wb);
+    // a pruned layer is pruned again, as much as it was
+    if(l->sw) prune_connected_layer(l, 1 - (float)l->sw->nnz/(inputs*outputs));
+    return 1;
 }
@@ -1,8 +1,10 @@
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
+#include <string.h>
 #include "dubnet.h"
 #include "matrix.h"
+#include "sparse.h"
 
 // Run a connected layer on input
 // layer l: pointer to layer to run
@@ -13,13 +15,15 @@ tensor forward_connected_layer(layer *l, tensor x)
     // Saving our input
     // Probably don't change this
     tensor_free(l->x);
-    l->x = tensor_copy(x);
+    l->x = tensor_ref(x);
 
-    // turn x into matrix if it isn't (this is kind gross but has to be done)
+    // turn x into matrix if it isn't (views are free, no data is copied)
     x = tensor_vview(x, 2, x.size[0], tensor_len(x)/x.size[0]);
 
     // TODO: 3.0 - run the network forward
-    tensor y = tensor_add(matrix_multiply(x, l->w), l->b);
+    tensor y = matrix_multiply(x, l->w);
+    tensor_add_(y, l->b);
+    tensor_free(x);
     return y;
 }
 
@@ -37,24 +41,16 @@ tensor backward_connected_layer(layer *l, tensor dy)
     /*
         dL_db = sum(dy)
     */
-    tensor dL_db = tensor_sum_dim(dy, 0);
-    tensor_axpy_(1.0f, dL_db, l->db);
+    tensor_sum_dim_(l->db, dy, 0);
 
-    tensor_free(dL_db);
-
-    // Then calculate dL/dw. Use axpy to add this dL/dw into any previously stored
-    // updates for our weights, which are stored in l.dw
+    // Then calculate dL/dw and add it into any previously stored updates
+    // for our weights, which are stored in l.dw (a gemm with beta = 1)
     /*
         dL_dw = dL_dwx * dwx_dw
             dwx_dw = transpose(x)
             dL_dwx = dy
     */
-    tensor x_t = matrix_transpose(x);
-    tensor dL_dw = matrix_multiply(x_t, dy);
-    tensor_axpy_(1.0f, dL_dw, l->dw);
-
-    tensor_free(x_t);
-    tensor_free(dL_dw);
+    gemm(1, 0, 1, x, dy, 1, l->dw);
 
     // Calculate dL/dx and return it
     /*
@@ -62,7 +58,12 @@ tensor backward_connected_layer(layer *l, tensor dy)
             dwx_dx = transpose(w)
             dL_dwx = dy
     */ 
-    tensor dx = matrix_multiply(dy, matrix_transpose(l->w));
+    // dx has the shape of the input, which isn't 2d after a conv layer
+    tensor dx = tensor_empty(l->x.n, l->x.size);
+    tensor dx2 = tensor_vview(dx, 2, x.size[0], x.size[1]);
+    gemm(0, 1, 1, dy, l->w, 0, dx2);
+    tensor_free(dx2);
+    tensor_free(x);
     return dx;
 }
 
@@ -81,31 +82,35 @@ void update_connected_layer(layer *l, float rate, float momentum, float decay)
     // lastly, l.dw is the negative update (-update) but for the next iteration
     // we want it to be (-momentum * update) so we just need to scale it a little
 
+    // w and b are updated in place, make sure no one else is looking at them
+    tensor_unshare(&l->w);
+    tensor_unshare(&l->b);
+
     /*
         dw = dw + (decay * w)
     */
-    l->dw = tensor_add(l->dw, tensor_scale(decay, l->w));
+    tensor_axpy_(decay, l->w, l->dw);
     
     /*
         w = w - rate * dw
     */
-    l->w = tensor_sub(l->w, tensor_scale(rate, l->dw));
+    tensor_axpy_(-rate, l->dw, l->w);
     
     /*
         l.dw = momentum * update
     */
-    l->dw = tensor_scale(momentum, l->dw);
+    tensor_scale_(momentum, l->dw);
 
     // Do the same for biases as well but no need to use weight decay on biases
     /*
         b = b - (rate * db)
     */
-    l->b = tensor_sub(l->b, tensor_scale(rate, l->db));
+    tensor_axpy_(-rate, l->db, l->b);
     
     /*
         db = momentum * update 
     */
-    l->db = tensor_scale(momentum, l->db);
+    tensor_scale_(momentum, l->db);
 }
 
 layer make_connected_layer(int inputs, int outputs)
@@ -121,3 +126,130 @@ layer make_connected_layer(int inputs, int outputs)
     return l;
 }
 
+
+// Run a pruned connected layer on input, multiplying by the nonzeros only
+// layer l: pointer to layer to run
+// matrix x: input to layer
+// returns: the result of running the layer y = xw+b
+tensor forward_sparse_connected_layer(layer *l, tensor x)
+{
+    tensor_free(l->x);
+    l->x = tensor_ref(x);
+
+    x = tensor_vview(x, 2, x.size[0], tensor_len(x)/x.size[0]);
+    tensor y = tensor_vempty(2, x.size[0], l->w.size[1]);
+    sparse_multiply_t_into(y, x, l->sw);
+    tensor_add_(y, l->b);
+    tensor_free(x);
+    return y;
+}
+
+// Update a pruned connected layer, keeping its pruned weights at zero
+// The dense update runs as usual, then the surviving weights are copied
+// into the sparse ones and the rest cleared
+void update_sparse_connected_layer(layer *l, float rate, float momentum, float decay)
+{
+    update_connected_layer(l, rate, momentum, decay);
+    sparse_matrix *s = l->sw;
+    size_t outputs = l->w.size[1];
+    size_t o, i, p;
+    for(o = 0; o < s->rows; ++o){
+        p = s->row[o];
+        for(i = 0; i < s->cols; ++i){
+            float *w = l->w.data + i*outputs + o;
+            if(p < s->row[o+1] && s->col[p] == i) s->val[p++] = *w;
+            else *w = 0;
+        }
+    }
+}
+
+int compare_float(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// Prune a connected layer by magnitude and switch it to sparse weights
+// The smallest weights are set to zero in w and the rest kept, transposed,
+// in l.sw for the forward pass. Training it further keeps the pruned
+// weights at zero.
+// layer l: connected layer to prune
+// float sparsity: fraction of the weights to remove, between 0 and 1
+void prune_connected_layer(layer *l, float sparsity)
+{
+    assert(l->w.n == 2);
+    assert(sparsity >= 0 && sparsity <= 1);
+    tensor_unshare(&l->w);
+    size_t len = tensor_len(l->w);
+    size_t cut = sparsity*len;
+    size_t i;
+    if(cut > 0){
+        float *mag = calloc(len, sizeof(float));
+        for(i = 0; i < len; ++i) mag[i] = fabsf(l->w.data[i]);
+        qsort(mag, len, sizeof(float), compare_float);
+        float threshold = mag[cut - 1];
+        for(i = 0; i < len; ++i){
+            if(fabsf(l->w.data[i]) <= threshold) l->w.data[i] = 0;
+        }
+        free(mag);
+    }
+    free_sparse(l->sw);
+    tensor wt = tensor_transpose_view(l->w, 0, 1);
+    l->sw = sparse_from_dense(wt);
+    tensor_free(wt);
+    l->forward = forward_sparse_connected_layer;
+    l->update  = update_sparse_connected_layer;
+}
+
+// Replace a connected layer with two thinner ones by truncated SVD
+// w = u s v^T is cut to its largest singular values, the first new layer
+// gets u sqrt(s) and no bias, the second sqrt(s) v^T and the old bias.
+// That pays off once rank*(inputs + outputs) < inputs*outputs.
+// net m: network to compress. The old layer is freed, the array holding
+// it is left to whoever allocated it.
+// int i: index of the connected layer
+// size_t rank: most singular values to keep, 0 for no limit
+// float energy: least fraction of the sum of squared singular values to
+// keep, 1 keeps them all
+// returns: the network with one more layer
+net compress_connected_layer(net m, int i, size_t rank, float energy)
+{
+    assert(i >= 0 && i < m.n);
+    layer *l = &m.layers[i];
+    assert(l->w.n == 2);
+    size_t inputs = l->w.size[0];
+    size_t outputs = l->w.size[1];
+    tensor u, s, v;
+    matrix_svd(l->w, &u, &s, &v);
+
+    size_t r = s.size[0];
+    size_t k, j;
+    double total = 0, kept = 0;
+    for(k = 0; k < r; ++k) total += (double)s.data[k]*s.data[k];
+    for(k = 0; k < r; ++k){
+        if(rank && k >= rank) break;
+        if(k > 0 && kept >= energy*total) break;
+        kept += (double)s.data[k]*s.data[k];
+    }
+    r = k;
+
+    layer first = make_connected_layer(inputs, r);
+    layer second = make_connected_layer(r, outputs);
+    for(k = 0; k < r; ++k){
+        float root = sqrtf(s.data[k]);
+        for(j = 0; j < inputs; ++j) first.w.data[j*r + k] = u.data[j*u.size[1] + k]*root;
+        for(j = 0; j < outputs; ++j) second.w.data[k*outputs + j] = v.data[j*v.size[1] + k]*root;
+    }
+    tensor_axpy_(1, l->b, second.b);
+
+    net c = {m.n + 1, calloc(m.n + 1, sizeof(layer))};
+    memcpy(c.layers, m.layers, i*sizeof(layer));
+    c.layers[i] = first;
+    c.layers[i+1] = second;
+    memcpy(c.layers + i + 2, m.layers + i + 1, (m.n - i - 1)*sizeof(layer));
+    free_layer(*l);
+    tensor_free(u);
+    tensor_free(s);
+    tensor_free(v);
+    return c;
+}
@@ -4,102 +4,257 @@
 #include <string.h>
 #include "dubnet.h"
 #include "matrix.h"
+#include "parallel.h"
+#include "gemm.h"
+#include "winograd.h"
 
-// Make a column matrix out of an image
-// tensor im: image to process
-// size_t size: kernel size for convolution operation
-// size_t stride: stride for convolution
-// size_t pad: # pixels padding on each edge for convolution
-// returns: column matrix
-tensor im2col(tensor im, size_t size_y, size_t size_x, size_t stride, size_t pad)
+// Most floats of column matrix lowered at once by default. Bigger batches
+// are cut into chunks of images whose columns fit.
+#define CONV_WORKSPACE (1 << 24)
+
+static size_t conv_workspace = CONV_WORKSPACE;
+
+// Limit the column matrix convolutional layers lower at once
+// size_t floats: workspace size, 0 restores the default. A chunk is never
+// smaller than one image.
+void conv_set_workspace(size_t floats)
 {
-    assert(im.n == 3);
-    size_t i, j, k;
+    conv_workspace = floats ? floats : CONV_WORKSPACE;
+}
 
-    size_t im_c = im.size[0];
-    size_t im_h = im.size[1];
-    size_t im_w = im.size[2];
+// Output columns ox whose input column ox*stride + kx - pad is in the
+// image, [lo, hi). The rest of the row reads padding.
+static void conv_span(size_t w, size_t res_w, size_t kx, size_t stride, size_t pad,
+        size_t *lo, size_t *hi)
+{
+    *lo = (pad > kx) ? (pad - kx + stride - 1)/stride : 0;
+    *hi = (w + pad > kx) ? (w + pad - kx - 1)/stride + 1 : 0;
+    if(*hi > res_w) *hi = res_w;
+    if(*lo > *hi) *lo = *hi;
+}
 
+// Fill the rows of one channel of a column matrix with patches from an image
+// Goes along kernel offsets and output rows, so each output row is one
+// span of an image row: copied whole at stride 1, gathered at a fixed step
+// otherwise, with the padding on either side zeroed around it
+// float *col: size_y*size_x rows of the column matrix, row stride ld
+// float *im: (h, w) channel of the image
+void im2col_channel(float *col, size_t ld, const float *im, size_t im_h, size_t im_w,
+        size_t size_y, size_t size_x, size_t stride, size_t pad)
+{
     size_t res_h = (im_h + 2*pad - size_y)/stride + 1;
     size_t res_w = (im_w + 2*pad - size_x)/stride + 1;
-
-    size_t rows = im_c*size_y*size_x;
-    size_t cols = res_w * res_h;
-
-    tensor col = tensor_vmake(2, rows, cols);
+    size_t ky, kx, oy, ox, lo, hi;
 
     // TODO: 5.1
     // Fill in the column matrix with patches from the image
-    for (i = 0; i < rows; i++)
-    {
-        for (j = 0; j < cols; j++)
-        {
-            size_t c = i / (size_y * size_x);
-            size_t y = (i / size_x) % size_y;
-            size_t x = i % size_x;
-            size_t res_y = j / res_w;
-            size_t res_x = j % res_w;
-            size_t im_y = res_y * stride + y - pad;
-            size_t im_x = res_x * stride + x - pad;
-            if (im_y >= 0 && im_y < im_h && im_x >= 0 && im_x < im_w)
-            {
-                col.data[i * cols + j] = im.data[c * im_h * im_w + im_y * im_w + im_x];
+    for(ky = 0; ky < size_y; ++ky){
+        for(kx = 0; kx < size_x; ++kx){
+            float *row = col + (ky*size_x + kx)*ld;
+            conv_span(im_w, res_w, kx, stride, pad, &lo, &hi);
+            for(oy = 0; oy < res_h; ++oy, row += res_w){
+                size_t iy = oy*stride + ky;
+                if(iy < pad || iy - pad >= im_h){
+                    memset(row, 0, res_w*sizeof(float));
+                    continue;
+                }
+                memset(row, 0, lo*sizeof(float));
+                memset(row + hi, 0, (res_w - hi)*sizeof(float));
+                if(lo == hi) continue;
+                // input of output column lo, then every stride-th one
+                const float *src = im + (iy - pad)*im_w + lo*stride + kx - pad;
+                float *dst = row + lo;
+                size_t n = hi - lo;
+                if(stride == 1){
+                    memcpy(dst, src, n*sizeof(float));
+                } else if(stride == 2){
+                    for(ox = 0; ox < n; ++ox) dst[ox] = src[2*ox];
+                } else {
+                    for(ox = 0; ox < n; ++ox) dst[ox] = src[ox*stride];
+                }
             }
-            else
-            {
-                col.data[i * cols + j] = 0;
+        }
+    }
+}
+
+// Add one channel's rows of a column matrix back into an image, see
+// im2col_channel. The padding in the rows is skipped.
+void col2im_channel(float *im, const float *col, size_t ld, size_t im_h, size_t im_w,
+        size_t size_y, size_t size_x, size_t stride, size_t pad)
+{
+    size_t res_h = (im_h + 2*pad - size_y)/stride + 1;
+    size_t res_w = (im_w + 2*pad - size_x)/stride + 1;
+    size_t ky, kx, oy, ox, lo, hi;
+    for(ky = 0; ky < size_y; ++ky){
+        for(kx = 0; kx < size_x; ++kx){
+            const float *row = col + (ky*size_x + kx)*ld;
+            conv_span(im_w, res_w, kx, stride, pad, &lo, &hi);
+            for(oy = 0; oy < res_h; ++oy, row += res_w){
+                size_t iy = oy*stride + ky;
+                if(iy < pad || iy - pad >= im_h || lo == hi) continue;
+                float *dst = im + (iy - pad)*im_w + lo*stride + kx - pad;
+                const float *src = row + lo;
+                size_t n = hi - lo;
+                if(stride == 1){
+                    for(ox = 0; ox < n; ++ox) dst[ox] += src[ox];
+                } else if(stride == 2){
+                    for(ox = 0; ox < n; ++ox) dst[2*ox] += src[ox];
+                } else {
+                    for(ox = 0; ox < n; ++ox) dst[ox*stride] += src[ox];
+                }
             }
         }
     }
+}
+
+// Lowering of a chunk of images into one column matrix, image i taking
+// columns i*out_h*out_w onwards of every row
+typedef struct conv_job {
+    float *col;
+    size_t ld;
+    float *im;
+    size_t c, h, w;
+    size_t size_y, size_x, stride, pad;
+    size_t out;     // out_h*out_w
+} conv_job;
+
+// Channels start to end of the chunk, channel r being channel r % c of
+// image r / c
+void im2col_part(void *ctx, size_t start, size_t end)
+{
+    conv_job *j = ctx;
+    size_t r;
+    for(r = start; r < end; ++r){
+        size_t i = r / j->c, ch = r % j->c;
+        im2col_channel(j->col + ch*j->size_y*j->size_x*j->ld + i*j->out, j->ld,
+                j->im + r*j->h*j->w, j->h, j->w, j->size_y, j->size_x, j->stride, j->pad);
+    }
+}
+
+void col2im_part(void *ctx, size_t start, size_t end)
+{
+    conv_job *j = ctx;
+    size_t r;
+    for(r = start; r < end; ++r){
+        size_t i = r / j->c, ch = r % j->c;
+        col2im_channel(j->im + r*j->h*j->w, j->col + ch*j->size_y*j->size_x*j->ld + i*j->out,
+                j->ld, j->h, j->w, j->size_y, j->size_x, j->stride, j->pad);
+    }
+}
+
+// Fill a column matrix with patches from an image
+// tensor col: (c*size_y*size_x, out_h*out_w) matrix to fill, rows may be
+// strided
+// tensor im: image to process
+// size_t size: kernel size for convolution operation
+// size_t stride: stride for convolution
+// size_t pad: # pixels padding on each edge for convolution
+void im2col_into(tensor col, tensor im, size_t size_y, size_t size_x, size_t stride, size_t pad)
+{
+    assert(im.n == 3 && col.n == 2);
+    assert(tensor_is_contiguous(im) && col.stride[1] == 1);
+    size_t res_h = (im.size[1] + 2*pad - size_y)/stride + 1;
+    size_t res_w = (im.size[2] + 2*pad - size_x)/stride + 1;
+    assert(col.size[0] == im.size[0]*size_y*size_x);
+    assert(col.size[1] == res_h*res_w);
+    conv_job j = {col.data, col.stride[0], im.data, im.size[0], im.size[1], im.size[2],
+        size_y, size_x, stride, pad, res_h*res_w};
+    parallel_for(im.size[0], 1, im2col_part, &j);
+}
+
+// Make a column matrix out of an image
+// tensor im: image to process
+// size_t size: kernel size for convolution operation
+// size_t stride: stride for convolution
+// size_t pad: # pixels padding on each edge for convolution
+// returns: column matrix
+tensor im2col(tensor im, size_t size_y, size_t size_x, size_t stride, size_t pad)
+{
+    assert(im.n == 3);
+    size_t res_h = (im.size[1] + 2*pad - size_y)/stride + 1;
+    size_t res_w = (im.size[2] + 2*pad - size_x)/stride + 1;
+    tensor col = tensor_vempty(2, im.size[0]*size_y*size_x, res_h*res_w);
+    im2col_into(col, im, size_y, size_x, stride, pad);
     return col;
 }
 
 // The reverse of im2col, add elements back into image
+// tensor im: (c, h, w) image to add elements back into
+// matrix col: column matrix to put back into image, rows may be strided
+// int size: kernel size
+// int stride: convolution stride
+void col2im_into(tensor im, tensor col, size_t size_y, size_t size_x, size_t stride, size_t pad)
+{
+    assert(im.n == 3 && col.n == 2);
+    assert(tensor_is_contiguous(im) && col.stride[1] == 1);
+    size_t res_h = (im.size[1] + 2*pad - size_y)/stride + 1;
+    size_t res_w = (im.size[2] + 2*pad - size_x)/stride + 1;
+    assert(col.size[0] == im.size[0]*size_y*size_x);
+    assert(col.size[1] == res_h*res_w);
+    conv_job j = {col.data, col.stride[0], im.data, im.size[0], im.size[1], im.size[2],
+        size_y, size_x, stride, pad, res_h*res_w};
+    parallel_for(im.size[0], 1, col2im_part, &j);
+}
+
+// The reverse of im2col, add elements back into a new image
 // matrix col: column matrix to put back into image
 // int size: kernel size
 // int stride: convolution stride
-// image im: image to add elements back into
+// returns: (c, h, w) image
 tensor col2im(tensor col, size_t c, size_t h, size_t w, size_t size_y, size_t size_x, size_t stride, size_t pad)
 {
     tensor im = tensor_vmake(3, c, h, w);
-    size_t i, j, k;
-
-    size_t im_c = im.size[0];
-    size_t im_h = im.size[1];
-    size_t im_w = im.size[2];
-
-    size_t res_h = (im_h + 2*pad - size_y)/stride + 1;
-    size_t res_w = (im_w + 2*pad - size_x)/stride + 1;
-
-    size_t rows = im_c*size_y*size_x;
-    size_t cols = res_w * res_h;
-    assert(col.n == 2);
-    assert(col.size[0] == rows);
-    assert(col.size[1] == cols);
+    col2im_into(im, col, size_y, size_x, stride, pad);
+    return im;
+}
 
-    // TODO: 5.1
-    // Fill in the column matrix with patches from the image
-    for (i = 0; i < rows; i++)
-    {
-        for (j = 0; j < cols; j++)
-        {
-            size_t c = i / (size_y * size_x);
-            size_t y = (i / size_x) % size_y;
-            size_t x = i % size_x;
-            size_t res_y = j / res_w;
-            size_t res_x = j % res_w;
-            size_t im_y = res_y * stride + y - pad;
-            size_t im_x = res_x * stride + x - pad;
-            if (im_y >= 0 && im_y < im_h && im_x >= 0 && im_x < im_w)
-            {
-                im.data[c * im_h * im_w + im_y * im_w + im_x] += col.data[i * cols + j];
-            }
+// Copies between a chunk in NCHW, as the layers pass it, and the
+// (channels, images*out_h*out_w) layout of the GEMM on the whole chunk
+typedef struct conv_copy_job {
+    float *nchw;
+    float *cm;
+    const float *bias;  // added on the way to NCHW when set
+    size_t n, c, out;
+    int to_nchw;
+} conv_copy_job;
+
+void conv_copy_part(void *ctx, size_t start, size_t end)
+{
+    conv_copy_job *j = ctx;
+    size_t r, q;
+    for(r = start; r < end; ++r){
+        size_t i = r / j->c, f = r % j->c;
+        float *a = j->nchw + r*j->out;
+        float *b = j->cm + f*j->n*j->out + i*j->out;
+        if(!j->to_nchw){
+            memcpy(b, a, j->out*sizeof(float));
+        } else if(j->bias){
+            float bf = j->bias[f];
+            for(q = 0; q < j->out; ++q) a[q] = b[q] + bf;
+        } else if(a != b){
+            memcpy(a, b, j->out*sizeof(float));
         }
     }
-    return im;
+}
+
+void conv_copy(float *nchw, float *cm, const float *bias, size_t n, size_t c, size_t out, int to_nchw)
+{
+    conv_copy_job j = {nchw, cm, bias, n, c, out, to_nchw};
+    parallel_for(n*c, 1 + 4096/out, conv_copy_part, &j);
+}
+
+// Images of a batch lowered together so their columns fit the workspace
+size_t conv_chunk(size_t n, size_t col_len)
+{
+    size_t chunk = conv_workspace/col_len;
+    if(chunk < 1) chunk = 1;
+    return chunk < n ? chunk : n;
 }
 
 // Run a convolutional layer on input
+// The batch is lowered a chunk of images at a time into one column
+// matrix. Each chunk is one batched multiply by the weights, image i
+// reading its own columns and writing straight into its NCHW output.
 // layer l: pointer to layer to run
 // tensor x: input to layer
 // returns: the result of running the layer
@@ -112,10 +267,11 @@ tensor forward_convolutional_layer(layer *l, tensor x)
     // Saving our input
     // Probably don't change this
     tensor_free(l->x);
-    l->x = tensor_copy(x);
+    l->x = tensor_ref(x);
+    assert(tensor_is_contiguous(x));
 
     size_t im_n = x.size[0];
-    // size_t im_c = x.size[1];
+    size_t im_c = x.size[1];
     size_t im_h = x.size[2];
     size_t im_w = x.size[3];
 
@@ -128,47 +284,137 @@ tensor forward_convolutional_layer(layer *l, tensor x)
     size_t y_h = (im_h + 2*l->pad - f_h)/l->stride + 1;
     size_t y_w = (im_w + 2*l->pad - f_w)/l->stride + 1;
 
-    tensor y = tensor_vmake(4, im_n, y_c, y_h, y_w);
+    tensor y = tensor_vempty(4, im_n, y_c, y_h, y_w);
+
+    size_t k = f_c*f_h*f_w;
+    size_t out = y_h*y_w;
+    size_t chunk = conv_chunk(im_n, k*out);
+    tensor cols = tensor_vmake_in(l->scratch, 2, k, chunk*out);
+    conv_job j = {cols.data, 0, 0, im_c, im_h, im_w, f_h, f_w, l->stride, l->pad, out};
+    size_t s, i;
+    for(s = 0; s < im_n; s += chunk){
+        size_t nb = (im_n - s < chunk) ? im_n - s : chunk;
+        float *ys = y.data + s*y_c*out;
+        j.ld = nb*out;
+        j.im = x.data + s*im_c*im_h*im_w;
+        parallel_for(nb*im_c, 1, im2col_part, &j);
+        matrix_backend_get()->gemm(nb, f_n, out, k, 1, l->w.data, k, 1, 0,
+                cols.data, nb*out, 1, out, 0, ys, out, 1, f_n*out);
+        for(i = 0; i < nb; ++i){
+            conv_copy(ys + i*y_c*out, ys + i*y_c*out, l->b.data, 1, y_c, out, 1);
+        }
+    }
+    tensor_free(cols);
 
-    // weights in matrix for matrix multiplication
-    tensor w = tensor_vview(l->w, 2, f_n, f_c*f_h*f_w);
+    return y;
+}
 
-    size_t i, j;
-    for(i = 0; i < x.size[0]; ++i){
-        tensor x_i = im2col(tensor_get_(x, i), f_h, f_w, l->stride, l->pad);
-        tensor wx = matrix_multiply(w, x_i);
-        tensor y_i = tensor_get_(y, i);
-        size_t len = tensor_len(wx);
-        for(j = 0; j < len; ++j){
-            y_i.data[j] = wx.data[j];
+// An image batch seen as the column matrices im2col would make of it,
+// operand i of the multiply being image i
+typedef struct conv_pack_job {
+    const float *x;
+    size_t c, h, w;
+    size_t size_y, size_x, stride, pad;
+    size_t out_w;
+} conv_pack_job;
+
+// Gather a block of patches into GEMM panels, see gemm_packer
+// Where each column's patch starts is worked out once per panel, after
+// that every step along k is one channel and kernel offset
+void conv_pack(void *ctx, size_t i, size_t p0, size_t kc, size_t j0, size_t nc, size_t nr, float *bp)
+{
+    const conv_pack_job *j = ctx;
+    const float *im = j->x + i*j->c*j->h*j->w;
+    long ys[GEMM_NR_MAX], xs[GEMM_NR_MAX];
+    long h = j->h, w = j->w;
+    size_t jr, p, t;
+    for(jr = 0; jr < nc; jr += nr){
+        size_t cols = (nc - jr < nr) ? nc - jr : nr;
+        for(t = 0; t < cols; ++t){
+            size_t q = j0 + jr + t;
+            ys[t] = (long)((q / j->out_w)*j->stride) - (long)j->pad;
+            xs[t] = (long)((q % j->out_w)*j->stride) - (long)j->pad;
+        }
+        for(p = p0; p < p0 + kc; ++p){
+            size_t ch = p / (j->size_y*j->size_x);
+            long y = (p / j->size_x) % j->size_y;
+            long x = p % j->size_x;
+            const float *imc = im + ch*h*w;
+            for(t = 0; t < cols; ++t){
+                long iy = ys[t] + y, ix = xs[t] + x;
+                bp[t] = (iy >= 0 && iy < h && ix >= 0 && ix < w) ? imc[iy*w + ix] : 0;
+            }
+            for(; t < nr; ++t) bp[t] = 0;
+            bp += nr;
         }
-        tensor_free(wx);
-        tensor_free(x_i);
     }
-    tensor b = tensor_vview(l->b, 4, 1, l->b.size[0], 1, 1);
-    tensor yb = tensor_add(y, b);
+}
+
+// Run a convolutional layer on input without lowering it
+// The patches are gathered by the GEMM as it packs its panels of B, so no
+// column matrix is ever stored, see conv_lowered_bytes for what that
+// saves. On the blocked backend the output is the same bit for bit as
+// forward_convolutional_layer's. The backward pass is shared with it.
+// layer l: pointer to layer to run
+// tensor x: input to layer
+// returns: the result of running the layer
+tensor forward_convolutional_layer_implicit(layer *l, tensor x)
+{
+    assert(x.n == 4);
+    assert(l->w.n == 4);
+    assert(x.size[1] == l->w.size[1]); // Same number of channels
 
-    tensor_free(y);
-    tensor_free(b);
-    tensor_free(w);
+    tensor_free(l->x);
+    l->x = tensor_ref(x);
+    assert(tensor_is_contiguous(x));
 
-    return yb;
+    size_t im_n = x.size[0];
+    size_t im_h = x.size[2];
+    size_t im_w = x.size[3];
+    size_t f_n = l->w.size[0];
+    size_t f_h = l->w.size[2];
+    size_t f_w = l->w.size[3];
+    size_t y_h = (im_h + 2*l->pad - f_h)/l->stride + 1;
+    size_t y_w = (im_w + 2*l->pad - f_w)/l->stride + 1;
+    tensor y = tensor_vempty(4, im_n, f_n, y_h, y_w);
+
+    size_t k = x.size[1]*f_h*f_w;
+    size_t out = y_h*y_w;
+    conv_pack_job j = {x.data, x.size[1], im_h, im_w, f_h, f_w, l->stride, l->pad, y_w};
+    gemm_implicit_batched(im_n, f_n, out, k, 1, l->w.data, k, 1, 0, conv_pack, &j,
+            0, y.data, out, 1, f_n*out);
+    size_t s;
+    for(s = 0; s < im_n; ++s){
+        float *ys = y.data + s*f_n*out;
+        conv_copy(ys, ys, l->b.data, 1, f_n, out, 1);
+    }
+    return y;
+}
+
+// Bytes of column matrix forward_convolutional_layer lowers at once for
+// input x, all of which the implicit forward pass goes without
+size_t conv_lowered_bytes(const layer *l, tensor x)
+{
+    assert(x.n == 4 && l->w.n == 4);
+    size_t y_h = (x.size[2] + 2*l->pad - l->w.size[2])/l->stride + 1;
+    size_t y_w = (x.size[3] + 2*l->pad - l->w.size[3])/l->stride + 1;
+    size_t k = l->w.size[1]*l->w.size[2]*l->w.size[3];
+    size_t out = y_h*y_w;
+    return k*conv_chunk(x.size[0], k*out)*out*sizeof(float);
 }
 
 // Run a convolutional layer backward
+// Chunks of the batch are lowered as in the forward pass, then dw takes
+// one multiply per chunk and so do its columns of dx
 // layer l: layer to run
 // matrix dy: dL/dy for this layer
 // returns: dL/dx for this layer
 tensor backward_convolutional_layer(layer *l, tensor dy)
 {
-    // Calculate dL/db
-    tensor db_1 = tensor_sum_dim(dy, 0);
-    tensor db_2 = tensor_sum_dim(db_1, 1);
-    tensor db = tensor_sum_dim(db_2, 1);
-    tensor_axpy_(1, db, l->db);
-    tensor_free(db_1);
-    tensor_free(db_2);
-    tensor_free(db);
+    // Calculate dL/db, summing dy over everything but the channels
+    size_t bias_axes[3] = {0, 2, 3};
+    tensor_sum_axes_(l->db, dy, 3, bias_axes);
+    assert(tensor_is_contiguous(dy));
 
     size_t f_n = l->w.size[0];
     size_t f_c = l->w.size[1];
@@ -176,42 +422,221 @@ tensor backward_convolutional_layer(layer *l, tensor dy)
     size_t f_w = l->w.size[3];
 
     tensor x = l->x;
-
     tensor dx = tensor_make(l->x.n, l->x.size);
-    tensor w = tensor_vview(l->w, 2, f_n, f_c*f_h*f_w);
-    tensor wt = matrix_transpose(w);
 
+    size_t im_n = x.size[0];
+    size_t im_c = x.size[1];
+    size_t im_h = x.size[2];
+    size_t im_w = x.size[3];
+    size_t k = f_c*f_h*f_w;
+    size_t out = dy.size[2]*dy.size[3];
+    size_t chunk = conv_chunk(im_n, k*out);
+    tensor cols = tensor_vmake_in(l->scratch, 2, k, chunk*out);
+    tensor dyc = tensor_vmake_in(l->scratch, 2, f_n, chunk > 1 ? chunk*out : 0);
+    const matrix_backend *be = matrix_backend_get();
+    conv_job j = {cols.data, 0, 0, im_c, im_h, im_w, f_h, f_w, l->stride, l->pad, out};
+    size_t s;
+    for(s = 0; s < im_n; s += chunk){
+        size_t nb = (im_n - s < chunk) ? im_n - s : chunk;
+        size_t len = nb*out;
+        float *dys = dy.data + s*f_n*out;
+        float *d = dys;
+        if(nb > 1){
+            d = dyc.data;
+            conv_copy(dys, d, 0, nb, f_n, out, 0);
+        }
+        j.ld = len;
+        j.im = x.data + s*im_c*im_h*im_w;
+        parallel_for(nb*im_c, 1, im2col_part, &j);
+
+        // Calculate dL/dw, the whole chunk accumulating straight into l->dw
+        be->gemm(1, f_n, k, len, 1, d, len, 1, 0, cols.data, 1, len, 0,
+                1, l->dw.data, k, 1, 0);
+
+        // Calculate dL/dx, the columns are done with so they hold w^T*dy
+        be->gemm(1, k, len, f_n, 1, l->w.data, 1, k, 0, d, len, 1, 0,
+                0, cols.data, len, 1, 0);
+        j.im = dx.data + s*im_c*im_h*im_w;
+        parallel_for(nb*im_c, 1, col2im_part, &j);
+    }
+
+    tensor_free(cols);
+    tensor_free(dyc);
+    return dx;
+}
+
+// Whether a layer is a 1x1 convolution at stride 1 without padding, whose
+// images are their own column matrices
+int conv_1x1_fits(const layer *l)
+{
+    return l->w.size[2] == 1 && l->w.size[3] == 1 && l->stride == 1 && l->pad == 0;
+}
+
+// Run a 1x1 convolutional layer on input
+// Each (c, h*w) image is already the B of its multiply, so the whole batch
+// is one batched GEMM sharing the weights, with nothing lowered
+// Other shapes fall back to forward_convolutional_layer
+// layer l: pointer to layer to run
+// tensor x: input to layer
+// returns: the result of running the layer
+tensor forward_convolutional_layer_1x1(layer *l, tensor x)
+{
+    if(!conv_1x1_fits(l)) return forward_convolutional_layer(l, x);
+    assert(x.n == 4);
+    assert(x.size[1] == l->w.size[1]); // Same number of channels
+
+    tensor_free(l->x);
+    l->x = tensor_ref(x);
+    assert(tensor_is_contiguous(x));
+
+    size_t im_n = x.size[0];
+    size_t im_c = x.size[1];
+    size_t out = x.size[2]*x.size[3];
+    size_t y_c = l->w.size[0];
+    tensor y = tensor_vempty(4, im_n, y_c, x.size[2], x.size[3]);
+
+    matrix_backend_get()->gemm(im_n, y_c, out, im_c, 1, l->w.data, im_c, 1, 0,
+            x.data, out, 1, im_c*out, 0, y.data, out, 1, y_c*out);
+    size_t i;
+    for(i = 0; i < im_n; ++i){
+        float *yi = y.data + i*y_c*out;
+        conv_copy(yi, yi, l->b.data, 1, y_c, out, 1);
+    }
+    return y;
+}
+
+// Run a 1x1 convolutional layer backward
+// dx is one batched multiply by w^T, dw takes one multiply per image
+// accumulating into l->dw
+// Other shapes fall back to backward_convolutional_layer
+// layer l: layer to run
+// matrix dy: dL/dy for this layer
+// returns: dL/dx for this layer
+tensor backward_convolutional_layer_1x1(layer *l, tensor dy)
+{
+    if(!conv_1x1_fits(l)) return backward_convolutional_layer(l, dy);
+    size_t bias_axes[3] = {0, 2, 3};
+    tensor_sum_axes_(l->db, dy, 3, bias_axes);
+    assert(tensor_is_contiguous(dy));
+
+    tensor x = l->x;
+    tensor dx = tensor_empty(x.n, x.size);
+    size_t im_n = x.size[0];
+    size_t im_c = x.size[1];
+    size_t out = x.size[2]*x.size[3];
+    size_t f_n = l->w.size[0];
+    const matrix_backend *be = matrix_backend_get();
+
+    // Calculate dL/dw, dy_i*x_i^T for every image
     size_t i;
-    for(i = 0; i < x.size[0]; ++i){
-        tensor x_i = im2col(tensor_get_(x, i), f_h, f_w, l->stride, l->pad);
-        tensor dy_i = tensor_get_(dy, i);
-        size_t tmp_size[2];
-        tmp_size[0] = dy.size[1];
-        tmp_size[1] = dy.size[2]*dy.size[3];
-        dy_i.n = 2;
-        dy_i.size = tmp_size;
-
-        // Calculate dL/dw
-        tensor xt = matrix_transpose(x_i);
-        tensor dw = matrix_multiply(dy_i, xt);
-        tensor_axpy_(1, dw, l->dw);
-
-        // Calculate dL/dx
-        tensor col = matrix_multiply(wt, dy_i);
-        tensor dx_i = col2im(col, x.size[1], x.size[2], x.size[3], f_h, f_w, l->stride, l->pad);
-        memcpy(dx.data + i*tensor_len(dx_i), dx_i.data, tensor_len(dx_i) * sizeof(float));
-
-        tensor_free(x_i);
-        tensor_free(xt);
-        tensor_free(dw);
-        tensor_free(col);
-        tensor_free(dx_i);
+    for(i = 0; i < im_n; ++i){
+        be->gemm(1, f_n, im_c, out, 1, dy.data + i*f_n*out, out, 1, 0,
+                x.data + i*im_c*out, 1, out, 0, 1, l->dw.data, im_c, 1, 0);
     }
-    tensor_free(wt);
-    tensor_free(w);
+
+    // Calculate dL/dx, w^T*dy_i for every image
+    be->gemm(im_n, im_c, out, f_n, 1, l->w.data, 1, im_c, 0,
+            dy.data, out, 1, f_n*out, 0, dx.data, out, 1, im_c*out);
     return dx;
 }
 
+// Whether a layer can run through its Winograd engine, 3x3 stride 1
+int conv_winograd_fits(const layer *l)
+{
+    return l->wg && winograd_fits(l->w, l->stride);
+}
+
+// Run a convolutional layer on input with Winograd, see winograd_forward
+// Other shapes fall back to forward_convolutional_layer
+// layer l: pointer to layer to run
+// tensor x: input to layer
+// returns: the result of running the layer
+tensor forward_convolutional_layer_winograd(layer *l, tensor x)
+{
+    if(!conv_winograd_fits(l)) return forward_convolutional_layer(l, x);
+    assert(x.n == 4);
+    assert(x.size[1] == l->w.size[1]); // Same number of channels
+
+    tensor_free(l->x);
+    l->x = tensor_ref(x);
+    assert(tensor_is_contiguous(x));
+
+    size_t im_n = x.size[0];
+    size_t im_c = x.size[1];
+    size_t im_h = x.size[2];
+    size_t im_w = x.size[3];
+    size_t y_c = l->w.size[0];
+    size_t out = (im_h + 2*l->pad - 2)*(im_w + 2*l->pad - 2);
+    tensor y = tensor_vempty(4, im_n, y_c, im_h + 2*l->pad - 2, im_w + 2*l->pad - 2);
+
+    size_t chunk = conv_chunk(im_n, winograd_floats(l->wg, l->w, im_h, im_w, l->pad));
+    size_t s, i;
+    for(s = 0; s < im_n; s += chunk){
+        size_t nb = (im_n - s < chunk) ? im_n - s : chunk;
+        float *ys = y.data + s*y_c*out;
+        winograd_forward(l->wg, l->w, x.data + s*im_c*im_h*im_w, nb, im_h, im_w, l->pad,
+                ys, l->scratch);
+        for(i = 0; i < nb; ++i){
+            conv_copy(ys + i*y_c*out, ys + i*y_c*out, l->b.data, 1, y_c, out, 1);
+        }
+    }
+    return y;
+}
+
+// Run a convolutional layer backward with Winograd, see winograd_backward
+// Other shapes fall back to backward_convolutional_layer
+// layer l: layer to run
+// matrix dy: dL/dy for this layer
+// returns: dL/dx for this layer
+tensor backward_convolutional_layer_winograd(layer *l, tensor dy)
+{
+    if(!conv_winograd_fits(l)) return backward_convolutional_layer(l, dy);
+    size_t bias_axes[3] = {0, 2, 3};
+    tensor_sum_axes_(l->db, dy, 3, bias_axes);
+    assert(tensor_is_contiguous(dy));
+    assert(tensor_is_contiguous(l->dw));
+
+    tensor x = l->x;
+    tensor dx = tensor_make(x.n, x.size);
+    size_t im_n = x.size[0];
+    size_t im_c = x.size[1];
+    size_t im_h = x.size[2];
+    size_t im_w = x.size[3];
+    size_t f_n = l->w.size[0];
+    size_t out = dy.size[2]*dy.size[3];
+
+    size_t chunk = conv_chunk(im_n, winograd_floats(l->wg, l->w, im_h, im_w, l->pad));
+    size_t s;
+    for(s = 0; s < im_n; s += chunk){
+        size_t nb = (im_n - s < chunk) ? im_n - s : chunk;
+        winograd_backward(l->wg, l->w, x.data + s*im_c*im_h*im_w, dy.data + s*f_n*out,
+                nb, im_h, im_w, l->pad, dx.data + s*im_c*im_h*im_w, l->dw.data, l->scratch);
+    }
+    return dx;
+}
+
+// Pick how a convolutional layer runs forward
+// int implicit: 1 to gather patches inside the GEMM, 0 to lower with im2col
+void conv_set_implicit(layer *l, int implicit)
+{
+    free_winograd(l->wg);
+    l->wg = 0;
+    l->forward = implicit ? forward_convolutional_layer_implicit : forward_convolutional_layer;
+    l->backward = backward_convolutional_layer;
+}
+
+// Run a convolutional layer with Winograd F(m x m, 3 x 3) when its filters
+// are 3x3 at stride 1, lowering with im2col otherwise
+// size_t m: output tile size, 2 or 4, or 0 to always lower with im2col.
+// F(2x2) is the more accurate, F(4x4) does fewer multiplies.
+void conv_set_winograd(layer *l, size_t m)
+{
+    free_winograd(l->wg);
+    l->wg = m ? make_winograd(m) : 0;
+    l->forward = m ? forward_convolutional_layer_winograd : forward_convolutional_layer;
+    l->backward = m ? backward_convolutional_layer_winograd : backward_convolutional_layer;
+}
+
 // Update convolutional layer
 // layer l: layer to update
 // float rate: learning rate
@@ -221,28 +646,32 @@ void update_convolutional_layer(layer *l, float rate, float momentum, float deca
 {
     // TODO: 5.3
     // Copy-pasted from update_connected_layer in connected_layer.c
-    l->dw = tensor_add(l->dw, tensor_scale(decay, l->w));
+    // w and b are updated in place, make sure no one else is looking at them
+    tensor_unshare(&l->w);
+    tensor_unshare(&l->b);
+
+    tensor_axpy_(decay, l->w, l->dw);
     
     /*
         w = w - rate * dw
     */
-    l->w = tensor_sub(l->w, tensor_scale(rate, l->dw));
+    tensor_axpy_(-rate, l->dw, l->w);
     
     /*
         l.dw = momentum * update
     */
-    l->dw = tensor_scale(momentum, l->dw);
+    tensor_scale_(momentum, l->dw);
 
     // Do the same for biases as well but no need to use weight decay on biases
     /*
         b = b - (rate * db)
     */
-    l->b = tensor_sub(l->b, tensor_scale(rate, l->db));
+    tensor_axpy_(-rate, l->db, l->b);
     
     /*
         db = momentum * update 
     */
-    l->db = tensor_scale(momentum, l->db);
+    tensor_scale_(momentum, l->db);
 }
 
 // Make a new convolutional layer
@@ -251,6 +680,8 @@ void update_convolutional_layer(layer *l, float rate, float momentum, float deca
 // int c: number of channels
 // int size: size of convolutional filter to apply
 // int stride: stride of operation
+// 3x3 stride 1 layers run with Winograd F(4x4, 3x3), see conv_set_winograd,
+// and 1x1 stride 1 layers without padding multiply their input directly
 
 layer make_convolutional_layer(size_t c, size_t n, size_t size, size_t stride, size_t pad)
 {
@@ -265,6 +696,11 @@ layer make_convolutional_layer(size_t c, size_t n, size_t size, size_t stride, s
     l.forward  = forward_convolutional_layer;
     l.backward = backward_convolutional_layer;
     l.update   = update_convolutional_layer;
+    if(size == 3 && stride == 1) conv_set_winograd(&l, 4);
+    if(size == 1 && stride == 1 && pad == 0){
+        l.forward  = forward_convolutional_layer_1x1;
+        l.backward = backward_convolutional_layer_1x1;
+    }
     return l;
 }
 
@@ -39,6 +39,37 @@ data random_batch(data d, int n)
     return c;
 }
 
+// Examples start..start+n of a dataset, in order
+// data d: dataset to take them from
+// size_t start: first example
+// int n: number of examples, fewer if the dataset ends first
+// returns: copy of the examples
+data get_batch(data d, size_t start, int n)
+{
+    if(start + n > d.x.size[0]) n = d.x.size[0] - start;
+    size_t *sx = calloc(d.x.n, sizeof(size_t));
+    memcpy(sx, d.x.size, d.x.n*sizeof(size_t));
+    sx[0] = n;
+
+    size_t *sy = calloc(d.y.n, sizeof(size_t));
+    memcpy(sy, d.y.size, d.y.n*sizeof(size_t));
+    sy[0] = n;
+
+    tensor x = tensor_make(d.x.n, sx);
+    tensor y = tensor_make(d.y.n, sy);
+    size_t i;
+    for(i = 0; i < n; ++i){
+        tensor_axpy_(1, tensor_get_(d.x, start + i), tensor_get_(x, i));
+        tensor_axpy_(1, tensor_get_(d.y, start + i), tensor_get_(y, i));
+    }
+    data c;
+    c.x = x;
+    c.y = y;
+    free(sx);
+    free(sy);
+    return c;
+}
+
 list *get_lines(char *filename)
 {
     char *path;
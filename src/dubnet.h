@@ -33,11 +33,27 @@ typedef struct layer {
     tensor  (*forward)  (struct layer *, struct tensor);
     tensor  (*backward) (struct layer *, struct tensor);
     void   (*update)   (struct layer *, float rate, float momentum, float decay);
+
+    // Optional arena for temporaries that only live for one iteration
+    arena *scratch;
+
+    // Nonzeros of w^T once a connected layer is pruned
+    struct sparse_matrix *sw;
+
+    // Transformed filters of a convolutional layer running Winograd
+    struct winograd *wg;
 } layer;
 
 layer make_connected_layer(int inputs, int outputs);
+tensor forward_connected_layer(layer *l, tensor x);
+tensor forward_sparse_connected_layer(layer *l, tensor x);
+void prune_connected_layer(layer *l, float sparsity);
 layer make_activation_layer(ACTIVATION activation);
 layer make_convolutional_layer(size_t c, size_t n, size_t size, size_t stride, size_t pad);
+void conv_set_workspace(size_t floats);
+void conv_set_implicit(layer *l, int implicit);
+void conv_set_winograd(layer *l, size_t m);
+size_t conv_lowered_bytes(const layer *l, tensor x);
 layer make_maxpool_layer(size_t size, size_t stride);
 layer make_batchnorm2d_layer(int c);
 
@@ -51,6 +67,7 @@ void backward_net(net m, tensor d);
 void update_net(net m, float rate, float momentum, float decay);
 void free_layer(layer l);
 void free_net(net n);
+net compress_connected_layer(net m, int i, size_t rank, float energy);
 
 
 typedef struct{
@@ -59,14 +76,18 @@ typedef struct{
 } data;
 
 data random_batch(data d, int n);
+data get_batch(data d, size_t start, int n);
 data load_image_classification_data(char *images, char *label_file);
 void free_data(data d);
 void train_image_classifier(net m, data d, int batch, int iters, float rate, float momentum, float decay);
+int fit_final_layer(net m, data d, int batch, float lambda);
 float accuracy_net(net m, data d);
 tensor image_to_tensor(image im);
 
 tensor im2col(tensor im, size_t size_y, size_t size_x, size_t stride, size_t pad);
+void im2col_into(tensor col, tensor im, size_t size_y, size_t size_x, size_t stride, size_t pad);
 tensor col2im(tensor col, size_t c, size_t h, size_t w, size_t size_y, size_t size_x, size_t stride, size_t pad);
+void col2im_into(tensor im, tensor col, size_t size_y, size_t size_x, size_t stride, size_t pad);
 
 
 tensor mean2d(tensor x);
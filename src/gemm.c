@@ -0,0 +1,522 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "gemm.h"
+#include "simd.h"
+#include "pool.h"
+#include "parallel.h"
+#include "tune.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_X86
+#endif
+
+// Largest micro-tile of any kernel, for the edge tile buffer
+#define GEMM_TILE_MAX (6*GEMM_NR_MAX)
+
+// A micro-kernel computes one mr x nr tile of C from a packed panel of A
+// (mr values per step of k) and a packed panel of B (nr values per step):
+// C = alpha*A*B + beta*C with C row-major at leading dimension ldc
+typedef struct gemm_kernel {
+    const char *name;
+    ISA isa;
+    size_t mr;
+    size_t nr;
+    void (*micro)(size_t k, float alpha, const float *a, const float *b,
+            float beta, float *c, size_t ldc);
+} gemm_kernel;
+
+// Smallest multiply, in multiply-adds, worth giving its own thread
+#define GEMM_WORK_PER_THREAD (1 << 20)
+
+static gemm_blocking gemm_block = {240, 256, 4096};
+// Kernel picked by the tuner, 0 to follow the instruction set
+static const struct gemm_kernel *gemm_tuned = 0;
+static gemm_observer gemm_watch = 0;
+static void *gemm_watch_ctx = 0;
+static pthread_once_t gemm_once = PTHREAD_ONCE_INIT;
+
+void gemm_micro_scalar(size_t k, float alpha, const float *a, const float *b,
+        float beta, float *c, size_t ldc)
+{
+    float acc[4][8] = {{0}};
+    size_t i, j, p;
+    for(p = 0; p < k; ++p){
+        for(i = 0; i < 4; ++i){
+            for(j = 0; j < 8; ++j){
+                acc[i][j] += a[i]*b[j];
+            }
+        }
+        a += 4;
+        b += 8;
+    }
+    for(i = 0; i < 4; ++i){
+        for(j = 0; j < 8; ++j){
+            float v = alpha*acc[i][j];
+            c[i*ldc + j] = (beta == 0) ? v : v + beta*c[i*ldc + j];
+        }
+    }
+}
+
+static const gemm_kernel gemm_scalar = {"scalar 4x8", ISA_SCALAR, 4, 8, gemm_micro_scalar};
+
+#ifdef GEMM_X86
+#define AVX2 __attribute__((target("avx2,fma")))
+#define AVX512 __attribute__((target("avx512f")))
+
+// One row of the tile: broadcast a[i] against the two vectors of B
+#define GEMM_FMA_ROW(SET1, FMA, i) \
+    { VEC ai = SET1(a[i]); \
+      c##i##0 = FMA(ai, b0, c##i##0); \
+      c##i##1 = FMA(ai, b1, c##i##1); }
+
+#define GEMM_STORE_ROW(W, LOADU, STOREU, MUL, FMA, i) \
+    { float *ci = c + i*ldc; \
+      VEC r0 = MUL(va, c##i##0), r1 = MUL(va, c##i##1); \
+      if(beta != 0){ \
+          r0 = FMA(vb, LOADU(ci), r0); \
+          r1 = FMA(vb, LOADU(ci + W), r1); \
+      } \
+      STOREU(ci, r0); \
+      STOREU(ci + W, r1); }
+
+// 6 x 2W tile held in 12 vector registers
+#define GEMM_MICRO_6(W, ZERO, LOAD, LOADU, STOREU, SET1, MUL, FMA) do { \
+    VEC c00 = ZERO(), c01 = ZERO(), c10 = ZERO(), c11 = ZERO(); \
+    VEC c20 = ZERO(), c21 = ZERO(), c30 = ZERO(), c31 = ZERO(); \
+    VEC c40 = ZERO(), c41 = ZERO(), c50 = ZERO(), c51 = ZERO(); \
+    size_t p; \
+    for(p = 0; p < k; ++p){ \
+        VEC b0 = LOAD(b), b1 = LOAD(b + W); \
+        GEMM_FMA_ROW(SET1, FMA, 0) GEMM_FMA_ROW(SET1, FMA, 1) \
+        GEMM_FMA_ROW(SET1, FMA, 2) GEMM_FMA_ROW(SET1, FMA, 3) \
+        GEMM_FMA_ROW(SET1, FMA, 4) GEMM_FMA_ROW(SET1, FMA, 5) \
+        a += 6; \
+        b += 2*W; \
+    } \
+    VEC va = SET1(alpha), vb = SET1(beta); \
+    GEMM_STORE_ROW(W, LOADU, STOREU, MUL, FMA, 0) GEMM_STORE_ROW(W, LOADU, STOREU, MUL, FMA, 1) \
+    GEMM_STORE_ROW(W, LOADU, STOREU, MUL, FMA, 2) GEMM_STORE_ROW(W, LOADU, STOREU, MUL, FMA, 3) \
+    GEMM_STORE_ROW(W, LOADU, STOREU, MUL, FMA, 4) GEMM_STORE_ROW(W, LOADU, STOREU, MUL, FMA, 5) \
+} while(0)
+
+AVX2 void gemm_micro_avx2(size_t k, float alpha, const float *a, const float *b,
+        float beta, float *c, size_t ldc)
+{
+#define VEC __m256
+    GEMM_MICRO_6(8, _mm256_setzero_ps, _mm256_load_ps, _mm256_loadu_ps, _mm256_storeu_ps,
+            _mm256_set1_ps, _mm256_mul_ps, _mm256_fmadd_ps);
+#undef VEC
+}
+
+AVX512 void gemm_micro_avx512(size_t k, float alpha, const float *a, const float *b,
+        float beta, float *c, size_t ldc)
+{
+#define VEC __m512
+    GEMM_MICRO_6(16, _mm512_setzero_ps, _mm512_load_ps, _mm512_loadu_ps, _mm512_storeu_ps,
+            _mm512_set1_ps, _mm512_mul_ps, _mm512_fmadd_ps);
+#undef VEC
+}
+
+static const gemm_kernel gemm_avx2 = {"avx2 6x16", ISA_AVX2, 6, 16, gemm_micro_avx2};
+static const gemm_kernel gemm_avx512 = {"avx512 6x32", ISA_AVX512, 6, 32, gemm_micro_avx512};
+#endif
+
+static const gemm_kernel *gemm_kernels[] = {
+    &gemm_scalar,
+#ifdef GEMM_X86
+    &gemm_avx2,
+    &gemm_avx512,
+#endif
+};
+#define GEMM_NKERNELS (sizeof(gemm_kernels)/sizeof(gemm_kernels[0]))
+
+const gemm_kernel *gemm_find_kernel(const char *name)
+{
+    size_t i;
+    for(i = 0; i < GEMM_NKERNELS; ++i){
+        if(0 == strcmp(gemm_kernels[i]->name, name)) return gemm_kernels[i];
+    }
+    return 0;
+}
+
+// Pick up the tuning cache, if there is one for this cpu
+void gemm_init()
+{
+    gemm_tuning t;
+    if(!tune_load(tune_cache_path(), &t)) return;
+    const gemm_kernel *k = gemm_find_kernel(t.kernel);
+    if(k && k->isa <= simd()->isa) gemm_tuned = k;
+    if(t.blocking.mc && t.blocking.kc && t.blocking.nc) gemm_block = t.blocking;
+}
+
+// Micro-kernel for the instruction set the elementwise kernels use
+// The tuned kernel wins unless the instruction set was turned down below it
+const gemm_kernel *gemm_current()
+{
+    pthread_once(&gemm_once, gemm_init);
+    ISA isa = simd()->isa;
+    if(gemm_tuned && gemm_tuned->isa <= isa) return gemm_tuned;
+#ifdef GEMM_X86
+    if(isa == ISA_AVX512) return &gemm_avx512;
+    if(isa == ISA_AVX2) return &gemm_avx2;
+#endif
+    return &gemm_scalar;
+}
+
+const char *gemm_kernel_name()
+{
+    return gemm_current()->name;
+}
+
+// Name of the i-th micro-kernel the current instruction set can run,
+// which DUBNET_ISA may have turned down below the cpu's
+// returns: kernel name, 0 past the last one
+const char *gemm_kernel_list(size_t i)
+{
+    size_t j;
+    ISA best = simd()->isa;
+    for(j = 0; j < GEMM_NKERNELS; ++j){
+        if(gemm_kernels[j]->isa > best) continue;
+        if(i-- == 0) return gemm_kernels[j]->name;
+    }
+    return 0;
+}
+
+// Use a micro-kernel by name instead of the one for the instruction set
+// const char *name: kernel from gemm_kernel_list, 0 to go back to the default
+// returns: 1 on success, 0 if there is no such kernel for the instruction set
+int gemm_set_kernel(const char *name)
+{
+    pthread_once(&gemm_once, gemm_init);
+    if(!name){
+        gemm_tuned = 0;
+        return 1;
+    }
+    const gemm_kernel *k = gemm_find_kernel(name);
+    if(!k || k->isa > simd()->isa) return 0;
+    gemm_tuned = k;
+    return 1;
+}
+
+gemm_blocking gemm_get_blocking()
+{
+    pthread_once(&gemm_once, gemm_init);
+    return gemm_block;
+}
+
+// Change the cache blocking, e.g. from the tuner
+// Sizes are rounded to whole micro-panels when they are used
+void gemm_set_blocking(gemm_blocking b)
+{
+    assert(b.mc > 0 && b.kc > 0 && b.nc > 0);
+    pthread_once(&gemm_once, gemm_init);
+    gemm_block = b;
+}
+
+// Have fn called with the shape of every multiply from now on, e.g. to
+// find out which shapes a net runs. 0 stops watching.
+void gemm_set_observer(gemm_observer fn, void *ctx)
+{
+    gemm_watch = fn;
+    gemm_watch_ctx = ctx;
+}
+
+// Pack an mc x kc block of A into panels of mr rows, step by step along k
+// The last panel is padded with zeros so the kernel never sees a ragged edge
+void gemm_pack_a(size_t mc, size_t kc, size_t mr, const float *a, size_t rsa, size_t csa, float *ap)
+{
+    size_t i, p, ir;
+    for(ir = 0; ir < mc; ir += mr){
+        size_t rows = (mc - ir < mr) ? mc - ir : mr;
+        const float *ar = a + ir*rsa;
+        if(csa == 1){
+            // row-major A: read each row once and scatter it into the panel
+            for(i = 0; i < rows; ++i){
+                for(p = 0; p < kc; ++p) ap[p*mr + i] = ar[i*rsa + p];
+            }
+            for(; i < mr; ++i){
+                for(p = 0; p < kc; ++p) ap[p*mr + i] = 0;
+            }
+            ap += mr*kc;
+            continue;
+        }
+        for(p = 0; p < kc; ++p){
+            for(i = 0; i < rows; ++i) ap[i] = ar[i*rsa + p*csa];
+            for(; i < mr; ++i) ap[i] = 0;
+            ap += mr;
+        }
+    }
+}
+
+// Pack a kc x nc panel of B into panels of nr columns, step by step along k
+void gemm_pack_b(size_t kc, size_t nc, size_t nr, const float *b, size_t rsb, size_t csb, float *bp)
+{
+    size_t j, p, jr;
+    for(jr = 0; jr < nc; jr += nr){
+        size_t cols = (nc - jr < nr) ? nc - jr : nr;
+        const float *bc = b + jr*csb;
+        for(p = 0; p < kc; ++p){
+            const float *row = bc + p*rsb;
+            if(csb == 1){
+                memcpy(bp, row, cols*sizeof(float));
+                j = cols;
+            } else {
+                for(j = 0; j < cols; ++j) bp[j] = row[j*csb];
+            }
+            for(; j < nr; ++j) bp[j] = 0;
+            bp += nr;
+        }
+    }
+}
+
+// Multiply a packed block of A by a packed panel of B into C
+// Full tiles of a row-major C go straight to the micro-kernel, edge tiles
+// and other layouts go through a small buffer
+void gemm_macro(const gemm_kernel *kern, size_t mc, size_t nc, size_t kc, float alpha,
+        const float *ap, const float *bp, float beta, float *c, size_t rsc, size_t csc)
+{
+    float tile[GEMM_TILE_MAX] __attribute__((aligned(64)));
+    size_t mr = kern->mr;
+    size_t nr = kern->nr;
+    size_t ir, jr, i, j;
+    for(jr = 0; jr < nc; jr += nr){
+        size_t cols = (nc - jr < nr) ? nc - jr : nr;
+        for(ir = 0; ir < mc; ir += mr){
+            size_t rows = (mc - ir < mr) ? mc - ir : mr;
+            const float *a = ap + ir*kc;
+            const float *b = bp + jr*kc;
+            float *ct = c + ir*rsc + jr*csc;
+            if(rows == mr && cols == nr && csc == 1){
+                kern->micro(kc, alpha, a, b, beta, ct, rsc);
+                continue;
+            }
+            kern->micro(kc, 1, a, b, 0, tile, nr);
+            for(i = 0; i < rows; ++i){
+                for(j = 0; j < cols; ++j){
+                    float *cij = ct + i*rsc + j*csc;
+                    float v = alpha*tile[i*nr + j];
+                    *cij = (beta == 0) ? v : v + beta*(*cij);
+                }
+            }
+        }
+    }
+}
+
+// C = beta*C, without reading C when beta is 0
+void gemm_scale_c(size_t m, size_t n, float beta, float *c, size_t rsc, size_t csc)
+{
+    size_t i, j;
+    for(i = 0; i < m; ++i){
+        for(j = 0; j < n; ++j){
+            float *cij = c + i*rsc + j*csc;
+            *cij = (beta == 0) ? 0 : beta*(*cij);
+        }
+    }
+}
+
+// Where the B of a multiply comes from: a strided matrix, or a packer
+// that makes up operand i of an implicit batch panel by panel
+typedef struct gemm_b {
+    const float *b;
+    size_t rsb, csb;
+    gemm_packer pack;
+    void *ctx;
+    size_t i;
+} gemm_b;
+
+// Pack rows p0.. and columns j0.. of B, see gemm_pack_b
+void gemm_pack_from(const gemm_b *src, size_t p0, size_t kc, size_t j0, size_t nc, size_t nr, float *bp)
+{
+    if(src->pack){
+        src->pack(src->ctx, src->i, p0, kc, j0, nc, nr, bp);
+    } else {
+        gemm_pack_b(kc, nc, nr, src->b + p0*src->rsb + j0*src->csb, src->rsb, src->csb, bp);
+    }
+}
+
+// Single-threaded GEMM on one piece of C, the columns from j0 onwards of B
+// see gemm_strided
+void gemm_serial(const gemm_kernel *kern, size_t m, size_t n, size_t k, float alpha,
+        const float *a, size_t rsa, size_t csa, const gemm_b *b, size_t j0,
+        float beta, float *c, size_t rsc, size_t csc)
+{
+    size_t mr = kern->mr;
+    size_t nr = kern->nr;
+
+    // Blocks are whole micro-panels and no bigger than the problem
+    size_t mc = gemm_block.mc/mr*mr;
+    size_t nc = gemm_block.nc/nr*nr;
+    size_t kc = gemm_block.kc;
+    if(mc == 0) mc = mr;
+    if(nc == 0) nc = nr;
+    if(mc > (m + mr - 1)/mr*mr) mc = (m + mr - 1)/mr*mr;
+    if(nc > (n + nr - 1)/nr*nr) nc = (n + nr - 1)/nr*nr;
+    if(kc > k) kc = k;
+
+    float *ap = pool_alloc(mc*kc*sizeof(float));
+    float *bp = pool_alloc(kc*nc*sizeof(float));
+    size_t ic, jc, pc;
+    for(jc = 0; jc < n; jc += nc){
+        size_t ncb = (n - jc < nc) ? n - jc : nc;
+        for(pc = 0; pc < k; pc += kc){
+            size_t kcb = (k - pc < kc) ? k - pc : kc;
+            // only the first pass over k applies beta, the rest accumulate
+            float betab = (pc == 0) ? beta : 1;
+            gemm_pack_from(b, pc, kcb, j0 + jc, ncb, nr, bp);
+            for(ic = 0; ic < m; ic += mc){
+                size_t mcb = (m - ic < mc) ? m - ic : mc;
+                gemm_pack_a(mcb, kcb, mr, a + ic*rsa + pc*csa, rsa, csa, ap);
+                gemm_macro(kern, mcb, ncb, kcb, alpha, ap, bp, betab,
+                        c + ic*rsc + jc*csc, rsc, csc);
+            }
+        }
+    }
+    pool_free(ap, mc*kc*sizeof(float));
+    pool_free(bp, kc*nc*sizeof(float));
+}
+
+// Pieces of C for the threads: every multiply of the batch is cut into the
+// same grid along M and N, and the pieces of all of them are shared out
+typedef struct gemm_job {
+    const gemm_kernel *kern;
+    size_t m, n, k;
+    float alpha, beta;
+    const float *a;
+    const float *b;
+    float *c;
+    size_t rsa, csa, rsb, csb, rsc, csc;
+    size_t sa, sb, sc;  // distance between operands of the batch
+    size_t tn;          // pieces along N
+    size_t mstep;       // rows per piece
+    size_t nstep;       // columns per piece
+    size_t per;         // pieces per multiply
+    gemm_packer pack;   // makes up B instead when set
+    void *pctx;
+} gemm_job;
+
+void gemm_part(void *ctx, size_t start, size_t end)
+{
+    gemm_job *j = ctx;
+    size_t t;
+    for(t = start; t < end; ++t){
+        size_t bi = t / j->per;
+        size_t p = t % j->per;
+        size_t i0 = (p / j->tn)*j->mstep;
+        size_t j0 = (p % j->tn)*j->nstep;
+        if(i0 >= j->m || j0 >= j->n) continue;
+        size_t mi = (j->m - i0 < j->mstep) ? j->m - i0 : j->mstep;
+        size_t nj = (j->n - j0 < j->nstep) ? j->n - j0 : j->nstep;
+        gemm_b b = {j->b + bi*j->sb, j->rsb, j->csb, j->pack, j->pctx, bi};
+        gemm_serial(j->kern, mi, nj, j->k, j->alpha,
+                j->a + bi*j->sa + i0*j->rsa, j->rsa, j->csa, &b, j0,
+                j->beta, j->c + bi*j->sc + i0*j->rsc + j0*j->csc, j->rsc, j->csc);
+    }
+}
+
+// Cut C into a tm x tn grid of pieces, one per thread
+// Picks the grid whose pieces are closest to square, with at least one
+// micro-tile each way, dropping threads if no grid fits
+// returns: number of pieces, tm*tn
+size_t gemm_grid(size_t m, size_t n, size_t threads, size_t mr, size_t nr, size_t *tm, size_t *tn)
+{
+    size_t tiles_m = (m + mr - 1)/mr;
+    size_t tiles_n = (n + nr - 1)/nr;
+    for(; threads > 1; --threads){
+        size_t t;
+        double best = -1;
+        for(t = 1; t <= threads; ++t){
+            size_t u = threads/t;
+            if(t*u != threads || t > tiles_m || u > tiles_n) continue;
+            double d = (double)m/t - (double)n/u;
+            if(d < 0) d = -d;
+            if(best < 0 || d < best){
+                best = d;
+                *tm = t;
+                *tn = u;
+            }
+        }
+        if(best >= 0) return threads;
+    }
+    *tm = *tn = 1;
+    return 1;
+}
+
+// Number of threads worth using for an m x n x k multiply
+size_t gemm_threads(size_t m, size_t n, size_t k)
+{
+    size_t work = m*n*k/GEMM_WORK_PER_THREAD;
+    size_t threads = parallel_threads();
+    if(work < threads) threads = work;
+    return threads ? threads : 1;
+}
+
+// Shared by the strided and implicit multiplies, B comes from pack when set
+void gemm_run(size_t batch, size_t m, size_t n, size_t k, float alpha,
+        const float *a, size_t rsa, size_t csa, size_t sa,
+        const float *b, size_t rsb, size_t csb, size_t sb,
+        gemm_packer pack, void *pctx,
+        float beta, float *c, size_t rsc, size_t csc, size_t sc)
+{
+    size_t i;
+    if(gemm_watch) gemm_watch(gemm_watch_ctx, batch, m, n, k);
+    if(batch == 0 || m == 0 || n == 0) return;
+    if(k == 0 || alpha == 0){
+        for(i = 0; i < batch; ++i) gemm_scale_c(m, n, beta, c + i*sc, rsc, csc);
+        return;
+    }
+    const gemm_kernel *kern = gemm_current();
+    assert(kern->nr <= GEMM_NR_MAX);
+    size_t threads = gemm_threads(batch*m, n, k);
+    if(threads == 1){
+        for(i = 0; i < batch; ++i){
+            gemm_b bi = {b + i*sb, rsb, csb, pack, pctx, i};
+            gemm_serial(kern, m, n, k, alpha, a + i*sa, rsa, csa, &bi, 0,
+                    beta, c + i*sc, rsc, csc);
+        }
+        return;
+    }
+    // a batch at least as big as the pool is split by multiply alone,
+    // a smaller one also cuts each multiply so every thread gets a piece
+    size_t tm = 1, tn = 1;
+    size_t per = 1;
+    if(batch < threads) per = gemm_grid(m, n, (threads + batch - 1)/batch, kern->mr, kern->nr, &tm, &tn);
+
+    // pieces are whole micro-tiles so only the last row and column have edges
+    gemm_job j = {kern, m, n, k, alpha, beta, a, b, c, rsa, csa, rsb, csb, rsc, csc, sa, sb, sc, tn};
+    j.mstep = ((m + tm - 1)/tm + kern->mr - 1)/kern->mr*kern->mr;
+    j.nstep = ((n + tn - 1)/tn + kern->nr - 1)/kern->nr*kern->nr;
+    j.per = per;
+    j.pack = pack;
+    j.pctx = pctx;
+    parallel_for(batch*per, 1, gemm_part, &j);
+}
+
+void gemm_strided_batched(size_t batch, size_t m, size_t n, size_t k, float alpha,
+        const float *a, size_t rsa, size_t csa, size_t sa,
+        const float *b, size_t rsb, size_t csb, size_t sb,
+        float beta, float *c, size_t rsc, size_t csc, size_t sc)
+{
+    gemm_run(batch, m, n, k, alpha, a, rsa, csa, sa, b, rsb, csb, sb, 0, 0,
+            beta, c, rsc, csc, sc);
+}
+
+void gemm_implicit_batched(size_t batch, size_t m, size_t n, size_t k, float alpha,
+        const float *a, size_t rsa, size_t csa, size_t sa,
+        gemm_packer pack, void *ctx,
+        float beta, float *c, size_t rsc, size_t csc, size_t sc)
+{
+    gemm_run(batch, m, n, k, alpha, a, rsa, csa, sa, 0, 0, 0, 0, pack, ctx,
+            beta, c, rsc, csc, sc);
+}
+
+void gemm_strided(size_t m, size_t n, size_t k, float alpha,
+        const float *a, size_t rsa, size_t csa,
+        const float *b, size_t rsb, size_t csb,
+        float beta, float *c, size_t rsc, size_t csc)
+{
+    gemm_strided_batched(1, m, n, k, alpha, a, rsa, csa, 0, b, rsb, csb, 0,
+            beta, c, rsc, csc, 0);
+}
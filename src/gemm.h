@@ -0,0 +1,71 @@
+// Include guards and C++ compatibility
+#ifndef GEMM_H
+#define GEMM_H
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Cache blocking of the packed GEMM: kc x nc panels of B and mc x kc
+// blocks of A are packed so the micro-kernel streams them from L3 and L2,
+// while one micro-panel of B stays in L1
+typedef struct gemm_blocking {
+    size_t mc;
+    size_t kc;
+    size_t nc;
+} gemm_blocking;
+
+// C = alpha*A*B + beta*C where A is m x k, B is k x n and C is m x n
+// Every matrix is given by a pointer and its row and column strides, so
+// transposed views cost nothing. C is not read when beta is 0.
+// Multiplies big enough to be worth it are cut into a grid of pieces of C
+// that run on the shared thread pool.
+void gemm_strided(size_t m, size_t n, size_t k, float alpha,
+        const float *a, size_t rsa, size_t csa,
+        const float *b, size_t rsb, size_t csb,
+        float beta, float *c, size_t rsc, size_t csc);
+
+// A batch of independent multiplies C_i = alpha*A_i*B_i + beta*C_i
+// Operand i starts sa, sb and sc floats after operand i-1, so a stride of
+// 0 shares one A or B (e.g. the weights) across the whole batch. The
+// threads are spread over the batch and, when it is smaller than the pool,
+// over pieces of each multiply as well. The C_i must not overlap.
+void gemm_strided_batched(size_t batch, size_t m, size_t n, size_t k, float alpha,
+        const float *a, size_t rsa, size_t csa, size_t sa,
+        const float *b, size_t rsb, size_t csb, size_t sb,
+        float beta, float *c, size_t rsc, size_t csc, size_t sc);
+
+// Widest micro-panel of B any kernel asks a packer for
+#define GEMM_NR_MAX 32
+
+// Makes up a kc x nc block of operand i of an implicit B, rows p0.. and
+// columns j0.., in the layout gemm_pack_b leaves: panels of nr columns
+// (nr <= GEMM_NR_MAX), each nr values per step along k, the last panel
+// padded with zeros
+typedef void (*gemm_packer)(void *ctx, size_t i, size_t p0, size_t kc,
+        size_t j0, size_t nc, size_t nr, float *bp);
+
+// gemm_strided_batched with a B that is never stored: pack is called for
+// each panel as the multiply needs it, e.g. to gather convolution patches
+// straight out of an image. Blocking, threads and order of summation are
+// those of the strided multiply, so the results are the same bit for bit.
+// The packer runs on the pool's threads and must not write to ctx.
+void gemm_implicit_batched(size_t batch, size_t m, size_t n, size_t k, float alpha,
+        const float *a, size_t rsa, size_t csa, size_t sa,
+        gemm_packer pack, void *ctx,
+        float beta, float *c, size_t rsc, size_t csc, size_t sc);
+
+// Called with the shape of each multiply, see gemm_set_observer
+typedef void (*gemm_observer)(void *ctx, size_t batch, size_t m, size_t n, size_t k);
+
+gemm_blocking gemm_get_blocking();
+void gemm_set_blocking(gemm_blocking b);
+const char *gemm_kernel_name();
+const char *gemm_kernel_list(size_t i);
+int gemm_set_kernel(const char *name);
+void gemm_set_observer(gemm_observer fn, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
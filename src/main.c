@@ -3,13 +3,10 @@
 #include "string.h"
 #include "jcr.h"
 #include "dubnet.h"
+#include "tune.h"
 
-void try_hw0()
+net make_hw0_net()
 {
-    srand(0);
-    data train = load_image_classification_data("mnist/mnist.train", "mnist/mnist.labels");
-    data test  = load_image_classification_data("mnist/mnist.test", "mnist/mnist.labels");
-
     net n = {0};
     n.n = 4;
     n.layers = calloc(n.n, sizeof(layer));
@@ -17,6 +14,70 @@ void try_hw0()
     n.layers[1] = make_activation_layer(RELU);
     n.layers[2] = make_connected_layer(32, 10);
     n.layers[3] = make_activation_layer(SOFTMAX);
+    return n;
+}
+
+net make_conv_net()
+{
+    net n = {0};
+    n.n = 8;
+    n.layers = calloc(n.n, sizeof(layer));
+    n.layers[0] = make_convolutional_layer(1, 8, 3, 1, 1);
+    n.layers[1] = make_activation_layer(RELU);
+    n.layers[2] = make_maxpool_layer(3, 2);
+    n.layers[3] = make_convolutional_layer(8, 16, 3, 1, 1);
+    n.layers[4] = make_activation_layer(RELU);
+    n.layers[5] = make_maxpool_layer(3, 2);
+    n.layers[6] = make_connected_layer(784, 10);
+    n.layers[7] = make_activation_layer(SOFTMAX);
+    return n;
+}
+
+typedef struct tune_job {
+    net m;
+    tensor x;
+} tune_job;
+
+// One training iteration's multiplies for tune_gemm, the gradients are
+// left dirty
+void tune_run_net(void *ctx)
+{
+    tune_job *j = ctx;
+    tensor y = forward_net(j->m, j->x);
+    backward_net(j->m, y);
+    tensor_free(y);
+}
+
+// Tune the GEMM for one of the nets on this machine and cache the result
+// char *name: mlp or conv
+// int batch: batch size the net trains with
+void tune(char *name, int batch)
+{
+    net n;
+    if(0 == strcmp(name, "mlp")) n = make_hw0_net();
+    else if(0 == strcmp(name, "conv")) n = make_conv_net();
+    else {
+        fprintf(stderr, "Unknown net %s, expected mlp or conv\n", name);
+        return;
+    }
+    tensor x = tensor_vrandom(1, 4, batch, 1, 28, 28);
+    tune_job j = {n, x};
+    gemm_tuning t = tune_gemm(tune_run_net, &j);
+    const char *path = tune_cache_path();
+    if(tune_save(path, t)) printf("Saved %s, %zu %zu %zu to %s\n", t.kernel,
+            t.blocking.mc, t.blocking.kc, t.blocking.nc, path);
+    else fprintf(stderr, "Couldn't write tuning cache %s\n", path);
+    tensor_free(x);
+    free_net(n);
+}
+
+void try_hw0()
+{
+    srand(0);
+    data train = load_image_classification_data("mnist/mnist.train", "mnist/mnist.labels");
+    data test  = load_image_classification_data("mnist/mnist.test", "mnist/mnist.labels");
+
+    net n = make_hw0_net();
 
     int batch = 128;
     int iters = 1500;
@@ -68,11 +129,13 @@ void try_hw1()
 int main(int argc, char **argv)
 {
     if(argc < 2){
-        printf("usage: %s [test | tryhw0 | tryhw1]\n", argv[0]);  
+        printf("usage: %s [test | tryhw0 | tryhw1 | tune [mlp | conv] [batch]]\n", argv[0]);  
     } else if (0 == strcmp(argv[1], "tryhw0")){
         try_hw0();
     } else if (0 == strcmp(argv[1], "time")){
         time_matrix_multiply();
+    } else if (0 == strcmp(argv[1], "tune")){
+        tune(argc > 2 ? argv[2] : "conv", argc > 3 ? atoi(argv[3]) : 128);
     } else if (0 == strcmp(argv[1], "tryhw1")){
         //try_hw1();
     } else if (0 == strcmp(argv[1], "test")){
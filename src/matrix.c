@@ -1,9 +1,137 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "matrix.h"
 #include "tensor.h"
+#include "gemm.h"
+#include "simd.h"
+#include "parallel.h"
+
+// Blocks at most this big on each side are transposed tile by tile,
+// bigger ones are halved until they are, whatever the cache sizes
+#define TRANSPOSE_LEAF 64
+// Matrices with fewer elements than this are transposed on one thread
+#define TRANSPOSE_PARALLEL_MIN (1 << 18)
+
+// Transpose the rows x cols block of a starting at (i0, j0) into t
+// Row-major operands go through the 8x8 in-register kernel, the ragged
+// edges and other layouts are copied one element at a time
+void matrix_transpose_block(tensor t, const tensor a, size_t i0, size_t j0, size_t rows, size_t cols)
+{
+    if(rows > TRANSPOSE_LEAF || cols > TRANSPOSE_LEAF){
+        if(rows >= cols){
+            size_t h = (rows/2 + 7)/8*8;
+            matrix_transpose_block(t, a, i0, j0, h, cols);
+            matrix_transpose_block(t, a, i0 + h, j0, rows - h, cols);
+        } else {
+            size_t h = (cols/2 + 7)/8*8;
+            matrix_transpose_block(t, a, i0, j0, rows, h);
+            matrix_transpose_block(t, a, i0, j0 + h, rows, cols - h);
+        }
+        return;
+    }
+    size_t as0 = a.stride[0], as1 = a.stride[1];
+    size_t ts0 = t.stride[0], ts1 = t.stride[1];
+    size_t i, j;
+    size_t rows8 = 0, cols8 = 0;
+    if(as1 == 1 && ts1 == 1){
+        rows8 = rows/8*8;
+        cols8 = cols/8*8;
+        void (*transpose8)(const float *, size_t, float *, size_t) = simd()->transpose8;
+        for(i = 0; i < rows8; i += 8){
+            for(j = 0; j < cols8; j += 8){
+                transpose8(a.data + (i0 + i)*as0 + j0 + j, as0, t.data + (j0 + j)*ts0 + i0 + i, ts0);
+            }
+        }
+    }
+    for(i = 0; i < rows; ++i){
+        for(j = (i < rows8) ? cols8 : 0; j < cols; ++j){
+            t.data[(j0 + j)*ts0 + (i0 + i)*ts1] = a.data[(i0 + i)*as0 + (j0 + j)*as1];
+        }
+    }
+}
+
+typedef struct transpose_job {
+    tensor t;
+    tensor a;
+} transpose_job;
+
+// Each thread takes bands of TRANSPOSE_LEAF rows of a
+void matrix_transpose_band(void *ctx, size_t start, size_t end)
+{
+    transpose_job *j = ctx;
+    size_t rows = j->a.size[0];
+    size_t i0 = start*TRANSPOSE_LEAF;
+    size_t i1 = (end*TRANSPOSE_LEAF < rows) ? end*TRANSPOSE_LEAF : rows;
+    matrix_transpose_block(j->t, j->a, i0, 0, i1 - i0, j->a.size[1]);
+}
+
+// Cache-oblivious transpose, threaded for big matrices
+void matrix_transpose_blocked(tensor t, const tensor a)
+{
+    size_t rows = a.size[0];
+    size_t cols = a.size[1];
+    if(rows*cols < TRANSPOSE_PARALLEL_MIN){
+        matrix_transpose_block(t, a, 0, 0, rows, cols);
+        return;
+    }
+    transpose_job j = {t, a};
+    parallel_for((rows + TRANSPOSE_LEAF - 1)/TRANSPOSE_LEAF, 1, matrix_transpose_band, &j);
+}
+
+// Swap the 8x8 tiles of a square row-major matrix at (i, j) and (j, i),
+// transposing both, or transpose the tile in place when i == j
+void matrix_transpose_swap8(float *a, size_t lda, size_t i, size_t j)
+{
+    float tmp[64];
+    void (*transpose8)(const float *, size_t, float *, size_t) = simd()->transpose8;
+    size_t r;
+    transpose8(a + i*lda + j, lda, tmp, 8);
+    if(i != j) transpose8(a + j*lda + i, lda, a + i*lda + j, lda);
+    for(r = 0; r < 8; ++r){
+        memcpy(a + (j + r)*lda + i, tmp + 8*r, 8*sizeof(float));
+    }
+}
+
+// Each thread takes bands of 8 rows and swaps them with the columns
+void matrix_transpose_band_(void *ctx, size_t start, size_t end)
+{
+    tensor *a = ctx;
+    size_t n8 = a->size[0]/8*8;
+    size_t bi, j;
+    for(bi = start; bi < end; ++bi){
+        for(j = bi*8; j < n8; j += 8){
+            matrix_transpose_swap8(a->data, a->stride[0], bi*8, j);
+        }
+    }
+}
+
+// Transpose a square matrix in place
+// tensor a: square matrix, overwritten with its transpose
+void matrix_transpose_(tensor a)
+{
+    assert(a.n == 2 && a.size[0] == a.size[1]);
+    size_t n = a.size[0];
+    size_t s0 = a.stride[0], s1 = a.stride[1];
+    size_t i, j;
+    size_t n8 = 0;
+    if(s1 == 1){
+        n8 = n/8*8;
+        if(n*n < TRANSPOSE_PARALLEL_MIN) matrix_transpose_band_(&a, 0, n8/8);
+        else parallel_for(n8/8, 1, matrix_transpose_band_, &a);
+    }
+    // whatever the tiles didn't cover, one pair of elements at a time
+    for(i = 0; i < n; ++i){
+        for(j = (i < n8) ? n8 : i + 1; j < n; ++j){
+            float swap = a.data[i*s0 + j*s1];
+            a.data[i*s0 + j*s1] = a.data[j*s0 + i*s1];
+            a.data[j*s0 + i*s1] = swap;
+        }
+    }
+}
 
 // Transpose a matrix
 // tensor m: matrix to be transposed
@@ -13,20 +141,74 @@ tensor matrix_transpose(tensor a)
     assert(a.n == 2);
     // TODO 1.0: return a transposed version of a (don't modify a)
     size_t s[2] = { a.size[1], a.size[0] };
-    tensor t = tensor_make(a.n, s);
-    // see: https://stackoverflow.com/questions/38627087/taking-the-transpose-of-a-matrix-in-c-with-1d-arrays
-    size_t n = a.size[0];
-    size_t m = a.size[1];
-    for (size_t i = 0; i < m; i++) {
-        for (size_t j = 0; j < n; j++) {
-            size_t i1 = i * n + j;
-            size_t i2 = j * m + i;
-            t.data[i1] = a.data[i2];
-        }
-    }
+    tensor t = tensor_empty(a.n, s);
+    matrix_transpose_into(t, a);
     return t;
 }
 
+// General matrix multiply: c = alpha*op(a)*op(b) + beta*c
+// op transposes its operand when the flag is set, by reading it with
+// swapped strides rather than copying it. Operands may be strided views.
+// int ta, tb: whether to transpose a and b
+// float alpha: scale of the product
+// tensor a, b: operands
+// float beta: scale of c before adding the product, 0 overwrites c
+// tensor c: output, must not overlap a or b
+void gemm(int ta, int tb, float alpha, const tensor a, const tensor b, float beta, tensor c)
+{
+    assert(a.n == 2);
+    assert(b.n == 2);
+    assert(c.n == 2);
+    size_t m = ta ? a.size[1] : a.size[0];
+    size_t k = ta ? a.size[0] : a.size[1];
+    size_t n = tb ? b.size[0] : b.size[1];
+    assert((tb ? b.size[1] : b.size[0]) == k);
+    assert(c.size[0] == m && c.size[1] == n);
+
+    matrix_backend_get()->gemm(1, m, n, k, alpha,
+            a.data, a.stride[ta ? 1 : 0], a.stride[ta ? 0 : 1], 0,
+            b.data, b.stride[tb ? 1 : 0], b.stride[tb ? 0 : 1], 0,
+            beta, c.data, c.stride[0], c.stride[1], 0);
+}
+
+// Batched general matrix multiply: c[i] = alpha*op(a[i])*op(b[i]) + beta*c[i]
+// A 2D a or b is shared by every multiply, e.g. the weights of a layer run
+// on each image of a batch. All of them run in one call on the thread pool.
+// int ta, tb: whether to transpose each a[i] and b[i]
+// float alpha: scale of the products
+// tensor a, b: (batch, rows, cols) operands, or (rows, cols) to share one
+// float beta: scale of c before adding the products, 0 overwrites c
+// tensor c: (batch, rows, cols) output, must not overlap a or b
+void gemm_batched(int ta, int tb, float alpha, const tensor a, const tensor b, float beta, tensor c)
+{
+    assert(a.n == 2 || a.n == 3);
+    assert(b.n == 2 || b.n == 3);
+    assert(c.n == 3);
+    size_t batch = c.size[0];
+    size_t ao = a.n - 2;
+    size_t bo = b.n - 2;
+    assert(a.n == 2 || a.size[0] == batch);
+    assert(b.n == 2 || b.size[0] == batch);
+    size_t m = ta ? a.size[ao+1] : a.size[ao];
+    size_t k = ta ? a.size[ao] : a.size[ao+1];
+    size_t n = tb ? b.size[bo] : b.size[bo+1];
+    assert((tb ? b.size[bo+1] : b.size[bo]) == k);
+    assert(c.size[1] == m && c.size[2] == n);
+
+    matrix_backend_get()->gemm(batch, m, n, k, alpha,
+            a.data, a.stride[ao + (ta ? 1 : 0)], a.stride[ao + (ta ? 0 : 1)], ao ? a.stride[0] : 0,
+            b.data, b.stride[bo + (tb ? 1 : 0)], b.stride[bo + (tb ? 0 : 1)], bo ? b.stride[0] : 0,
+            beta, c.data, c.stride[1], c.stride[2], c.stride[0]);
+}
+
+// Perform matrix multiplication a*b into an existing tensor
+// tensor t: destination, overwritten with the result
+// tensor a,b: operands
+void matrix_multiply_into(tensor t, const tensor a, const tensor b)
+{
+    gemm(0, 0, 1, a, b, 0, t);
+}
+
 // Perform matrix multiplication a*b, return result
 // tensor a,b: operands
 // returns: new tensor that is the result
@@ -35,28 +217,9 @@ tensor matrix_multiply(const tensor a, const tensor b)
     assert(a.n == 2);
     assert(b.n == 2);
     assert(a.size[1] == b.size[0]);
-    // TODO 1.1: matrix multiplication! just use 3 for loops
-    // size = height matrix a * width matrix b
     size_t s[2] = { a.size[0], b.size[1] }; 
-    tensor t = tensor_make(2, s);
-
-    // see: https://stackoverflow.com/questions/47023651/multiplying-matrices-in-one-dimensional-arrays
-
-    size_t a_n = a.size[0];
-    size_t b_n = b.size[0];
-    size_t a_m = a.size[1];
-    size_t b_m = b.size[1];
-    
-    for (size_t i = 0; i < a_n; ++i) {
-        for (size_t j = 0; j < b_m; ++j) {
-            float sum = 0.0f;
-            for (size_t k = 0; k < b_n; ++k) {
-                sum = sum + a.data[i * b_n + k] * b.data[k * b_m + j];
-            }
-            t.data[i * b_m + j] = sum;
-        }
-    }
-
+    tensor t = tensor_empty(2, s);
+    matrix_multiply_into(t, a, b);
     return t;
 }
 
@@ -70,7 +233,7 @@ tensor matrix_augment(tensor m)
     tensor c = tensor_vmake(2, rows, cols*2);
     for(i = 0; i < rows; ++i){
         for(j = 0; j < cols; ++j){
-            c.data[i*cols*2 + j] = m.data[i*cols + j];
+            c.data[i*cols*2 + j] = m.data[i*m.stride[0] + j*m.stride[1]];
         }
     }
     for(j = 0; j < rows; ++j){
@@ -79,8 +242,8 @@ tensor matrix_augment(tensor m)
     return c;
 }
 
-// Invert matrix m
-tensor matrix_invert(tensor m)
+// Invert matrix m by Gauss-Jordan elimination with partial pivoting
+tensor matrix_invert_gauss_jordan(tensor m)
 {
     size_t i, j, k;
     assert(m.n == 2);
@@ -146,10 +309,11 @@ tensor matrix_invert(tensor m)
     return inv;
 }
 
-tensor solve_system(tensor M, tensor b)
+// Least squares through the normal equations, a = (M^T M)^-1 M^T b
+tensor solve_system_normal(tensor M, tensor b)
 {
     tensor none = {0};
-    tensor Mt = matrix_transpose(M);
+    tensor Mt = tensor_transpose_view(M, 0, 1);
     tensor MtM = matrix_multiply(Mt, M);
     tensor MtMinv = matrix_invert(MtM);
     if(!MtMinv.data) return none;
@@ -161,3 +325,102 @@ tensor solve_system(tensor M, tensor b)
     tensor_free(Mdag);
     return a;
 }
+
+const matrix_backend matrix_blocked = {
+    "blocked",
+    gemm_strided_batched,
+    matrix_transpose_blocked,
+    matrix_invert_lu,
+    solve_system_factored,
+};
+
+static const matrix_backend *matrix_backends[] = {
+    &matrix_blocked,
+    &matrix_reference,
+#ifdef BLAS
+    &matrix_blas,
+#endif
+};
+#define MATRIX_NBACKENDS (sizeof(matrix_backends)/sizeof(matrix_backends[0]))
+
+static const matrix_backend *matrix_current = &matrix_blocked;
+static pthread_once_t matrix_once = PTHREAD_ONCE_INIT;
+
+// Point the matrix routines at a backend by name
+int matrix_use_backend(const char *name)
+{
+    size_t i;
+    for(i = 0; i < MATRIX_NBACKENDS; ++i){
+        if(0 == strcmp(matrix_backends[i]->name, name)){
+            matrix_current = matrix_backends[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void matrix_backend_init()
+{
+    char *env = getenv("DUBNET_BACKEND");
+    if(env && !matrix_use_backend(env)){
+        fprintf(stderr, "Unknown DUBNET_BACKEND %s, using %s\n", env, matrix_current->name);
+    }
+}
+
+// Backend the matrix routines run on, picked from DUBNET_BACKEND on first use
+const matrix_backend *matrix_backend_get()
+{
+    pthread_once(&matrix_once, matrix_backend_init);
+    return matrix_current;
+}
+
+// Switch every matrix routine to another backend, e.g. to A/B them
+// const char *name: backend from matrix_backend_list
+// returns: 1 on success, 0 if there is no such backend in this build
+int matrix_set_backend(const char *name)
+{
+    pthread_once(&matrix_once, matrix_backend_init);
+    return matrix_use_backend(name);
+}
+
+// Name of the i-th backend in this build
+// returns: backend name, 0 past the last one
+const char *matrix_backend_list(size_t i)
+{
+    return (i < MATRIX_NBACKENDS) ? matrix_backends[i]->name : 0;
+}
+
+// Transpose a matrix into an existing tensor
+// tensor t: destination, shape must be the transpose of a's, must not
+// overlap a (see matrix_transpose_ for square matrices in place)
+// tensor a: matrix to be transposed
+void matrix_transpose_into(tensor t, const tensor a)
+{
+    assert(a.n == 2 && t.n == 2);
+    assert(t.size[0] == a.size[1] && t.size[1] == a.size[0]);
+    matrix_backend_get()->transpose_into(t, a);
+}
+
+// Invert a square matrix
+// Through a blocked LU except on the reference backend, which keeps
+// Gauss-Jordan elimination
+// tensor m: matrix to invert
+// returns: the inverse, or an empty tensor if m is singular
+tensor matrix_invert(tensor m)
+{
+    assert(m.n == 2);
+    assert(m.size[0] == m.size[1]);
+    return matrix_backend_get()->invert(m);
+}
+
+// Least squares solution of M a = b
+// Factored with Cholesky or QR except on the reference backend, which
+// keeps the normal equations and an explicit inverse
+// tensor M: (n, k) system
+// tensor b: (n, m) right hand sides
+// returns: (k, m) solution, or an empty tensor if there is none
+tensor solve_system(tensor M, tensor b)
+{
+    assert(M.n == 2 && b.n == 2 && M.size[0] == b.size[0]);
+    return matrix_backend_get()->solve(M, b);
+}
@@ -6,10 +6,57 @@
 extern "C" {
 #endif
 
+// Implementations of the matrix routines, swappable at runtime
+// gemm is gemm_strided_batched's contract, transpose_into, invert and
+// solve are those of matrix_transpose_into, matrix_invert and solve_system
+// with the shapes already checked. The backend is picked with
+// DUBNET_BACKEND or matrix_set_backend: blocked (the default), reference
+// (plain loops, for checking the others against) and blas when built with
+// BLAS=1.
+typedef struct matrix_backend {
+    const char *name;
+    void (*gemm)(size_t batch, size_t m, size_t n, size_t k, float alpha,
+            const float *a, size_t rsa, size_t csa, size_t sa,
+            const float *b, size_t rsb, size_t csb, size_t sb,
+            float beta, float *c, size_t rsc, size_t csc, size_t sc);
+    void (*transpose_into)(tensor t, const tensor a);
+    tensor (*invert)(tensor m);
+    tensor (*solve)(tensor M, tensor b);
+} matrix_backend;
+
+extern const matrix_backend matrix_blocked;
+extern const matrix_backend matrix_reference;
+#ifdef BLAS
+extern const matrix_backend matrix_blas;
+#endif
+
+const matrix_backend *matrix_backend_get();
+int matrix_set_backend(const char *name);
+const char *matrix_backend_list(size_t i);
+
+// Building blocks the backends share
+void matrix_transpose_blocked(tensor t, const tensor a);
+tensor matrix_invert_gauss_jordan(tensor m);
+tensor solve_system_normal(tensor M, tensor b);
+int matrix_cholesky_(tensor a);
+int matrix_lu_(tensor a, size_t *piv);
+tensor matrix_invert_lu(tensor m);
+void matrix_qr_(tensor a, size_t k, float *tau);
+tensor solve_system_cholesky(tensor M, tensor b);
+tensor solve_system_qr(tensor M, tensor b);
+tensor solve_system_spd(tensor A, tensor b);
+tensor solve_system_factored(tensor M, tensor b);
+
+void gemm(int ta, int tb, float alpha, const tensor a, const tensor b, float beta, tensor c);
+void gemm_batched(int ta, int tb, float alpha, const tensor a, const tensor b, float beta, tensor c);
 tensor matrix_multiply(const tensor a, const tensor b);
+void matrix_multiply_into(tensor t, const tensor a, const tensor b);
 tensor matrix_transpose(const tensor a);
+void matrix_transpose_into(tensor t, const tensor a);
+void matrix_transpose_(tensor a);
 tensor matrix_invert(tensor m);
 tensor solve_system(tensor M, tensor b);
+void matrix_svd(tensor a, tensor *u, tensor *s, tensor *v);
 
 
 #ifdef __cplusplus
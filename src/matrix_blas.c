@@ -0,0 +1,59 @@
+#ifdef BLAS
+#include <assert.h>
+#include <stdlib.h>
+#include <cblas.h>
+
+#include "matrix.h"
+#include "gemm.h"
+
+// Backend on the system BLAS, built with BLAS=1
+// Only the multiply goes to the library, anything it can't express and
+// the rest of the routines run on the blocked backend
+
+// How BLAS reads a rows x cols operand with row stride rs and column
+// stride cs: row-major as is, or column-major through the transpose flag
+// returns: 1 if one of the two fits, 0 if the layout needs a copy
+int blas_layout(size_t rows, size_t cols, size_t rs, size_t cs, enum CBLAS_TRANSPOSE *trans, int *ld)
+{
+    if(cs == 1 && rs >= cols){
+        *trans = CblasNoTrans;
+        *ld = rs > 1 ? rs : 1;
+        return 1;
+    }
+    if(rs == 1 && cs >= rows){
+        *trans = CblasTrans;
+        *ld = cs > 1 ? cs : 1;
+        return 1;
+    }
+    return 0;
+}
+
+void gemm_blas(size_t batch, size_t m, size_t n, size_t k, float alpha,
+        const float *a, size_t rsa, size_t csa, size_t sa,
+        const float *b, size_t rsb, size_t csb, size_t sb,
+        float beta, float *c, size_t rsc, size_t csc, size_t sc)
+{
+    enum CBLAS_TRANSPOSE ta, tb, tc;
+    int lda, ldb, ldc;
+    if(!blas_layout(m, k, rsa, csa, &ta, &lda) ||
+            !blas_layout(k, n, rsb, csb, &tb, &ldb) ||
+            !blas_layout(m, n, rsc, csc, &tc, &ldc) || tc != CblasNoTrans){
+        gemm_strided_batched(batch, m, n, k, alpha, a, rsa, csa, sa, b, rsb, csb, sb,
+                beta, c, rsc, csc, sc);
+        return;
+    }
+    size_t i;
+    for(i = 0; i < batch; ++i){
+        cblas_sgemm(CblasRowMajor, ta, tb, m, n, k, alpha, a + i*sa, lda,
+                b + i*sb, ldb, beta, c + i*sc, ldc);
+    }
+}
+
+const matrix_backend matrix_blas = {
+    "blas",
+    gemm_blas,
+    matrix_transpose_blocked,
+    matrix_invert_lu,
+    solve_system_factored,
+};
+#endif
@@ -0,0 +1,45 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "matrix.h"
+
+// Textbook loops for every matrix routine, slow but simple enough to
+// trust, so the other backends can be checked against them
+
+void gemm_reference(size_t batch, size_t m, size_t n, size_t k, float alpha,
+        const float *a, size_t rsa, size_t csa, size_t sa,
+        const float *b, size_t rsb, size_t csb, size_t sb,
+        float beta, float *c, size_t rsc, size_t csc, size_t sc)
+{
+    size_t t, i, j, p;
+    for(t = 0; t < batch; ++t){
+        for(i = 0; i < m; ++i){
+            for(j = 0; j < n; ++j){
+                float sum = 0;
+                for(p = 0; p < k; ++p){
+                    sum += a[t*sa + i*rsa + p*csa]*b[t*sb + p*rsb + j*csb];
+                }
+                float *cij = c + t*sc + i*rsc + j*csc;
+                *cij = (beta == 0) ? alpha*sum : alpha*sum + beta*(*cij);
+            }
+        }
+    }
+}
+
+void matrix_transpose_reference(tensor t, const tensor a)
+{
+    size_t i, j;
+    for(i = 0; i < a.size[0]; ++i){
+        for(j = 0; j < a.size[1]; ++j){
+            t.data[j*t.stride[0] + i*t.stride[1]] = a.data[i*a.stride[0] + j*a.stride[1]];
+        }
+    }
+}
+
+const matrix_backend matrix_reference = {
+    "reference",
+    gemm_reference,
+    matrix_transpose_reference,
+    matrix_invert_gauss_jordan,
+    solve_system_normal,
+};
@@ -0,0 +1,650 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+#include <string.h>
+
+#include "matrix.h"
+#include "parallel.h"
+
+// Rows or columns factored or solved one at a time before the rest of the
+// matrix is updated with GEMMs
+#define SOLVE_BLOCK 128
+// Columns of an LU panel. Pivoting keeps the panel serial, so it is
+// narrower than SOLVE_BLOCK.
+#define LU_BLOCK 64
+// Right hand sides handed to each thread by solve_triangular
+#define TRIANGULAR_GRAIN 64
+// Householder reflectors gathered into one block before they are applied.
+// The panel they come from is factored serially, so this stays small.
+#define QR_BLOCK 32
+// Systems at least this many times taller than wide go through the
+// normal equations, which cost about half as much as a QR
+#define SOLVE_NORMAL_RATIO 2
+// Cholesky gives up, and solve_system falls back to QR, when the normal
+// equations look worse conditioned than this: float would keep too few
+// digits of the solution
+#define SOLVE_MAX_CONDITION 1e5f
+
+// C = alpha*A*B + beta*C on row-major C through the current backend
+void solve_gemm(size_t m, size_t n, size_t k, float alpha,
+        const float *a, size_t rsa, size_t csa,
+        const float *b, size_t rsb, size_t csb,
+        float beta, float *c, size_t rsc)
+{
+    if(!m || !n) return;
+    matrix_backend_get()->gemm(1, m, n, k, alpha, a, rsa, csa, 0, b, rsb, csb, 0,
+            beta, c, rsc, 1, 0);
+}
+
+// b <- L^-1 b for lower triangular L, or U^-1 b for upper triangular U
+// on one slice of the right hand sides, see solve_triangular
+void solve_triangular_serial(int upper, int unit, const float *l, size_t rs, size_t cs,
+        size_t k, float *b, size_t ldb, size_t m)
+{
+    size_t nblocks = (k + SOLVE_BLOCK - 1)/SOLVE_BLOCK;
+    size_t bi, r, p, c;
+    for(bi = 0; bi < nblocks; ++bi){
+        size_t i0 = (upper ? nblocks - 1 - bi : bi)*SOLVE_BLOCK;
+        size_t ib = (k - i0 < SOLVE_BLOCK) ? k - i0 : SOLVE_BLOCK;
+        for(r = 0; r < ib; ++r){
+            size_t i = upper ? i0 + ib - 1 - r : i0 + r;
+            float *bi_ = b + i*ldb;
+            size_t p0 = upper ? i + 1 : i0;
+            size_t p1 = upper ? i0 + ib : i;
+            for(p = p0; p < p1; ++p){
+                float lip = l[i*rs + p*cs];
+                const float *bp = b + p*ldb;
+                for(c = 0; c < m; ++c) bi_[c] -= lip*bp[c];
+            }
+            if(unit) continue;
+            float inv = 1/l[i*rs + i*cs];
+            for(c = 0; c < m; ++c) bi_[c] *= inv;
+        }
+        if(upper){
+            solve_gemm(i0, m, ib, -1, l + i0*cs, rs, cs, b + i0*ldb, ldb, 1,
+                    1, b, ldb);
+        } else {
+            solve_gemm(k - i0 - ib, m, ib, -1, l + (i0 + ib)*rs + i0*cs, rs, cs,
+                    b + i0*ldb, ldb, 1, 1, b + (i0 + ib)*ldb, ldb);
+        }
+    }
+}
+
+typedef struct triangular_job {
+    int upper;
+    int unit;
+    const float *l;
+    size_t rs;
+    size_t cs;
+    size_t k;
+    float *b;
+    size_t ldb;
+} triangular_job;
+
+void solve_triangular_part(void *ctx, size_t start, size_t end)
+{
+    triangular_job *j = ctx;
+    solve_triangular_serial(j->upper, j->unit, j->l, j->rs, j->cs, j->k,
+            j->b + start, j->ldb, end - start);
+}
+
+// b <- L^-1 b for lower triangular L, or U^-1 b for upper triangular U
+// The triangle is read through its strides, so L^T serves as U uncopied.
+// Blocks of rows are solved in turn, each one then removed from the rest
+// of b with a GEMM. Many right hand sides are split over the threads,
+// a few leave the threads to the GEMMs.
+// int upper: whether l is upper triangular
+// int unit: whether l has an implied unit diagonal
+// float *l: k x k triangle with row stride rs and column stride cs
+// float *b: k x m right hand sides with row stride ldb
+void solve_triangular(int upper, int unit, const float *l, size_t rs, size_t cs, size_t k,
+        float *b, size_t ldb, size_t m)
+{
+    triangular_job j = {upper, unit, l, rs, cs, k, b, ldb};
+    parallel_for(m, TRIANGULAR_GRAIN, solve_triangular_part, &j);
+}
+
+typedef struct cholesky_job {
+    float *a;
+    size_t lda;
+    size_t k0;
+    size_t kb;
+} cholesky_job;
+
+// Rows of the panel under the diagonal block just factored: x <- x L11^-T
+void cholesky_panel_part(void *ctx, size_t start, size_t end)
+{
+    cholesky_job *j = ctx;
+    const float *l = j->a + j->k0*j->lda + j->k0;
+    size_t r, c, p;
+    for(r = start; r < end; ++r){
+        float *x = j->a + (j->k0 + j->kb + r)*j->lda + j->k0;
+        for(c = 0; c < j->kb; ++c){
+            float sum = x[c];
+            const float *lc = l + c*j->lda;
+            for(p = 0; p < c; ++p) sum -= x[p]*lc[p];
+            x[c] = sum/lc[c];
+        }
+    }
+}
+
+// Factor a diagonal block one column at a time, accumulating in double
+// returns: 0 if a pivot isn't bigger than tiny
+int cholesky_block(float *a, size_t lda, size_t kb, float tiny)
+{
+    size_t i, j, p;
+    for(j = 0; j < kb; ++j){
+        double d = a[j*lda + j];
+        for(p = 0; p < j; ++p) d -= (double)a[j*lda + p]*a[j*lda + p];
+        if(!(d > tiny)) return 0;
+        float l = sqrt(d);
+        a[j*lda + j] = l;
+        for(i = j + 1; i < kb; ++i){
+            double s = a[i*lda + j];
+            for(p = 0; p < j; ++p) s -= (double)a[i*lda + p]*a[j*lda + p];
+            a[i*lda + j] = s/l;
+        }
+    }
+    return 1;
+}
+
+// Cholesky factorization a = L L^T of a symmetric positive definite matrix
+// Right-looking and blocked: each block column is factored, the panel
+// under it solved on the thread pool, and the lower triangle of the rest
+// updated with GEMMs
+// tensor a: square matrix with unit column stride. Only the lower triangle
+// is read, and it is overwritten with L.
+// returns: 1 on success, 0 if a is not positive definite or looks worse
+// conditioned than SOLVE_MAX_CONDITION
+int matrix_cholesky_(tensor a)
+{
+    assert(a.n == 2 && a.size[0] == a.size[1]);
+    assert(a.stride[1] == 1);
+    size_t n = a.size[0];
+    size_t lda = a.stride[0];
+    float *d = a.data;
+    float big = 0;
+    size_t i, k0, j0;
+    for(i = 0; i < n; ++i){
+        if(d[i*lda + i] > big) big = d[i*lda + i];
+    }
+    float tiny = big/SOLVE_MAX_CONDITION;
+    for(k0 = 0; k0 < n; k0 += SOLVE_BLOCK){
+        size_t kb = (n - k0 < SOLVE_BLOCK) ? n - k0 : SOLVE_BLOCK;
+        if(!cholesky_block(d + k0*lda + k0, lda, kb, tiny)) return 0;
+        size_t rest = n - k0 - kb;
+        cholesky_job j = {d, lda, k0, kb};
+        parallel_for(rest, 16, cholesky_panel_part, &j);
+        // a22 -= l21 l21^T, one block column of the lower triangle at a time
+        float *l21 = d + (k0 + kb)*lda + k0;
+        float *a22 = d + (k0 + kb)*lda + k0 + kb;
+        for(j0 = 0; j0 < rest; j0 += SOLVE_BLOCK){
+            size_t jb = (rest - j0 < SOLVE_BLOCK) ? rest - j0 : SOLVE_BLOCK;
+            solve_gemm(rest - j0, jb, kb, -1, l21 + j0*lda, lda, 1,
+                    l21 + j0*lda, 1, lda, 1, a22 + j0*lda + j0, lda);
+        }
+    }
+    return 1;
+}
+
+// Factor columns k0..k0+kb of a with partial pivoting, one column at a
+// time, swapping whole rows of a
+// returns: 0 if a column has no nonzero pivot
+int lu_panel(float *a, size_t lda, size_t n, size_t k0, size_t kb, size_t *piv)
+{
+    size_t i, j, c;
+    for(j = k0; j < k0 + kb; ++j){
+        size_t p = j;
+        float best = fabsf(a[j*lda + j]);
+        for(i = j + 1; i < n; ++i){
+            float v = fabsf(a[i*lda + j]);
+            if(v > best){
+                best = v;
+                p = i;
+            }
+        }
+        if(!(best > 0)) return 0;
+        piv[j] = p;
+        if(p != j){
+            float *x = a + j*lda, *y = a + p*lda;
+            for(c = 0; c < n; ++c){
+                float swap = x[c];
+                x[c] = y[c];
+                y[c] = swap;
+            }
+        }
+        const float *aj = a + j*lda;
+        float inv = 1/aj[j];
+        for(i = j + 1; i < n; ++i){
+            float *ai = a + i*lda;
+            float l = ai[j] *= inv;
+            for(c = j + 1; c < k0 + kb; ++c) ai[c] -= l*aj[c];
+        }
+    }
+    return 1;
+}
+
+// LU factorization P a = L U with partial pivoting
+// Right-looking and blocked: each panel of LU_BLOCK columns is factored,
+// the rows of U right of it solved, and the rest of the matrix updated
+// with one GEMM on the thread pool
+// tensor a: square matrix with unit column stride, overwritten with U and,
+// under the diagonal, L with its unit diagonal implied
+// size_t *piv: row j was swapped with row piv[j], in order
+// returns: 1 on success, 0 if a is singular
+int matrix_lu_(tensor a, size_t *piv)
+{
+    assert(a.n == 2 && a.size[0] == a.size[1]);
+    assert(a.stride[1] == 1);
+    size_t n = a.size[0];
+    size_t lda = a.stride[0];
+    float *d = a.data;
+    size_t k0;
+    for(k0 = 0; k0 < n; k0 += LU_BLOCK){
+        size_t kb = (n - k0 < LU_BLOCK) ? n - k0 : LU_BLOCK;
+        if(!lu_panel(d, lda, n, k0, kb, piv)) return 0;
+        size_t rest = n - k0 - kb;
+        if(!rest) break;
+        float *a11 = d + k0*lda + k0;
+        solve_triangular(0, 1, a11, lda, 1, kb, a11 + kb, lda, rest);
+        solve_gemm(rest, rest, kb, -1, a11 + kb*lda, lda, 1, a11 + kb, lda, 1,
+                1, a11 + kb*lda + kb, lda);
+    }
+    return 1;
+}
+
+// Invert a matrix through its LU factorization, a^-1 = U^-1 L^-1 P
+// Both triangular solves run on the permuted identity, split over the
+// threads by columns.
+// returns: the inverse, or an empty tensor if m is singular
+tensor matrix_invert_lu(tensor m)
+{
+    assert(m.n == 2 && m.size[0] == m.size[1]);
+    tensor none = {0};
+    size_t n = m.size[0];
+    size_t i;
+    tensor a = tensor_copy(m);
+    size_t *piv = calloc(n, sizeof(size_t));
+    if(!matrix_lu_(a, piv)){
+        tensor_free(a);
+        free(piv);
+        return none;
+    }
+    tensor inv = tensor_make(2, m.size);
+    size_t *row = calloc(n, sizeof(size_t));
+    for(i = 0; i < n; ++i) row[i] = i;
+    for(i = 0; i < n; ++i){
+        size_t swap = row[i];
+        row[i] = row[piv[i]];
+        row[piv[i]] = swap;
+    }
+    for(i = 0; i < n; ++i) inv.data[i*n + row[i]] = 1;
+    solve_triangular(0, 1, a.data, n, 1, n, inv.data, n, n);
+    solve_triangular(1, 0, a.data, n, 1, n, inv.data, n, n);
+    tensor_free(a);
+    free(piv);
+    free(row);
+    return inv;
+}
+
+// Householder reflector that zeroes x below its first element
+// x is overwritten with beta followed by the reflector v, whose leading 1
+// is implied, so that (I - tau v v^T) x = (beta, 0, ..., 0)
+// returns: tau, 0 if x needs no reflecting
+float householder(float *x, size_t n, size_t stride)
+{
+    double sigma = 0;
+    size_t i;
+    for(i = 1; i < n; ++i) sigma += (double)x[i*stride]*x[i*stride];
+    if(sigma == 0) return 0;
+    double alpha = x[0];
+    double beta = -copysign(sqrt(alpha*alpha + sigma), alpha);
+    float scale = 1/(alpha - beta);
+    for(i = 1; i < n; ++i) x[i*stride] *= scale;
+    x[0] = beta;
+    return (beta - alpha)/beta;
+}
+
+// Factor columns j0..j0+jb of a one reflector at a time, updating only the
+// rest of the panel
+void qr_panel(float *a, size_t lda, size_t rows, size_t j0, size_t jb, float *tau, float *w)
+{
+    size_t j, i, c;
+    for(j = j0; j < j0 + jb; ++j){
+        float *col = a + j*lda + j;
+        size_t n = rows - j;
+        size_t nc = j0 + jb - j - 1;
+        tau[j] = householder(col, n, lda);
+        if(tau[j] == 0 || nc == 0) continue;
+        // w = a^T v over the panel columns to the right, then a -= tau v w^T
+        memcpy(w, col + 1, nc*sizeof(float));
+        for(i = 1; i < n; ++i){
+            float v = col[i*lda];
+            const float *ai = col + i*lda + 1;
+            for(c = 0; c < nc; ++c) w[c] += v*ai[c];
+        }
+        for(c = 0; c < nc; ++c) col[1 + c] -= tau[j]*w[c];
+        for(i = 1; i < n; ++i){
+            float v = tau[j]*col[i*lda];
+            float *ai = col + i*lda + 1;
+            for(c = 0; c < nc; ++c) ai[c] -= v*w[c];
+        }
+    }
+}
+
+// Householder QR of the first k columns of a, applying the same
+// reflections to the columns after them
+// Blocked: each panel of QR_BLOCK columns is factored, its reflectors are
+// gathered into I - V T V^T and applied to everything right of it with
+// GEMMs on the thread pool
+// tensor a: (n, cols) matrix with unit column stride, n >= k. R is left on
+// and above the diagonal of the first k columns, the reflectors under it,
+// and Q^T times the remaining columns in their place.
+// float *tau: k scales of the reflectors
+void matrix_qr_(tensor a, size_t k, float *tau)
+{
+    assert(a.n == 2 && a.stride[1] == 1);
+    assert(k <= a.size[0] && k <= a.size[1]);
+    size_t rows = a.size[0];
+    size_t cols = a.size[1];
+    size_t lda = a.stride[0];
+    float *d = a.data;
+    size_t j0, i, c, q;
+    float *v = calloc(rows*QR_BLOCK, sizeof(float));
+    float *w = calloc((cols > QR_BLOCK ? cols : QR_BLOCK)*QR_BLOCK, sizeof(float));
+    float *t = calloc(QR_BLOCK*QR_BLOCK, sizeof(float));
+    float *g = calloc(QR_BLOCK*QR_BLOCK, sizeof(float));
+    for(j0 = 0; j0 < k; j0 += QR_BLOCK){
+        size_t jb = (k - j0 < QR_BLOCK) ? k - j0 : QR_BLOCK;
+        size_t n = rows - j0;
+        size_t nc = cols - j0 - jb;
+        qr_panel(d, lda, rows, j0, jb, tau, w);
+        if(!nc) continue;
+
+        // V: the reflectors as an explicit unit lower trapezoid
+        for(i = 0; i < n; ++i){
+            const float *ai = d + (j0 + i)*lda + j0;
+            for(c = 0; c < jb; ++c){
+                v[i*jb + c] = (i > c) ? ai[c] : (i == c);
+            }
+        }
+        // T upper triangular, T[0:c, c] = -tau_c T[0:c, 0:c] (V^T V)[0:c, c]
+        solve_gemm(jb, jb, n, 1, v, 1, jb, v, jb, 1, 0, g, jb);
+        for(c = 0; c < jb; ++c){
+            t[c*jb + c] = tau[j0 + c];
+            for(i = 0; i < c; ++i){
+                float s = 0;
+                for(q = i; q < c; ++q) s += t[i*jb + q]*g[q*jb + c];
+                t[i*jb + c] = -tau[j0 + c]*s;
+            }
+        }
+        // C <- (I - V T^T V^T) C for the columns right of the panel
+        float *rest = d + j0*lda + j0 + jb;
+        solve_gemm(jb, nc, n, 1, v, 1, jb, rest, lda, 1, 0, w, nc);
+        for(i = jb; i > 0; --i){
+            float *wi = w + (i-1)*nc;
+            float tii = t[(i-1)*jb + i-1];
+            for(c = 0; c < nc; ++c) wi[c] *= tii;
+            for(q = 0; q + 1 < i; ++q){
+                float tq = t[q*jb + i-1];
+                const float *wq = w + q*nc;
+                for(c = 0; c < nc; ++c) wi[c] += tq*wq[c];
+            }
+        }
+        solve_gemm(n, nc, jb, -1, v, jb, 1, w, nc, 1, 1, rest, lda);
+    }
+    free(v);
+    free(w);
+    free(t);
+    free(g);
+}
+
+// Solve A x = b in place for symmetric positive definite A
+// tensor A: contiguous (k, k), overwritten with its Cholesky factor
+// tensor x: contiguous (k, m), b on the way in and x on the way out
+// returns: 0 if A isn't safely positive definite, see matrix_cholesky_
+int cholesky_solve_(tensor A, tensor x)
+{
+    size_t k = A.size[0];
+    size_t m = x.size[1];
+    if(!matrix_cholesky_(A)) return 0;
+    solve_triangular(0, 0, A.data, k, 1, k, x.data, m, m);
+    solve_triangular(1, 0, A.data, 1, k, k, x.data, m, m);
+    return 1;
+}
+
+// Least squares through Cholesky of the normal equations M^T M a = M^T b
+// Only the lower triangle of M^T M is formed. Cheapest for tall M, but it
+// squares M's condition number, so it refuses badly conditioned systems.
+// returns: (k, m) solution, or an empty tensor if M^T M isn't safely
+// positive definite
+tensor solve_system_cholesky(tensor M, tensor b)
+{
+    assert(M.n == 2 && b.n == 2 && M.size[0] == b.size[0]);
+    tensor none = {0};
+    size_t n = M.size[0];
+    size_t k = M.size[1];
+    size_t m = b.size[1];
+    size_t rs = M.stride[0], cs = M.stride[1];
+    size_t i0;
+    tensor A = tensor_vempty(2, k, k);
+    tensor x = tensor_vempty(2, k, m);
+    for(i0 = 0; i0 < k; i0 += SOLVE_BLOCK){
+        size_t ib = (k - i0 < SOLVE_BLOCK) ? k - i0 : SOLVE_BLOCK;
+        solve_gemm(ib, i0 + ib, n, 1, M.data + i0*cs, cs, rs, M.data, rs, cs,
+                0, A.data + i0*k, k);
+    }
+    solve_gemm(k, m, n, 1, M.data, cs, rs, b.data, b.stride[0], b.stride[1], 0, x.data, m);
+    int ok = cholesky_solve_(A, x);
+    tensor_free(A);
+    if(ok) return x;
+    tensor_free(x);
+    return none;
+}
+
+// Solve a symmetric positive definite system A x = b, e.g. normal
+// equations already accumulated by the caller
+// Cholesky when A is well enough conditioned for it, QR otherwise
+// tensor A: (k, k) symmetric positive definite matrix, only its lower
+// triangle is read by Cholesky
+// tensor b: (k, m) right hand sides
+// returns: (k, m) solution, or an empty tensor if A is singular
+tensor solve_system_spd(tensor A, tensor b)
+{
+    assert(A.n == 2 && b.n == 2 && A.size[0] == A.size[1] && A.size[0] == b.size[0]);
+    tensor L = tensor_copy(A);
+    tensor x = tensor_copy(b);
+    int ok = cholesky_solve_(L, x);
+    tensor_free(L);
+    if(ok) return x;
+    tensor_free(x);
+    return solve_system_qr(A, b);
+}
+
+// Least squares through Householder QR, R a = Q^T b
+// Q^T b comes out of factoring M and b side by side, so Q is never formed.
+// returns: (k, m) solution, or an empty tensor if M has fewer rows than
+// columns or is rank deficient
+tensor solve_system_qr(tensor M, tensor b)
+{
+    assert(M.n == 2 && b.n == 2 && M.size[0] == b.size[0]);
+    tensor none = {0};
+    size_t n = M.size[0];
+    size_t k = M.size[1];
+    size_t m = b.size[1];
+    size_t i, j;
+    if(n < k) return none;
+    tensor a = tensor_vempty(2, n, k + m);
+    for(i = 0; i < n; ++i){
+        float *ai = a.data + i*(k + m);
+        for(j = 0; j < k; ++j) ai[j] = M.data[i*M.stride[0] + j*M.stride[1]];
+        for(j = 0; j < m; ++j) ai[k + j] = b.data[i*b.stride[0] + j*b.stride[1]];
+    }
+    float *tau = calloc(k, sizeof(float));
+    matrix_qr_(a, k, tau);
+    free(tau);
+
+    float big = 0;
+    for(j = 0; j < k; ++j){
+        float r = fabsf(a.data[j*(k + m) + j]);
+        if(r > big) big = r;
+    }
+    for(j = 0; j < k; ++j){
+        if(!(fabsf(a.data[j*(k + m) + j]) > big*k*FLT_EPSILON)){
+            tensor_free(a);
+            return none;
+        }
+    }
+    tensor x = tensor_vempty(2, k, m);
+    for(i = 0; i < k; ++i){
+        memcpy(x.data + i*m, a.data + i*(k + m) + k, m*sizeof(float));
+    }
+    solve_triangular(1, 0, a.data, k + m, 1, k, x.data, m, m);
+    tensor_free(a);
+    return x;
+}
+
+// Least squares by factorization, never forming an inverse
+// Tall systems try Cholesky of the normal equations first, everything
+// else, and the tall ones too badly conditioned for it, goes through QR
+tensor solve_system_factored(tensor M, tensor b)
+{
+    if(M.size[0] >= SOLVE_NORMAL_RATIO*M.size[1]){
+        tensor a = solve_system_cholesky(M, b);
+        if(a.data) return a;
+    }
+    return solve_system_qr(M, b);
+}
+
+// Most sweeps of Jacobi rotations matrix_svd does before giving up
+#define SVD_MAX_SWEEPS 30
+// Two vectors count as orthogonal when their cosine is below this
+#define SVD_TOL 1e-6
+
+typedef struct svd_job {
+    float *g;          // r x len vectors being orthogonalized
+    float *w;          // r x r rotations applied so far
+    size_t r;
+    size_t len;
+    const size_t *pair; // 2*(r/2) indices paired off this round
+    int rotated;
+} svd_job;
+
+// Rotate each pair of vectors so they are orthogonal, applying the same
+// rotation to the accumulated ones
+void svd_rotate_part(void *ctx, size_t start, size_t end)
+{
+    svd_job *j = ctx;
+    size_t k, i;
+    int rotated = 0;
+    for(k = start; k < end; ++k){
+        size_t p = j->pair[2*k], q = j->pair[2*k + 1];
+        if(p >= j->r || q >= j->r) continue;
+        float *gp = j->g + p*j->len, *gq = j->g + q*j->len;
+        double alpha = 0, beta = 0, gamma = 0;
+        for(i = 0; i < j->len; ++i){
+            alpha += (double)gp[i]*gp[i];
+            beta  += (double)gq[i]*gq[i];
+            gamma += (double)gp[i]*gq[i];
+        }
+        if(alpha == 0 || beta == 0 || fabs(gamma) <= SVD_TOL*sqrt(alpha*beta)) continue;
+        double zeta = (beta - alpha)/(2*gamma);
+        double t = (zeta >= 0 ? 1 : -1)/(fabs(zeta) + sqrt(1 + zeta*zeta));
+        float c = 1/sqrt(1 + t*t);
+        float s = c*t;
+        for(i = 0; i < j->len; ++i){
+            float x = gp[i], y = gq[i];
+            gp[i] = c*x - s*y;
+            gq[i] = s*x + c*y;
+        }
+        float *wp = j->w + p*j->r, *wq = j->w + q*j->r;
+        for(i = 0; i < j->r; ++i){
+            float x = wp[i], y = wq[i];
+            wp[i] = c*x - s*y;
+            wq[i] = s*x + c*y;
+        }
+        rotated = 1;
+    }
+    if(rotated) __atomic_store_n(&j->rotated, 1, __ATOMIC_RELAXED);
+}
+
+// Singular value decomposition a = u diag(s) v^T, by one-sided Jacobi
+// The vectors along a's shorter side are rotated pairwise until they are
+// orthogonal. Each round rotates disjoint pairs, which run on the thread
+// pool, and rounds follow a round-robin schedule so every pair meets once
+// a sweep.
+// tensor a: (m, n) matrix to decompose
+// tensor *u: set to (m, r) left singular vectors, r = min(m, n)
+// tensor *s: set to (r) singular values, largest first
+// tensor *v: set to (n, r) right singular vectors
+void matrix_svd(tensor a, tensor *u, tensor *s, tensor *v)
+{
+    assert(a.n == 2);
+    size_t m = a.size[0];
+    size_t n = a.size[1];
+    int tall = m >= n;
+    size_t r = tall ? n : m;
+    size_t len = tall ? m : n;
+    size_t i, j, sweep, round;
+
+    // rows of g are the columns of a when it is tall, its rows otherwise
+    tensor g = tall ? tensor_vempty(2, r, len) : tensor_copy(a);
+    if(tall) matrix_transpose_into(g, a);
+    tensor w = tensor_vmake(2, r, r);
+    for(i = 0; i < r; ++i) w.data[i*r + i] = 1;
+
+    size_t players = r + (r & 1);
+    size_t *order = calloc(players, sizeof(size_t));
+    size_t *pair = calloc(players, sizeof(size_t));
+    for(i = 0; i < players; ++i) order[i] = i;
+    svd_job job = {g.data, w.data, r, len, pair, 0};
+    for(sweep = 0; sweep < SVD_MAX_SWEEPS; ++sweep){
+        job.rotated = 0;
+        for(round = 0; round + 1 < players; ++round){
+            for(i = 0; i < players/2; ++i){
+                pair[2*i] = order[i];
+                pair[2*i + 1] = order[players - 1 - i];
+            }
+            parallel_for(players/2, 1, svd_rotate_part, &job);
+            // keep the first player, rotate the others one seat
+            size_t last = order[players - 1];
+            for(i = players - 1; i > 1; --i) order[i] = order[i-1];
+            if(players > 1) order[1] = last;
+        }
+        if(!job.rotated) break;
+    }
+
+    // the singular values are the lengths of the rotated vectors
+    float *sigma = calloc(r, sizeof(float));
+    for(i = 0; i < r; ++i){
+        double sum = 0;
+        for(j = 0; j < len; ++j) sum += (double)g.data[i*len + j]*g.data[i*len + j];
+        sigma[i] = sqrt(sum);
+        order[i] = i;
+    }
+    for(i = 1; i < r; ++i){
+        size_t k = order[i];
+        for(j = i; j > 0 && sigma[order[j-1]] < sigma[k]; --j) order[j] = order[j-1];
+        order[j] = k;
+    }
+
+    tensor longer = tensor_vmake(2, len, r);
+    tensor shorter = tensor_vmake(2, r, r);
+    *s = tensor_vmake(1, r);
+    for(j = 0; j < r; ++j){
+        size_t k = order[j];
+        float inv = sigma[k] > 0 ? 1/sigma[k] : 0;
+        s->data[j] = sigma[k];
+        for(i = 0; i < len; ++i) longer.data[i*r + j] = g.data[k*len + i]*inv;
+        for(i = 0; i < r; ++i) shorter.data[i*r + j] = w.data[k*r + i];
+    }
+    *u = tall ? longer : shorter;
+    *v = tall ? shorter : longer;
+
+    tensor_free(g);
+    tensor_free(w);
+    free(order);
+    free(pair);
+    free(sigma);
+}
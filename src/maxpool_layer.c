@@ -13,7 +13,7 @@ tensor forward_maxpool_layer(layer *l, tensor x)
     // Saving our input
     // Probably don't change this
     tensor_free(l->x);
-    l->x = tensor_copy(x);
+    l->x = tensor_ref(x);
 
     assert(x.n == 4);
 
@@ -1,11 +1,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "dubnet.h"
+#include "sparse.h"
+#include "winograd.h"
 
 tensor forward_net(net m, tensor input)
 {
     int i;
-    tensor x = tensor_copy(input);
+    tensor x = tensor_ref(input);
     for (i = 0; i < m.n; ++i) {
         layer *l = &m.layers[i];
         tensor y = l->forward(l, x);
@@ -18,7 +20,7 @@ tensor forward_net(net m, tensor input)
 
 void backward_net(net m, tensor d)
 {
-    tensor dy = tensor_copy(d);
+    tensor dy = tensor_ref(d);
     int i;
     for (i = m.n-1; i >= 0; --i) {
         layer *l = &m.layers[i];
@@ -46,6 +48,8 @@ void free_layer(layer l)
     tensor_free(l.b);
     tensor_free(l.db);
     tensor_free(l.x);
+    free_sparse(l.sw);
+    free_winograd(l.wg);
 }
 
 void free_net(net n)
@@ -82,9 +86,12 @@ void load_weights(net m, char *filename)
     if(!fp) file_error(filename);
     int i;
     for(i = 0; i < m.n; ++i){
-        layer l = m.layers[i];
-        if(l.b.data) tensor_read(l.b, fp);
-        if(l.w.data) tensor_read(l.w, fp);
+        layer *l = &m.layers[i];
+        // written in place, so they get storage of their own first
+        tensor_unshare(&l->b);
+        tensor_unshare(&l->w);
+        if(l->b.data) tensor_read(l->b, fp);
+        if(l->w.data) tensor_read(l->w, fp);
     }
     fclose(fp);
 }
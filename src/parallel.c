@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "parallel.h"
+
+// One parallel_for call: the range is cut into chunks that the calling
+// thread and the workers claim one at a time until none are left
+typedef struct parallel_job {
+    parallel_fn fn;
+    void *ctx;
+    size_t n;
+    size_t chunk;
+    size_t chunks;
+    size_t next;    // next chunk to hand out, claimed atomically
+    int active;     // workers currently running chunks of this job
+} parallel_job;
+
+static pthread_once_t parallel_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t parallel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parallel_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t parallel_idle = PTHREAD_COND_INITIALIZER;
+// Held while a job runs or the workers are being replaced
+static pthread_mutex_t parallel_run = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t *parallel_workers = 0;
+static int parallel_nworkers = 0;
+static int parallel_stop = 0;
+static parallel_job *parallel_current = 0;
+static size_t parallel_generation = 0;
+static __thread int parallel_inside = 0;
+
+// Run chunks of a job until they have all been claimed
+void parallel_work(parallel_job *j)
+{
+    size_t c;
+    while((c = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->chunks){
+        size_t start = c*j->chunk;
+        size_t end = (start + j->chunk < j->n) ? start + j->chunk : j->n;
+        j->fn(j->ctx, start, end);
+    }
+}
+
+void *parallel_worker(void *arg)
+{
+    size_t seen = 0;
+    parallel_inside = 1;
+    pthread_mutex_lock(&parallel_lock);
+    while(1){
+        while(!parallel_stop && (!parallel_current || parallel_generation == seen)){
+            pthread_cond_wait(&parallel_wake, &parallel_lock);
+        }
+        if(parallel_stop) break;
+        seen = parallel_generation;
+        parallel_job *j = parallel_current;
+        ++j->active;
+        pthread_mutex_unlock(&parallel_lock);
+
+        parallel_work(j);
+
+        pthread_mutex_lock(&parallel_lock);
+        if(--j->active == 0) pthread_cond_broadcast(&parallel_idle);
+    }
+    pthread_mutex_unlock(&parallel_lock);
+    return 0;
+}
+
+// Replace the workers with a new set, the caller counts as one thread
+// Must hold parallel_run
+// int n: total number of threads to use
+void parallel_spawn(int n)
+{
+    int i;
+    pthread_mutex_lock(&parallel_lock);
+    parallel_stop = 1;
+    pthread_cond_broadcast(&parallel_wake);
+    pthread_mutex_unlock(&parallel_lock);
+    for(i = 0; i < parallel_nworkers; ++i){
+        pthread_join(parallel_workers[i], 0);
+    }
+    free(parallel_workers);
+
+    parallel_stop = 0;
+    parallel_nworkers = (n > 1) ? n - 1 : 0;
+    parallel_workers = calloc(parallel_nworkers, sizeof(pthread_t));
+    for(i = 0; i < parallel_nworkers; ++i){
+        if(pthread_create(&parallel_workers[i], 0, parallel_worker, 0)){
+            fprintf(stderr, "Couldn't start worker thread, using %d threads\n", i + 1);
+            parallel_nworkers = i;
+            break;
+        }
+    }
+}
+
+void parallel_init()
+{
+    int n = sysconf(_SC_NPROCESSORS_ONLN);
+    char *env = getenv("DUBNET_THREADS");
+    if(env){
+        if(atoi(env) > 0) n = atoi(env);
+        else fprintf(stderr, "Bad DUBNET_THREADS %s, expected a positive number\n", env);
+    }
+    pthread_mutex_lock(&parallel_run);
+    parallel_spawn(n);
+    pthread_mutex_unlock(&parallel_run);
+}
+
+// Number of threads parallel_for spreads work over, including the caller
+int parallel_threads()
+{
+    pthread_once(&parallel_once, parallel_init);
+    return parallel_nworkers + 1;
+}
+
+// Change the number of threads, e.g. to measure scaling
+// int n: total number of threads, 1 runs everything on the caller
+void parallel_set_threads(int n)
+{
+    pthread_once(&parallel_once, parallel_init);
+    pthread_mutex_lock(&parallel_run);
+    parallel_spawn(n);
+    pthread_mutex_unlock(&parallel_run);
+}
+
+// Run fn over the range [0, n) split into pieces across the threads
+// Each call of fn gets a disjoint [start, end) piece of the range
+// size_t n: size of the range
+// size_t grain: smallest piece worth handing to another thread
+// parallel_fn fn: function to run on each piece
+// void *ctx: passed through to fn
+void parallel_for(size_t n, size_t grain, parallel_fn fn, void *ctx)
+{
+    if(n == 0) return;
+    pthread_once(&parallel_once, parallel_init);
+    if(grain < 1) grain = 1;
+    size_t chunks = (n + grain - 1)/grain;
+    if(chunks <= 1 || parallel_inside || pthread_mutex_trylock(&parallel_run)){
+        fn(ctx, 0, n);
+        return;
+    }
+    if(parallel_nworkers == 0){
+        pthread_mutex_unlock(&parallel_run);
+        fn(ctx, 0, n);
+        return;
+    }
+
+    // a few chunks per thread so uneven pieces even out
+    size_t most = 4*(size_t)(parallel_nworkers + 1);
+    if(chunks > most) chunks = most;
+    parallel_job j = {0};
+    j.fn = fn;
+    j.ctx = ctx;
+    j.n = n;
+    j.chunk = (n + chunks - 1)/chunks;
+    j.chunks = (n + j.chunk - 1)/j.chunk;
+
+    pthread_mutex_lock(&parallel_lock);
+    parallel_current = &j;
+    ++parallel_generation;
+    pthread_cond_broadcast(&parallel_wake);
+    pthread_mutex_unlock(&parallel_lock);
+
+    parallel_inside = 1;
+    parallel_work(&j);
+    parallel_inside = 0;
+
+    // every chunk is claimed, wait for the workers still running theirs
+    pthread_mutex_lock(&parallel_lock);
+    while(j.active) pthread_cond_wait(&parallel_idle, &parallel_lock);
+    parallel_current = 0;
+    pthread_mutex_unlock(&parallel_lock);
+    pthread_mutex_unlock(&parallel_run);
+}
@@ -0,0 +1,23 @@
+// Include guards and C++ compatibility
+#ifndef PARALLEL_H
+#define PARALLEL_H
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Persistent pool of worker threads shared by every parallel kernel
+// The thread count defaults to the number of online cpus and can be set
+// with the DUBNET_THREADS environment variable or parallel_set_threads.
+// Calls from inside a parallel_for body, or while another thread is
+// already running one, just run serially on the calling thread.
+typedef void (*parallel_fn)(void *ctx, size_t start, size_t end);
+
+void parallel_for(size_t n, size_t grain, parallel_fn fn, void *ctx);
+int parallel_threads();
+void parallel_set_threads(int n);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "pool.h"
+
+#define POOL_ALIGN 64
+// 4 size classes per power of two, so at most 25% of a buffer is unused
+#define POOL_STEPS 4
+#define POOL_CLASSES (64*POOL_STEPS)
+
+typedef struct pool_node {
+    struct pool_node *next;
+} pool_node;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_node *pool_lists[POOL_CLASSES];
+static pool_stats pool_state = {0, 0, 0, 0, (size_t)1 << 30};
+
+// Size class of an allocation
+// size_t bytes: requested size
+// size_t *class_bytes: set to the size actually allocated for the class
+// returns: index of the class' free list
+size_t pool_class(size_t bytes, size_t *class_bytes)
+{
+    // keeps every class a multiple of the alignment
+    if(bytes < POOL_STEPS*POOL_ALIGN) bytes = POOL_STEPS*POOL_ALIGN;
+    size_t log = 63 - __builtin_clzl(bytes);
+    size_t base = (size_t)1 << log;
+    size_t step = base / POOL_STEPS;
+    size_t sub = (bytes - base + step - 1) / step;
+    *class_bytes = base + sub*step;
+    return log*POOL_STEPS + sub;
+}
+
+// Allocate an uninitialized buffer, reusing a pooled one if possible
+// size_t bytes: number of bytes needed
+// returns: 64-byte aligned buffer, release with pool_free
+void *pool_alloc(size_t bytes)
+{
+    size_t class_bytes;
+    size_t c = pool_class(bytes, &class_bytes);
+    pthread_mutex_lock(&pool_lock);
+    pool_node *p = pool_lists[c];
+    if(p){
+        pool_lists[c] = p->next;
+        ++pool_state.hits;
+        pool_state.bytes_held -= class_bytes;
+        --pool_state.buffers_held;
+    } else {
+        ++pool_state.misses;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if(!p) p = aligned_alloc(POOL_ALIGN, class_bytes);
+    assert(p);
+    return p;
+}
+
+// Allocate a zeroed buffer, reusing a pooled one if possible
+// size_t bytes: number of bytes needed
+// returns: 64-byte aligned buffer, release with pool_free
+void *pool_calloc(size_t bytes)
+{
+    void *p = pool_alloc(bytes);
+    memset(p, 0, bytes);
+    return p;
+}
+
+// Return a buffer to the pool
+// Buffers beyond the pool's limit go straight back to the system
+// void *p: buffer from pool_alloc or pool_calloc
+// size_t bytes: size it was allocated with
+void pool_free(void *p, size_t bytes)
+{
+    if(!p) return;
+    size_t class_bytes;
+    size_t c = pool_class(bytes, &class_bytes);
+    pthread_mutex_lock(&pool_lock);
+    if(pool_state.bytes_held + class_bytes <= pool_state.limit){
+        pool_node *n = p;
+        n->next = pool_lists[c];
+        pool_lists[c] = n;
+        pool_state.bytes_held += class_bytes;
+        ++pool_state.buffers_held;
+        p = 0;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(p);
+}
+
+// Give every pooled buffer back to the system
+void pool_trim()
+{
+    size_t c;
+    pthread_mutex_lock(&pool_lock);
+    for(c = 0; c < POOL_CLASSES; ++c){
+        while(pool_lists[c]){
+            pool_node *next = pool_lists[c]->next;
+            free(pool_lists[c]);
+            pool_lists[c] = next;
+        }
+    }
+    pool_state.bytes_held = 0;
+    pool_state.buffers_held = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Set how many bytes the pool may hold on to, trimming if it's over
+// size_t bytes: new limit, 0 disables pooling
+void pool_set_limit(size_t bytes)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_state.limit = bytes;
+    int over = pool_state.bytes_held > bytes;
+    pthread_mutex_unlock(&pool_lock);
+    if(over) pool_trim();
+}
+
+pool_stats pool_get_stats()
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_stats s = pool_state;
+    pthread_mutex_unlock(&pool_lock);
+    return s;
+}
+
+void pool_print_stats(FILE *fp)
+{
+    pool_stats s = pool_get_stats();
+    size_t total = s.hits + s.misses;
+    fprintf(fp, "pool: %ld allocations, %.1f%% hit rate, holding %ld buffers (%.2f MB)\n",
+            total, total ? 100.*s.hits/total : 0., s.buffers_held, s.bytes_held/1048576.);
+}
@@ -0,0 +1,31 @@
+// Include guards and C++ compatibility
+#ifndef POOL_H
+#define POOL_H
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Thread-safe buffer pool with free lists per size class
+// Buffers released with pool_free are handed out again by later
+// allocations of the same size class instead of going back to the system
+typedef struct pool_stats {
+    size_t hits;
+    size_t misses;
+    size_t bytes_held;
+    size_t buffers_held;
+    size_t limit;
+} pool_stats;
+
+void *pool_alloc(size_t bytes);
+void *pool_calloc(size_t bytes);
+void pool_free(void *p, size_t bytes);
+void pool_trim();
+void pool_set_limit(size_t bytes);
+pool_stats pool_get_stats();
+void pool_print_stats(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+// Kernels are picked once, from the best instruction set the CPU supports
+// Set DUBNET_ISA to scalar, avx2 or avx512 to force a lower level
+static const simd_kernels *simd_current = 0;
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+// Strided loop shared by every instruction set for the leftover elements
+#define SIMD_TAIL(SOP) \
+    for(; i < n; ++i){ t[i] = a[i*sa] SOP b[i*sb]; }
+
+// One vectorized loop per broadcast pattern, then a scalar tail
+#define SIMD_LOOP(VEC, W, LOAD, STORE, SET1, VOP, SOP) do { \
+    size_t i = 0; \
+    if(sa && sb){ \
+        for(; i + W <= n; i += W) STORE(t + i, VOP(LOAD(a + i), LOAD(b + i))); \
+    } else if(sa){ \
+        VEC vb = SET1(b[0]); \
+        for(; i + W <= n; i += W) STORE(t + i, VOP(LOAD(a + i), vb)); \
+    } else { \
+        VEC va = SET1(a[0]); \
+        for(; i + W <= n; i += W) STORE(t + i, VOP(va, LOAD(b + i))); \
+    } \
+    SIMD_TAIL(SOP) \
+} while(0)
+
+void axpy_scalar(size_t n, float a, const float *x, float *y)
+{
+    size_t i;
+    for(i = 0; i < n; ++i) y[i] += a*x[i];
+}
+
+void scale_scalar(size_t n, float s, float *x)
+{
+    size_t i;
+    for(i = 0; i < n; ++i) x[i] *= s;
+}
+
+float sum_scalar(size_t n, const float *x)
+{
+    size_t i;
+    float s = 0;
+    for(i = 0; i < n; ++i) s += x[i];
+    return s;
+}
+
+void binary_scalar(BINARY_OP op, size_t n, const float *a, size_t sa, const float *b, size_t sb, float *t)
+{
+    size_t i = 0;
+    switch(op){
+        case ADD_OP: SIMD_TAIL(+); break;
+        case SUB_OP: SIMD_TAIL(-); break;
+        case MUL_OP: SIMD_TAIL(*); break;
+        case DIV_OP: SIMD_TAIL(/); break;
+    }
+}
+
+void transpose8_scalar(const float *a, size_t lda, float *t, size_t ldt)
+{
+    size_t i, j;
+    for(i = 0; i < 8; ++i){
+        for(j = 0; j < 8; ++j){
+            t[j*ldt + i] = a[i*lda + j];
+        }
+    }
+}
+
+static const simd_kernels simd_scalar = {ISA_SCALAR, "scalar",
+    axpy_scalar, scale_scalar, sum_scalar, binary_scalar, transpose8_scalar};
+
+#ifdef SIMD_X86
+
+#define AVX2 __attribute__((target("avx2,fma")))
+#define AVX512 __attribute__((target("avx512f")))
+
+AVX2 void axpy_avx2(size_t n, float a, const float *x, float *y)
+{
+    size_t i = 0;
+    __m256 va = _mm256_set1_ps(a);
+    for(; i + 16 <= n; i += 16){
+        __m256 y0 = _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+        __m256 y1 = _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8));
+        _mm256_storeu_ps(y + i, y0);
+        _mm256_storeu_ps(y + i + 8, y1);
+    }
+    for(; i < n; ++i) y[i] += a*x[i];
+}
+
+AVX2 void scale_avx2(size_t n, float s, float *x)
+{
+    size_t i = 0;
+    __m256 vs = _mm256_set1_ps(s);
+    for(; i + 8 <= n; i += 8) _mm256_storeu_ps(x + i, _mm256_mul_ps(vs, _mm256_loadu_ps(x + i)));
+    for(; i < n; ++i) x[i] *= s;
+}
+
+AVX2 float sum_avx2(size_t n, const float *x)
+{
+    size_t i = 0;
+    __m256 s0 = _mm256_setzero_ps();
+    __m256 s1 = _mm256_setzero_ps();
+    for(; i + 16 <= n; i += 16){
+        s0 = _mm256_add_ps(s0, _mm256_loadu_ps(x + i));
+        s1 = _mm256_add_ps(s1, _mm256_loadu_ps(x + i + 8));
+    }
+    s0 = _mm256_add_ps(s0, s1);
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(s0), _mm256_extractf128_ps(s0, 1));
+    h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_add_ss(h, _mm_movehdup_ps(h));
+    float s = _mm_cvtss_f32(h);
+    for(; i < n; ++i) s += x[i];
+    return s;
+}
+
+AVX2 void binary_avx2(BINARY_OP op, size_t n, const float *a, size_t sa, const float *b, size_t sb, float *t)
+{
+    switch(op){
+        case ADD_OP: SIMD_LOOP(__m256, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_add_ps, +); break;
+        case SUB_OP: SIMD_LOOP(__m256, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_sub_ps, -); break;
+        case MUL_OP: SIMD_LOOP(__m256, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_mul_ps, *); break;
+        case DIV_OP: SIMD_LOOP(__m256, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_div_ps, /); break;
+    }
+}
+
+// 8x8 transpose in registers: interleave pairs of rows, then pairs of
+// pairs, then swap 128-bit halves
+AVX2 void transpose8_avx2(const float *a, size_t lda, float *t, size_t ldt)
+{
+    __m256 r0 = _mm256_loadu_ps(a + 0*lda), r1 = _mm256_loadu_ps(a + 1*lda);
+    __m256 r2 = _mm256_loadu_ps(a + 2*lda), r3 = _mm256_loadu_ps(a + 3*lda);
+    __m256 r4 = _mm256_loadu_ps(a + 4*lda), r5 = _mm256_loadu_ps(a + 5*lda);
+    __m256 r6 = _mm256_loadu_ps(a + 6*lda), r7 = _mm256_loadu_ps(a + 7*lda);
+
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+    __m256 t4 = _mm256_unpacklo_ps(r4, r5), t5 = _mm256_unpackhi_ps(r4, r5);
+    __m256 t6 = _mm256_unpacklo_ps(r6, r7), t7 = _mm256_unpackhi_ps(r6, r7);
+
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+    _mm256_storeu_ps(t + 0*ldt, _mm256_permute2f128_ps(s0, s4, 0x20));
+    _mm256_storeu_ps(t + 1*ldt, _mm256_permute2f128_ps(s1, s5, 0x20));
+    _mm256_storeu_ps(t + 2*ldt, _mm256_permute2f128_ps(s2, s6, 0x20));
+    _mm256_storeu_ps(t + 3*ldt, _mm256_permute2f128_ps(s3, s7, 0x20));
+    _mm256_storeu_ps(t + 4*ldt, _mm256_permute2f128_ps(s0, s4, 0x31));
+    _mm256_storeu_ps(t + 5*ldt, _mm256_permute2f128_ps(s1, s5, 0x31));
+    _mm256_storeu_ps(t + 6*ldt, _mm256_permute2f128_ps(s2, s6, 0x31));
+    _mm256_storeu_ps(t + 7*ldt, _mm256_permute2f128_ps(s3, s7, 0x31));
+}
+
+static const simd_kernels simd_avx2 = {ISA_AVX2, "avx2",
+    axpy_avx2, scale_avx2, sum_avx2, binary_avx2, transpose8_avx2};
+
+AVX512 void axpy_avx512(size_t n, float a, const float *x, float *y)
+{
+    size_t i = 0;
+    __m512 va = _mm512_set1_ps(a);
+    for(; i + 32 <= n; i += 32){
+        __m512 y0 = _mm512_fmadd_ps(va, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+        __m512 y1 = _mm512_fmadd_ps(va, _mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16));
+        _mm512_storeu_ps(y + i, y0);
+        _mm512_storeu_ps(y + i + 16, y1);
+    }
+    if(i < n){
+        __mmask16 m = (n - i) >= 16 ? 0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(y + i, m, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i)));
+        for(i += 16; i < n; ++i) y[i] += a*x[i];
+    }
+}
+
+AVX512 void scale_avx512(size_t n, float s, float *x)
+{
+    size_t i = 0;
+    __m512 vs = _mm512_set1_ps(s);
+    for(; i + 16 <= n; i += 16) _mm512_storeu_ps(x + i, _mm512_mul_ps(vs, _mm512_loadu_ps(x + i)));
+    if(i < n){
+        __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(x + i, m, _mm512_mul_ps(vs, _mm512_maskz_loadu_ps(m, x + i)));
+    }
+}
+
+AVX512 float sum_avx512(size_t n, const float *x)
+{
+    size_t i = 0;
+    __m512 s0 = _mm512_setzero_ps();
+    __m512 s1 = _mm512_setzero_ps();
+    for(; i + 32 <= n; i += 32){
+        s0 = _mm512_add_ps(s0, _mm512_loadu_ps(x + i));
+        s1 = _mm512_add_ps(s1, _mm512_loadu_ps(x + i + 16));
+    }
+    for(; i < n; i += 16){
+        __mmask16 m = (n - i) >= 16 ? 0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        s0 = _mm512_add_ps(s0, _mm512_maskz_loadu_ps(m, x + i));
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+}
+
+AVX512 void binary_avx512(BINARY_OP op, size_t n, const float *a, size_t sa, const float *b, size_t sb, float *t)
+{
+    switch(op){
+        case ADD_OP: SIMD_LOOP(__m512, 16, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, _mm512_add_ps, +); break;
+        case SUB_OP: SIMD_LOOP(__m512, 16, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, _mm512_sub_ps, -); break;
+        case MUL_OP: SIMD_LOOP(__m512, 16, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, _mm512_mul_ps, *); break;
+        case DIV_OP: SIMD_LOOP(__m512, 16, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, _mm512_div_ps, /); break;
+    }
+}
+
+static const simd_kernels simd_avx512 = {ISA_AVX512, "avx512",
+    axpy_avx512, scale_avx512, sum_avx512, binary_avx512, transpose8_avx2};
+
+#endif
+
+// Highest instruction set level both the CPU and the OS support
+ISA simd_detect()
+{
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) return ISA_AVX512;
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return ISA_AVX2;
+#endif
+    return ISA_SCALAR;
+}
+
+void simd_use(ISA isa)
+{
+    ISA best = simd_detect();
+    if(isa > best){
+        fprintf(stderr, "Instruction set not supported, using best available\n");
+        isa = best;
+    }
+    simd_current = &simd_scalar;
+#ifdef SIMD_X86
+    if(isa == ISA_AVX2) simd_current = &simd_avx2;
+    if(isa == ISA_AVX512) simd_current = &simd_avx512;
+#endif
+}
+
+void simd_init()
+{
+    ISA isa = simd_detect();
+    char *env = getenv("DUBNET_ISA");
+    if(env){
+        if(0 == strcmp(env, "scalar")) isa = ISA_SCALAR;
+        else if(0 == strcmp(env, "avx2")) isa = ISA_AVX2;
+        else if(0 == strcmp(env, "avx512")) isa = ISA_AVX512;
+        else fprintf(stderr, "Unknown DUBNET_ISA %s, expected scalar, avx2 or avx512\n", env);
+    }
+    simd_use(isa);
+}
+
+// Switch to the kernels for an instruction set level, e.g. for testing
+// Levels the CPU doesn't support fall back to the best one it does
+// ISA isa: level to use
+void simd_set_isa(ISA isa)
+{
+    pthread_once(&simd_once, simd_init);
+    simd_use(isa);
+}
+
+// Kernels for the selected instruction set, picked on first use
+const simd_kernels *simd()
+{
+    pthread_once(&simd_once, simd_init);
+    return simd_current;
+}
@@ -0,0 +1,34 @@
+// Include guards and C++ compatibility
+#ifndef SIMD_H
+#define SIMD_H
+#include <stddef.h>
+#include "tensor.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Instruction set levels we have kernels for, in increasing order
+typedef enum{ISA_SCALAR, ISA_AVX2, ISA_AVX512} ISA;
+
+// Elementwise kernels over dense float arrays
+// binary computes t = a op b where a and b are either arrays (stride 1)
+// or a single broadcast value (stride 0), transpose8 writes the transpose
+// of an 8x8 block with row strides lda into one with row strides ldt
+typedef struct simd_kernels {
+    ISA isa;
+    const char *name;
+    void  (*axpy)   (size_t n, float a, const float *x, float *y);
+    void  (*scale)  (size_t n, float s, float *x);
+    float (*sum)    (size_t n, const float *x);
+    void  (*binary) (BINARY_OP op, size_t n, const float *a, size_t sa, const float *b, size_t sb, float *t);
+    void  (*transpose8) (const float *a, size_t lda, float *t, size_t ldt);
+} simd_kernels;
+
+const simd_kernels *simd();
+ISA simd_detect();
+void simd_set_isa(ISA isa);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
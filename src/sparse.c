@@ -0,0 +1,141 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sparse.h"
+#include "matrix.h"
+#include "simd.h"
+#include "parallel.h"
+
+// Batches at least this big are multiplied one row of a at a time with
+// axpys along the batch, smaller ones one dot product at a time
+#define SPARSE_AXPY_MIN 8
+
+// Compress the nonzeros of a matrix
+// tensor a: matrix to compress, may be a strided view
+// returns: sparse copy of a, release with free_sparse
+sparse_matrix *sparse_from_dense(const tensor a)
+{
+    assert(a.n == 2);
+    size_t rows = a.size[0];
+    size_t cols = a.size[1];
+    size_t i, j;
+    sparse_matrix *s = calloc(1, sizeof(sparse_matrix));
+    s->rows = rows;
+    s->cols = cols;
+    s->row = calloc(rows + 1, sizeof(size_t));
+    for(i = 0; i < rows; ++i){
+        size_t count = 0;
+        for(j = 0; j < cols; ++j){
+            if(a.data[i*a.stride[0] + j*a.stride[1]] != 0) ++count;
+        }
+        s->row[i+1] = s->row[i] + count;
+    }
+    s->nnz = s->row[rows];
+    s->col = calloc(s->nnz, sizeof(uint32_t));
+    s->val = calloc(s->nnz, sizeof(float));
+    size_t p = 0;
+    for(i = 0; i < rows; ++i){
+        for(j = 0; j < cols; ++j){
+            float v = a.data[i*a.stride[0] + j*a.stride[1]];
+            if(v == 0) continue;
+            s->col[p] = j;
+            s->val[p] = v;
+            ++p;
+        }
+    }
+    return s;
+}
+
+// Expand a sparse matrix back into a dense one
+tensor sparse_to_dense(const sparse_matrix *s)
+{
+    tensor t = tensor_vmake(2, s->rows, s->cols);
+    size_t i, p;
+    for(i = 0; i < s->rows; ++i){
+        for(p = s->row[i]; p < s->row[i+1]; ++p){
+            t.data[i*s->cols + s->col[p]] = s->val[p];
+        }
+    }
+    return t;
+}
+
+void free_sparse(sparse_matrix *s)
+{
+    if(!s) return;
+    free(s->row);
+    free(s->col);
+    free(s->val);
+    free(s);
+}
+
+typedef struct sparse_job {
+    const sparse_matrix *a;
+    tensor x;      // (batch, a->cols) input, or its transpose for axpys
+    float *y;      // (a->rows, batch) output for axpys
+    tensor t;
+} sparse_job;
+
+// Rows start..end of a against the transposed batch: y[i] = sum a[i, c] x^T[c]
+void sparse_axpy_part(void *ctx, size_t start, size_t end)
+{
+    sparse_job *j = ctx;
+    const sparse_matrix *a = j->a;
+    size_t batch = j->x.size[1];
+    void (*axpy)(size_t, float, const float *, float *) = simd()->axpy;
+    size_t i, p;
+    for(i = start; i < end; ++i){
+        float *yi = j->y + i*batch;
+        memset(yi, 0, batch*sizeof(float));
+        for(p = a->row[i]; p < a->row[i+1]; ++p){
+            axpy(batch, a->val[p], j->x.data + a->col[p]*batch, yi);
+        }
+    }
+}
+
+// Rows start..end of a as dot products with each example of the batch
+void sparse_dot_part(void *ctx, size_t start, size_t end)
+{
+    sparse_job *j = ctx;
+    const sparse_matrix *a = j->a;
+    tensor x = j->x, t = j->t;
+    size_t i, b, p;
+    for(b = 0; b < x.size[0]; ++b){
+        const float *xb = x.data + b*x.stride[0];
+        for(i = start; i < end; ++i){
+            float sum = 0;
+            for(p = a->row[i]; p < a->row[i+1]; ++p){
+                sum += a->val[p]*xb[a->col[p]*x.stride[1]];
+            }
+            t.data[b*t.stride[0] + i*t.stride[1]] = sum;
+        }
+    }
+}
+
+// Sparse-dense multiply t = x a^T, spread over the rows of a
+// Big batches are transposed so each nonzero of a becomes one vectorized
+// axpy along the batch, small ones gather x for each nonzero instead.
+// tensor t: (batch, a->rows) output, may be a strided view
+// tensor x: (batch, a->cols) input, may be a strided view
+// sparse_matrix *a: sparse operand, e.g. transposed weights of a layer
+void sparse_multiply_t_into(tensor t, const tensor x, const sparse_matrix *a)
+{
+    assert(x.n == 2 && t.n == 2);
+    assert(x.size[1] == a->cols);
+    assert(t.size[0] == x.size[0] && t.size[1] == a->rows);
+    size_t batch = x.size[0];
+    size_t grain = a->nnz ? 1 + 4096*a->rows/(a->nnz*batch + 1) : a->rows;
+    sparse_job j = {a, x, 0, t};
+    if(batch < SPARSE_AXPY_MIN){
+        parallel_for(a->rows, grain, sparse_dot_part, &j);
+        return;
+    }
+    j.x = tensor_vempty(2, a->cols, batch);
+    matrix_transpose_into(j.x, x);
+    tensor y = tensor_vempty(2, a->rows, batch);
+    j.y = y.data;
+    parallel_for(a->rows, grain, sparse_axpy_part, &j);
+    matrix_transpose_into(t, y);
+    tensor_free(j.x);
+    tensor_free(y);
+}
@@ -0,0 +1,30 @@
+// Include guards and C++ compatibility
+#ifndef SPARSE_H
+#define SPARSE_H
+#include <stdint.h>
+#include "tensor.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Compressed sparse row matrix
+// The nonzeros of row i are val[row[i]] to val[row[i+1]-1], in the
+// columns col[row[i]] to col[row[i+1]-1], in increasing order
+typedef struct sparse_matrix {
+    size_t rows;
+    size_t cols;
+    size_t nnz;
+    size_t *row;
+    uint32_t *col;
+    float *val;
+} sparse_matrix;
+
+sparse_matrix *sparse_from_dense(const tensor a);
+tensor sparse_to_dense(const sparse_matrix *s);
+void free_sparse(sparse_matrix *s);
+void sparse_multiply_t_into(tensor t, const tensor x, const sparse_matrix *a);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -5,23 +5,140 @@
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <float.h>
 #include "tensor.h"
+#include "pool.h"
+#include "simd.h"
+#include "parallel.h"
 
-// Make a tensor with the specified dimension and size
+// Fill in row-major (contiguous) strides for the sizes of t
+// tensor t: tensor whose stride array is set
+void tensor_set_strides(tensor t)
+{
+    size_t i;
+    size_t stride = 1;
+    for(i = t.n; i > 0; --i){
+        t.stride[i-1] = stride;
+        stride *= t.size[i-1];
+    }
+}
+
+// Make the shape of a tensor without any storage
+// Sizes and strides share one allocation, freed by tensor_free unless it
+// came from an arena
+// arena *a: arena to allocate from, or 0 for the heap
 // size_t n: number of dimensions
 // size_t* size: size of each dimension
-// returns: a tensor of specified size filled with zeroes
-tensor tensor_make(const size_t n, const size_t *size)
+// returns: a tensor with contiguous strides and no data
+tensor tensor_shape_in(arena *a, const size_t n, const size_t *size)
 {
     tensor t = {0};
     t.n = n;
-    t.size = n > 0 ? calloc(n, sizeof(size_t)) : 0;
+    if(n > 0){
+        t.size = a ? arena_alloc(a, 2*n*sizeof(size_t)) : calloc(2*n, sizeof(size_t));
+    }
+    t.stride = n > 0 ? t.size + n : 0;
     size_t i;
     for(i = 0; i < n; ++i){
         t.size[i] = size[i];
     }
+    tensor_set_strides(t);
+    return t;
+}
+
+tensor tensor_shape(const size_t n, const size_t *size)
+{
+    return tensor_shape_in(0, n, size);
+}
+
+// Allocate a reference counted buffer from the buffer pool
+// size_t len: number of floats
+// int zero: whether the buffer must be zero filled
+// returns: storage holding one reference
+tensor_storage *tensor_storage_make(size_t len, int zero)
+{
+    tensor_storage *s = calloc(1, sizeof(tensor_storage));
+    s->data = zero ? pool_calloc(len*sizeof(float)) : pool_alloc(len*sizeof(float));
+    s->len = len;
+    s->refs = 1;
+    return s;
+}
+
+// Drop a reference to a buffer, freeing it with the last one
+// Arena buffers are left alone, they go away with arena_reset
+void tensor_storage_free(tensor_storage *s)
+{
+    if(!s || s->arena) return;
+    assert(s->refs > 0);
+    if(--s->refs) return;
+    pool_free(s->data, s->len*sizeof(float));
+    free(s);
+}
+
+// Make a tensor with the specified dimension and size
+// size_t n: number of dimensions
+// size_t* size: size of each dimension
+// returns: a tensor of specified size filled with zeroes
+tensor tensor_make(const size_t n, const size_t *size)
+{
+    tensor t = tensor_shape(n, size);
+    t.storage = tensor_storage_make(tensor_len(t), 1);
+    t.data = t.storage->data;
+    return t;
+}
+
+// Make a tensor without clearing its data, for outputs that get overwritten
+// size_t n: number of dimensions
+// size_t* size: size of each dimension
+// returns: a tensor of specified size with unspecified contents
+tensor tensor_empty(const size_t n, const size_t *size)
+{
+    tensor t = tensor_shape(n, size);
+    t.storage = tensor_storage_make(tensor_len(t), 0);
+    t.data = t.storage->data;
+    return t;
+}
+
+// Make a scratch tensor in an arena
+// Its data and shape live until the arena is reset, tensor_free on it does
+// nothing, so code can free it either way. Views of it are arena scratch
+// too, references (tensor_ref) are copied out to the heap.
+// arena *a: arena to allocate from, or 0 to fall back to tensor_make
+// size_t n: number of dimensions
+// size_t* size: size of each dimension
+// returns: a tensor of specified size filled with zeroes
+tensor tensor_make_in(arena *a, const size_t n, const size_t *size)
+{
+    if(!a) return tensor_make(n, size);
+    tensor t = tensor_shape_in(a, n, size);
     size_t len = tensor_len(t);
-    t.data = calloc(len, sizeof(float));
+    t.storage = arena_alloc(a, sizeof(tensor_storage));
+    t.storage->data = arena_alloc(a, len*sizeof(float));
+    t.storage->len = len;
+    t.storage->refs = 1;
+    t.storage->arena = a;
+    t.data = t.storage->data;
+    memset(t.data, 0, len*sizeof(float));
+    return t;
+}
+
+// Variadic version of tensor_make_in
+// arena *a: arena to allocate from, or 0 to fall back to tensor_make
+// size_t n: number of dimensions
+// vargs: list of size_t sizes for dimensions
+// returns: a tensor of specified size filled with zeroes
+tensor tensor_vmake_in(arena *a, const size_t n, ...)
+{
+    size_t *size = calloc(n, sizeof(size_t));
+    va_list args;
+    va_start(args, n);
+    size_t i;
+    for(i = 0; i < n; ++i){
+        size[i] = va_arg(args, size_t);
+    }
+    va_end(args);
+    tensor t = tensor_make_in(a, n, size);
+    free(size);
     return t;
 }
 
@@ -43,6 +160,24 @@ tensor tensor_vmake(const size_t n, ...)
     return t;
 }
 
+// Variadic version of tensor_empty
+// size_t n: number of dimensions
+// vargs: list of size_t sizes for dimensions
+// returns: a tensor of specified size with unspecified contents
+tensor tensor_vempty(const size_t n, ...)
+{
+    size_t *size = calloc(n, sizeof(size_t));
+    va_list args;
+    va_start(args, n);
+    size_t i;
+    for(i = 0; i < n; ++i){
+        size[i] = va_arg(args, size_t);
+    }
+    tensor t  = tensor_empty(n, size);
+    free(size);
+    return t;
+}
+
 // Total number of elements in tensor
 // tensor t:
 // returns: length of t
@@ -56,32 +191,106 @@ size_t tensor_len(const tensor t)
     return len;
 }
 
+// Whether the elements of t are laid out densely in row-major order
+// tensor t: tensor to check
+// returns: 1 if t.data can be walked as a flat array, 0 otherwise
+int tensor_is_contiguous(const tensor t)
+{
+    size_t i;
+    size_t stride = 1;
+    for(i = t.n; i > 0; --i){
+        if(t.size[i-1] != 1 && t.stride[i-1] != stride) return 0;
+        stride *= t.size[i-1];
+    }
+    return 1;
+}
+
+// Gather a (possibly strided) tensor into a dense row-major buffer
+// tensor t: tensor to read
+// float *out: buffer with room for tensor_len(t) elements
+void tensor_copy_strided_(const tensor t, float *out)
+{
+    if(t.n == 0){
+        out[0] = t.data[0];
+        return;
+    }
+    size_t i, j;
+    size_t len = tensor_len(t);
+    if(len == 0) return;
+    size_t inner = t.size[t.n-1];
+    size_t s = t.stride[t.n-1];
+    size_t outer = len / inner;
+    for(i = 0; i < outer; ++i){
+        size_t r = i;
+        size_t off = 0;
+        for(j = t.n-1; j > 0; --j){
+            off += (r % t.size[j-1]) * t.stride[j-1];
+            r /= t.size[j-1];
+        }
+        const float *src = t.data + off;
+        float *dst = out + i*inner;
+        for(j = 0; j < inner; ++j){
+            dst[j] = src[j*s];
+        }
+    }
+}
+
 // Copy a tensor
 // tensor t: tensor to be copied
 // returns: a copy of t
 tensor tensor_copy(tensor t)
 {
     // TODO 0.0: copy the tensor and return the copy
-    tensor c = tensor_make(t.n, t.size);
+    tensor c = tensor_empty(t.n, t.size);
     size_t len = tensor_len(t);
-    size_t i;
-    for (i = 0; i < len; ++i) {
-        c.data[i] = t.data[i];
+    if (tensor_is_contiguous(t)) {
+        memcpy(c.data, t.data, len*sizeof(float));
+    } else {
+        tensor_copy_strided_(t, c.data);
     }
     return c;
 }
 
+// Take another reference to a tensor instead of copying it
+// The result shares storage with t until one of them is unshared, so
+// whoever writes to a referenced tensor in place calls tensor_unshare first.
+// Borrowed views (from tensor_get_) and arena scratch can't be kept alive
+// and are copied.
+// tensor t: tensor to reference
+// returns: tensor with the same contents, release with tensor_free
+tensor tensor_ref(tensor t)
+{
+    if(!t.storage || t.storage->arena) return tensor_copy(t);
+    tensor r = tensor_shape(t.n, t.size);
+    if(t.n) memcpy(r.stride, t.stride, t.n*sizeof(size_t));
+    r.data = t.data;
+    r.storage = t.storage;
+    ++r.storage->refs;
+    return r;
+}
+
+// Copy-on-write: give t private storage if anyone else refers to its data
+// tensor *t: tensor about to be written in place
+void tensor_unshare(tensor *t)
+{
+    if(!t->storage || t->storage->refs == 1) return;
+    tensor c = tensor_copy(*t);
+    tensor_free(*t);
+    *t = c;
+}
+
 // In-place scaling of tensor
 // float s: scalar factor
 // tensor t: tensor to scale in place
 void tensor_scale_(float s, tensor t)
 {
     // TODO 0.1: scale the tensor in place
-    size_t len = tensor_len(t);
-    size_t i;
-    for (i = 0; i < len; ++i) {
-        t.data[i] = s * t.data[i];
+    if(!tensor_is_contiguous(t)){
+        tensor_scale_into(t, s, t);
+        return;
     }
+    size_t len = tensor_len(t);
+    simd()->scale(len, s, t.data);
 }
 
 // Scaling of tensor
@@ -103,25 +312,36 @@ void tensor_axpy_(float a, tensor x, tensor y)
 {
     // printf( "*** tensor_axpy_" );
     assert(tensor_len(x) == tensor_len(y));
+    assert(tensor_is_contiguous(x) && tensor_is_contiguous(y));
     // TODO 0.2: perform the elementwise, in-place computation
     size_t len = tensor_len(y);
-    size_t i;
-    for (i = 0; i < len; ++i) {
-        y.data[i] = a * x.data[i] + y.data[i];
-    }
+    simd()->axpy(len, a, x.data, y.data);
 }
 
 // Returns a new dimensionality view of a tensor
 // input must have same total number of elements as reshaped tensor
+// The view shares storage with t when t is contiguous, holding a reference
+// to it, otherwise the elements are gathered into a new buffer.
+// Either way the result must be released with tensor_free.
 // tensor t: tensor to reshape
 // size_t n: new dimensionality
 // size_t *sizes: new sizes for the dimensions
 // returns: reshaped tensor
 tensor tensor_view(tensor t, const size_t n, const size_t* size)
 {
-    tensor v = tensor_make(n, size);
+    if(tensor_is_contiguous(t)){
+        tensor v = tensor_shape_in(t.storage ? t.storage->arena : 0, n, size);
+        assert(tensor_len(t) == tensor_len(v));
+        v.data = t.data;
+        v.storage = t.storage;
+        if(v.storage) ++v.storage->refs;
+        return v;
+    }
+    tensor v = tensor_shape(n, size);
     assert(tensor_len(t) == tensor_len(v));
-    memcpy(v.data, t.data, tensor_len(t)*sizeof(float));
+    v.storage = tensor_storage_make(tensor_len(v), 0);
+    v.data = v.storage->data;
+    tensor_copy_strided_(t, v.data);
     return v;
 }
 
@@ -144,6 +364,34 @@ tensor tensor_vview(tensor t, const size_t n, ...)
     return v;
 }
 
+// Returns a view of a tensor with two dimensions swapped, no data is moved
+// tensor t: tensor to transpose
+// size_t d1, d2: dimensions to swap
+// returns: strided view sharing storage with t, release with tensor_free
+tensor tensor_transpose_view(tensor t, const size_t d1, const size_t d2)
+{
+    assert(d1 < t.n && d2 < t.n);
+    tensor v = tensor_shape_in(t.storage ? t.storage->arena : 0, t.n, t.size);
+    memcpy(v.stride, t.stride, t.n*sizeof(size_t));
+    v.size[d1] = t.size[d2];
+    v.size[d2] = t.size[d1];
+    v.stride[d1] = t.stride[d2];
+    v.stride[d2] = t.stride[d1];
+    v.data = t.data;
+    v.storage = t.storage;
+    if(v.storage) ++v.storage->refs;
+    return v;
+}
+
+// Returns a contiguous version of a tensor
+// tensor t: tensor to access
+// returns: a view of t if it is already contiguous, else a dense copy,
+// release with tensor_free
+tensor tensor_contiguous(tensor t)
+{
+    return tensor_view(t, t.n, t.size);
+}
+
 // Make a random tensor in interval [-s, s]
 // float s: bounds for random generation
 // size_t n: number of dimensions
@@ -151,7 +399,7 @@ tensor tensor_vview(tensor t, const size_t n, ...)
 // returns: a tensor filled with uniform distribution [-s, s]
 tensor tensor_random(const float s, const size_t n, const size_t *size)
 {
-    tensor t = tensor_make(n, size);
+    tensor t = tensor_empty(n, size);
     size_t len = tensor_len(t);
     size_t i;
     for(i = 0; i < len; ++i){
@@ -189,9 +437,9 @@ tensor tensor_get_(const tensor t, const size_t e)
     if (t.n == 0) return t;
     tensor a = {0};
     a.n = t.n - 1;
-    a.size = t.size + 1;
-    size_t len = tensor_len(a);
-    a.data = t.data + e*len;
+    a.size = a.n ? t.size + 1 : 0;
+    a.stride = a.n ? t.stride + 1 : 0;
+    a.data = t.data + e*t.stride[0];
     return a;
 }
 
@@ -205,11 +453,14 @@ tensor tensor_get(const tensor t, const size_t e)
     return tensor_copy(tensor_get_(t, e));
 }
 
-// Free storage of a tensor
+// Free a tensor, dropping its reference to the underlying storage
+// The data is released once no tensor or view refers to it anymore
+// Arena scratch tensors are released by arena_reset instead
 void tensor_free(tensor t)
 {
+    if(t.storage && t.storage->arena) return;
     if(t.size) free(t.size);
-    if(t.data) free(t.data);
+    tensor_storage_free(t.storage);
 }
 
 // This was so hard you don't even know...
@@ -282,105 +533,644 @@ tensor tensor_broadcast(tensor a, tensor b)
     for(i = 0; i < n - ln; ++i){
         size[i] = a.size[i];
     }
-    tensor t = tensor_make(n, size);
+    tensor t = tensor_empty(n, size);
     free(size);
     return t;
 }
 
-void tensor_binary_op_(const tensor a, const tensor b, tensor t, float op (float, float))
+// Strides of x when broadcast to an n-dimensional shape
+// Dimensions x doesn't have, or has with size 1, get stride 0 so the
+// same elements are read again along them
+// tensor x: operand
+// size_t n: dimensionality of the broadcast shape
+// size_t *stride: n strides to fill in
+void tensor_broadcast_strides(const tensor x, const size_t n, size_t *stride)
 {
-    if(t.n == 0){
-        t.data[0] = op(a.data[0], b.data[0]);
-    } else {
-        size_t i = 0;
-        for(i = 0; i < t.size[0]; ++i){
-            size_t inca = (a.n && a.size[0] == t.size[0]);
-            size_t incb = (b.n && b.size[0] == t.size[0]);
-            tensor suba = a;
-            tensor subb = b;
-            if(a.n == t.n){
-                suba = tensor_get_(a, i*inca);
-            }
-            if(b.n == t.n){
-                subb = tensor_get_(b, i*incb);
-            }
-            tensor subt = tensor_get_(t, i);
-            tensor_binary_op_(suba, subb, subt, op);
+    size_t i;
+    for(i = 0; i < n; ++i){
+        size_t d = n - 1 - i;
+        stride[d] = (i < x.n && x.size[x.n - 1 - i] != 1) ? x.stride[x.n - 1 - i] : 0;
+    }
+}
+
+#define BINARY_LOOP(EXPR) \
+    for(i = 0; i < n; ++i){ float x = a[i*sa], y = b[i*sb]; t[i*st] = (EXPR); }
+
+// Innermost loop of a binary op
+// The common stride patterns (same shape, scalar a or b) go to the
+// vectorized kernels, anything else takes the general strided loop
+void tensor_binary_loop(const float *a, size_t sa, const float *b, size_t sb,
+        float *t, size_t st, size_t n, BINARY_OP op)
+{
+    size_t i;
+    if(st == 1 && sa <= 1 && sb <= 1 && (sa || sb)){
+        simd()->binary(op, n, a, sa, b, sb, t);
+        return;
+    }
+    switch(op){
+        case ADD_OP: BINARY_LOOP(x + y); break;
+        case SUB_OP: BINARY_LOOP(x - y); break;
+        case MUL_OP: BINARY_LOOP(x * y); break;
+        case DIV_OP: BINARY_LOOP(x / y); break;
+    }
+}
+
+// Compute t = a op b elementwise, broadcasting a and b to the shape of t
+// t may be a or b itself (e.g. for accumulating in place) but must not
+// partially overlap either of them
+// tensor a, b: operands, broadcastable to t
+// tensor t: output
+// BINARY_OP op: operation to apply
+void tensor_binary_op_(const tensor a, const tensor b, tensor t, BINARY_OP op)
+{
+    size_t n = t.n;
+    size_t sa[n + 1], sb[n + 1], st[n + 1], size[n + 1];
+    tensor_broadcast_strides(a, n, sa);
+    tensor_broadcast_strides(b, n, sb);
+    size_t i, d;
+
+    // Drop size 1 dimensions and merge dimensions that are contiguous for
+    // all three operands, e.g. a bias add over NCHW becomes an (N, C, H*W)
+    // loop and a same-shape op becomes a single flat loop
+    size_t m = 0;
+    for(i = 0; i < n; ++i){
+        if(t.size[i] == 1) continue;
+        if(m > 0 && sa[m-1] == sa[i]*t.size[i] && sb[m-1] == sb[i]*t.size[i]
+                && st[m-1] == t.stride[i]*t.size[i]){
+            size[m-1] *= t.size[i];
+            sa[m-1] = sa[i];
+            sb[m-1] = sb[i];
+            st[m-1] = t.stride[i];
+            continue;
+        }
+        size[m] = t.size[i];
+        sa[m] = sa[i];
+        sb[m] = sb[i];
+        st[m] = t.stride[i];
+        ++m;
+    }
+    if(m == 0){
+        tensor_binary_loop(a.data, 0, b.data, 0, t.data, 0, 1, op);
+        return;
+    }
+
+    // Walk the outer dimensions like an odometer, running the innermost one
+    // as a single loop
+    size_t len = size[m-1];
+    size_t outer = 1;
+    for(d = 0; d + 1 < m; ++d) outer *= size[d];
+    size_t index[m];
+    memset(index, 0, m*sizeof(size_t));
+    const float *pa = a.data;
+    const float *pb = b.data;
+    float *pt = t.data;
+    for(i = 0; i < outer; ++i){
+        tensor_binary_loop(pa, sa[m-1], pb, sb[m-1], pt, st[m-1], len, op);
+        for(d = m-1; d > 0; --d){
+            pa += sa[d-1];
+            pb += sb[d-1];
+            pt += st[d-1];
+            if(++index[d-1] < size[d-1]) break;
+            index[d-1] = 0;
+            pa -= sa[d-1]*size[d-1];
+            pb -= sb[d-1]*size[d-1];
+            pt -= st[d-1]*size[d-1];
         }
     }
 }
 
-tensor tensor_binary_op(tensor a, tensor b, float op (float, float))
+// Number of floats spanned by t, from its first element to its last
+size_t tensor_extent(const tensor t)
 {
-    tensor t = tensor_broadcast(a, b);
-    if(t.data == 0) return t;
-    tensor_binary_op_(a, b, t, op);
-    return t;
+    size_t i;
+    size_t extent = 1;
+    for(i = 0; i < t.n; ++i){
+        if(t.size[i] == 0) return 0;
+        extent += (t.size[i] - 1)*t.stride[i];
+    }
+    return extent;
 }
 
-float tensor_add_op_(float a, float b)
+// Whether a and t share memory without being the exact same view of it
+// Such pairs can't be used as input and output of one operation because
+// elements of t get written before the elements of a that alias them are read
+int tensor_partial_overlap(const tensor a, const tensor t)
 {
-    return a + b;
+    size_t i;
+    if(!a.data || !t.data) return 0;
+    if(a.data + tensor_extent(a) <= t.data) return 0;
+    if(t.data + tensor_extent(t) <= a.data) return 0;
+    if(a.data != t.data || a.n != t.n) return 1;
+    for(i = 0; i < a.n; ++i){
+        if(a.size[i] != t.size[i] || a.stride[i] != t.stride[i]) return 1;
+    }
+    return 0;
 }
 
-float tensor_sub_op_(float a, float b)
+// Whether x can be broadcast to exactly the shape of t
+int tensor_broadcasts_to(const tensor x, const tensor t)
 {
-    return a - b;
+    size_t i;
+    if(x.n > t.n) return 0;
+    for(i = 0; i < x.n; ++i){
+        size_t sx = x.size[x.n - 1 - i];
+        if(sx != 1 && sx != t.size[t.n - 1 - i]) return 0;
+    }
+    return 1;
 }
 
-float tensor_mul_op_(float a, float b)
+// Elementwise op into an existing tensor, checking the aliasing rules
+// tensor t: output, must have the broadcast shape of a and b
+// tensor a, b: operands, may be t itself but must not partially overlap it
+// BINARY_OP op: operation to apply
+void tensor_binary_op_into(tensor t, const tensor a, const tensor b, BINARY_OP op)
 {
-    return a * b;
+    assert(tensor_broadcasts_to(a, t) && tensor_broadcasts_to(b, t));
+    assert(!tensor_partial_overlap(a, t) && !tensor_partial_overlap(b, t));
+    tensor_binary_op_(a, b, t, op);
 }
 
-float tensor_div_op_(float a, float b)
+tensor tensor_binary_op(tensor a, tensor b, BINARY_OP op)
 {
-    return a / b;
+    tensor t = tensor_broadcast(a, b);
+    if(t.data == 0) return t;
+    tensor_binary_op_(a, b, t, op);
+    return t;
 }
 
 tensor tensor_add(tensor a, tensor b)
 {
-    return tensor_binary_op(a, b, tensor_add_op_);
+    return tensor_binary_op(a, b, ADD_OP);
 }
 
 tensor tensor_sub(tensor a, tensor b)
 {
-    return tensor_binary_op(a, b, tensor_sub_op_);
+    return tensor_binary_op(a, b, SUB_OP);
 }
 
 tensor tensor_mul(tensor a, tensor b)
 {
-    return tensor_binary_op(a, b, tensor_mul_op_);
+    return tensor_binary_op(a, b, MUL_OP);
 }
 
 tensor tensor_div(tensor a, tensor b)
 {
-    return tensor_binary_op(a, b, tensor_div_op_);
+    return tensor_binary_op(a, b, DIV_OP);
+}
+
+// Elementwise ops into an existing tensor: t = a op b
+// t must have the broadcast shape of a and b. It may be a or b itself,
+// which is how the in-place versions below work, but must not partially
+// overlap either of them (e.g. a shifted view of the same buffer).
+// tensor t: output, overwritten
+// tensor a, b: operands
+void tensor_add_into(tensor t, tensor a, tensor b)
+{
+    tensor_binary_op_into(t, a, b, ADD_OP);
+}
+
+void tensor_sub_into(tensor t, tensor a, tensor b)
+{
+    tensor_binary_op_into(t, a, b, SUB_OP);
+}
+
+void tensor_mul_into(tensor t, tensor a, tensor b)
+{
+    tensor_binary_op_into(t, a, b, MUL_OP);
+}
+
+void tensor_div_into(tensor t, tensor a, tensor b)
+{
+    tensor_binary_op_into(t, a, b, DIV_OP);
+}
+
+// In-place elementwise ops: a = a op b
+// b is broadcast to the shape of a, so it can't be larger than a
+// Writes through to storage shared with other references, call
+// tensor_unshare first if a may be shared
+// tensor a: tensor to update
+// tensor b: operand
+void tensor_add_(tensor a, tensor b)
+{
+    tensor_binary_op_into(a, a, b, ADD_OP);
+}
+
+void tensor_sub_(tensor a, tensor b)
+{
+    tensor_binary_op_into(a, a, b, SUB_OP);
+}
+
+void tensor_mul_(tensor a, tensor b)
+{
+    tensor_binary_op_into(a, a, b, MUL_OP);
+}
+
+void tensor_div_(tensor a, tensor b)
+{
+    tensor_binary_op_into(a, a, b, DIV_OP);
+}
+
+// Scale a tensor into an existing one: t = s*a
+// Same aliasing rules as the binary ops, t == a is scaling in place
+// tensor t: output, same shape as a
+// float s: scalar factor
+// tensor a: tensor to scale
+void tensor_scale_into(tensor t, float s, tensor a)
+{
+    tensor scalar = {0};
+    scalar.data = &s;
+    assert(a.n == t.n && tensor_broadcasts_to(a, t));
+    tensor_binary_op_into(t, a, scalar, MUL_OP);
 }
 
 float tensor_sum(tensor a)
 {
-    float s = 0;
-    size_t i;
-    size_t len = tensor_len(a);
-    for(i = 0; i < len; ++i){
-        s += a.data[i];       
+    assert(tensor_is_contiguous(a));
+    return simd()->sum(tensor_len(a), a.data);
+}
+
+// Reductions over a set of axes
+// The axes of a are split into kept ones, which index the output, and
+// reduced ones. Neighbouring axes of the same kind are merged where the
+// memory allows and the elements are then visited once, in memory order,
+// e.g. a bias gradient over NCHW is an (N, C, H*W) walk that sums rows.
+typedef enum{SUM_REDUCE, MAX_REDUCE, ARGMAX_REDUCE} REDUCE_OP;
+
+// Inputs with fewer elements than this are reduced on one thread
+#define REDUCE_PARALLEL_MIN (1 << 16)
+
+typedef struct reduce_plan {
+    REDUCE_OP op;
+    size_t m;          // number of merged dimensions
+    size_t *size;
+    size_t *sa;        // strides in a
+    size_t *so;        // strides in the output, 0 along reduced dimensions
+    size_t *sr;        // strides in the flattened reduced axes, 0 along kept ones
+    size_t outputs;    // number of output elements
+    size_t count;      // number of elements reduced into each output
+    const float *data;
+} reduce_plan;
+
+// Work out the walk for reducing a over some of its axes
+// reduce_plan *p: plan to fill in
+// tensor a: tensor to reduce
+// size_t naxes, *axes: distinct axes of a to reduce over
+// size_t *buf: 4*a.n entries of storage for the plan's strides
+void tensor_reduce_plan(reduce_plan *p, const tensor a, size_t naxes, const size_t *axes, size_t *buf)
+{
+    size_t n = a.n;
+    size_t i, m = 0;
+    int reduced[n + 1];
+    size_t so[n + 1], sr[n + 1];
+    memset(reduced, 0, sizeof(reduced));
+    for(i = 0; i < naxes; ++i){
+        assert(axes[i] < n && !reduced[axes[i]]);
+        reduced[axes[i]] = 1;
     }
-    return s;
+    p->outputs = 1;
+    p->count = 1;
+    for(i = n; i-- > 0; ){
+        so[i] = reduced[i] ? 0 : p->outputs;
+        sr[i] = reduced[i] ? p->count : 0;
+        if(reduced[i]) p->count *= a.size[i];
+        else p->outputs *= a.size[i];
+    }
+
+    p->size = buf;
+    p->sa = buf + n;
+    p->so = buf + 2*n;
+    p->sr = buf + 3*n;
+    for(i = 0; i < n; ++i){
+        size_t s = a.size[i];
+        if(s == 1) continue;
+        if(m > 0 && p->sa[m-1] == a.stride[i]*s && p->so[m-1] == so[i]*s
+                && p->sr[m-1] == sr[i]*s){
+            p->size[m-1] *= s;
+            p->sa[m-1] = a.stride[i];
+            p->so[m-1] = so[i];
+            p->sr[m-1] = sr[i];
+            continue;
+        }
+        p->size[m] = s;
+        p->sa[m] = a.stride[i];
+        p->so[m] = so[i];
+        p->sr[m] = sr[i];
+        ++m;
+    }
+    p->m = m;
+    p->data = a.data;
+}
+
+// Starting values of the outputs of a reduction
+void tensor_reduce_init(REDUCE_OP op, float *out, size_t *arg, size_t n)
+{
+    size_t i;
+    for(i = 0; i < n; ++i) out[i] = (op == SUM_REDUCE) ? 0 : -FLT_MAX;
+    if(arg) memset(arg, 0, n*sizeof(size_t));
 }
 
-void tensor_sum_dim_(tensor a, size_t dim, tensor b)
+// Innermost loop of a reduction, n elements of a into outputs at stride so
+// which is 0 when the innermost dimension is one being reduced
+// size_t r, sr: flattened reduced index of the first element and its stride
+void tensor_reduce_loop(REDUCE_OP op, const float *a, size_t sa, float *o, size_t so,
+        size_t *arg, size_t r, size_t sr, size_t n)
 {
     size_t i;
-    if(dim == 0){
-        for(i = 0; i < a.size[0]; ++i){
-            tensor_binary_op_(tensor_get_(a,i), b, b, tensor_add_op_);
+    if(op == SUM_REDUCE){
+        if(so == 0){
+            float s = 0;
+            if(sa == 1) s = simd()->sum(n, a);
+            else for(i = 0; i < n; ++i) s += a[i*sa];
+            *o += s;
+        } else if(sa == 1 && so == 1){
+            simd()->axpy(n, 1, a, o);
+        } else {
+            for(i = 0; i < n; ++i) o[i*so] += a[i*sa];
+        }
+    } else if(op == MAX_REDUCE){
+        if(so == 0){
+            float mx = *o;
+            for(i = 0; i < n; ++i) mx = (a[i*sa] > mx) ? a[i*sa] : mx;
+            *o = mx;
+        } else {
+            for(i = 0; i < n; ++i) if(a[i*sa] > o[i*so]) o[i*so] = a[i*sa];
         }
     } else {
-        for(i = 0; i < a.size[0]; ++i){
-            tensor_sum_dim_(tensor_get_(a, i), dim-1, tensor_get_(b, i));
+        for(i = 0; i < n; ++i){
+            float v = a[i*sa];
+            if(v > o[i*so]){
+                o[i*so] = v;
+                arg[i*so] = r + i*sr;
+            }
+        }
+    }
+}
+
+// Run a reduction over the part of a where dimension d is in [start, end)
+// float *out: outputs to reduce into
+// size_t *arg: indices of the maxima for ARGMAX_REDUCE, otherwise 0
+void tensor_reduce_range(const reduce_plan *p, size_t d, size_t start, size_t end, float *out, size_t *arg)
+{
+    size_t m = p->m;
+    if(m == 0){
+        tensor_reduce_loop(p->op, p->data, 0, out, 0, arg, 0, 0, 1);
+        return;
+    }
+    if(end <= start) return;
+    size_t size[m];
+    memcpy(size, p->size, m*sizeof(size_t));
+    size[d] = end - start;
+    const float *pa = p->data + start*p->sa[d];
+    size_t po = start*p->so[d];
+    size_t pr = start*p->sr[d];
+
+    // Same odometer walk as the binary ops
+    size_t i, k;
+    size_t outer = 1;
+    for(k = 0; k + 1 < m; ++k) outer *= size[k];
+    size_t index[m];
+    memset(index, 0, m*sizeof(size_t));
+    for(i = 0; i < outer; ++i){
+        tensor_reduce_loop(p->op, pa, p->sa[m-1], out + po, p->so[m-1],
+                arg ? arg + po : 0, pr, p->sr[m-1], size[m-1]);
+        for(k = m-1; k > 0; --k){
+            pa += p->sa[k-1];
+            po += p->so[k-1];
+            pr += p->sr[k-1];
+            if(++index[k-1] < size[k-1]) break;
+            index[k-1] = 0;
+            pa -= p->sa[k-1]*size[k-1];
+            po -= p->so[k-1]*size[k-1];
+            pr -= p->sr[k-1]*size[k-1];
+        }
+    }
+}
+
+typedef struct reduce_job {
+    const reduce_plan *p;
+    size_t d;          // dimension split between threads
+    size_t parts;      // number of partial outputs when d is reduced
+    float *out;
+    size_t *arg;
+} reduce_job;
+
+// Threads own a range of a kept dimension, so their outputs are disjoint
+void tensor_reduce_kept_part(void *ctx, size_t start, size_t end)
+{
+    reduce_job *j = ctx;
+    tensor_reduce_range(j->p, j->d, start, end, j->out, j->arg);
+}
+
+// Threads own a range of a reduced dimension and a partial output each
+void tensor_reduce_reduced_part(void *ctx, size_t start, size_t end)
+{
+    reduce_job *j = ctx;
+    const reduce_plan *p = j->p;
+    size_t len = p->size[j->d];
+    size_t i;
+    for(i = start; i < end; ++i){
+        tensor_reduce_range(p, j->d, len*i/j->parts, len*(i+1)/j->parts,
+                j->out + i*p->outputs, j->arg ? j->arg + i*p->outputs : 0);
+    }
+}
+
+// Largest merged dimension that is kept (or reduced), m if there are none
+size_t tensor_reduce_widest(const reduce_plan *p, int kept)
+{
+    size_t d, best = p->m;
+    for(d = 0; d < p->m; ++d){
+        if((p->so[d] != 0) != kept) continue;
+        if(best == p->m || p->size[d] > p->size[best]) best = d;
+    }
+    return best;
+}
+
+// Run a reduction into initialized outputs, across threads if it is big
+// Splits a kept dimension when there are enough outputs to go around,
+// otherwise a reduced one with a partial result per thread that are
+// combined at the end
+void tensor_reduce_run(const reduce_plan *p, float *out, size_t *arg)
+{
+    size_t i, k;
+    if(p->outputs == 0 || p->count == 0) return;
+    size_t threads = (p->outputs*p->count >= REDUCE_PARALLEL_MIN) ? parallel_threads() : 1;
+    if(p->m == 0 || threads == 1){
+        tensor_reduce_range(p, 0, 0, p->m ? p->size[0] : 1, out, arg);
+        return;
+    }
+    reduce_job j = {p, tensor_reduce_widest(p, 1), 0, out, arg};
+    if(j.d < p->m && p->size[j.d] >= threads){
+        parallel_for(p->size[j.d], 1, tensor_reduce_kept_part, &j);
+        return;
+    }
+
+    j.d = tensor_reduce_widest(p, 0);
+    j.parts = (p->size[j.d] < threads) ? p->size[j.d] : threads;
+    j.out = malloc(j.parts*p->outputs*sizeof(float));
+    j.arg = arg ? malloc(j.parts*p->outputs*sizeof(size_t)) : 0;
+    tensor_reduce_init(p->op, j.out, j.arg, j.parts*p->outputs);
+    parallel_for(j.parts, 1, tensor_reduce_reduced_part, &j);
+    for(i = 0; i < j.parts; ++i){
+        float *po = j.out + i*p->outputs;
+        size_t *pi = j.arg ? j.arg + i*p->outputs : 0;
+        for(k = 0; k < p->outputs; ++k){
+            if(p->op == SUM_REDUCE) out[k] += po[k];
+            else if(p->op == MAX_REDUCE) out[k] = (po[k] > out[k]) ? po[k] : out[k];
+            else if(po[k] > out[k] || (po[k] == out[k] && pi[k] < arg[k])){
+                // ties go to the first maximum, like the serial walk
+                out[k] = po[k];
+                arg[k] = pi[k];
+            }
         }
     }
+    free(j.out);
+    free(j.arg);
+}
+
+// Shape of a reduction's result, a's shape without the reduced axes
+// size_t *size: a.n entries to fill in
+// returns: number of dimensions of the result
+size_t tensor_reduced_shape(const tensor a, size_t naxes, const size_t *axes, size_t *size)
+{
+    size_t i, k, n = 0;
+    for(i = 0; i < a.n; ++i){
+        int reduced = 0;
+        for(k = 0; k < naxes; ++k) reduced |= (axes[k] == i);
+        if(!reduced) size[n++] = a.size[i];
+    }
+    return n;
+}
+
+// Reduce a into an existing tensor
+// t needs one element per output, in row-major order of the kept axes,
+// and must not overlap a. Strided outputs go through a contiguous copy.
+// int accumulate: add into t instead of overwriting it (sums only)
+void tensor_reduce_into(tensor t, const tensor a, size_t naxes, const size_t *axes, REDUCE_OP op, int accumulate)
+{
+    size_t buf[4*a.n + 1];
+    reduce_plan p;
+    tensor_reduce_plan(&p, a, naxes, axes, buf);
+    p.op = op;
+    assert(tensor_len(t) == p.outputs);
+    assert(!tensor_partial_overlap(a, t) && a.data != t.data);
+
+    tensor c = t;
+    if(!tensor_is_contiguous(t)) c = accumulate ? tensor_copy(t) : tensor_empty(t.n, t.size);
+    if(!accumulate) tensor_reduce_init(op, c.data, 0, p.outputs);
+    tensor_reduce_run(&p, c.data, 0);
+    if(c.data != t.data){
+        float zero = 0;
+        tensor scalar = {0};
+        scalar.data = &zero;
+        tensor_binary_op_(c, scalar, t, ADD_OP);
+        tensor_free(c);
+    }
+}
+
+// Number of elements reduced into each output
+size_t tensor_reduce_count(const tensor a, size_t naxes, const size_t *axes)
+{
+    size_t i, count = 1;
+    for(i = 0; i < naxes; ++i) count *= a.size[axes[i]];
+    return count;
+}
+
+// Sum, mean or max of a over a set of axes, into an existing tensor
+// t gets one element per combination of the axes that aren't reduced and
+// must not overlap a. The in-place sum adds into t instead.
+// tensor t: output
+// tensor a: tensor to reduce
+// size_t naxes: number of axes to reduce over
+// size_t *axes: the axes, each at most once, in any order
+void tensor_sum_axes_into(tensor t, tensor a, size_t naxes, const size_t *axes)
+{
+    tensor_reduce_into(t, a, naxes, axes, SUM_REDUCE, 0);
+}
+
+void tensor_sum_axes_(tensor t, tensor a, size_t naxes, const size_t *axes)
+{
+    tensor_reduce_into(t, a, naxes, axes, SUM_REDUCE, 1);
+}
+
+void tensor_mean_axes_into(tensor t, tensor a, size_t naxes, const size_t *axes)
+{
+    tensor_reduce_into(t, a, naxes, axes, SUM_REDUCE, 0);
+    size_t count = tensor_reduce_count(a, naxes, axes);
+    if(count) tensor_scale_(1.0f/count, t);
+}
+
+void tensor_max_axes_into(tensor t, tensor a, size_t naxes, const size_t *axes)
+{
+    tensor_reduce_into(t, a, naxes, axes, MAX_REDUCE, 0);
+}
+
+// Sum, mean or max of a over a set of axes
+// tensor a: tensor to reduce
+// size_t naxes: number of axes to reduce over
+// size_t *axes: the axes, each at most once, in any order
+// returns: tensor with a's shape minus the reduced axes
+tensor tensor_sum_axes(tensor a, size_t naxes, const size_t *axes)
+{
+    size_t size[a.n + 1];
+    tensor t = tensor_empty(tensor_reduced_shape(a, naxes, axes, size), size);
+    tensor_sum_axes_into(t, a, naxes, axes);
+    return t;
+}
+
+tensor tensor_mean_axes(tensor a, size_t naxes, const size_t *axes)
+{
+    size_t size[a.n + 1];
+    tensor t = tensor_empty(tensor_reduced_shape(a, naxes, axes, size), size);
+    tensor_mean_axes_into(t, a, naxes, axes);
+    return t;
+}
+
+tensor tensor_max_axes(tensor a, size_t naxes, const size_t *axes)
+{
+    size_t size[a.n + 1];
+    tensor t = tensor_empty(tensor_reduced_shape(a, naxes, axes, size), size);
+    tensor_max_axes_into(t, a, naxes, axes);
+    return t;
+}
+
+// Position of the maximum of a over a set of axes
+// Positions are row-major indices into the reduced axes, in the order
+// they appear in a, and ties go to the first maximum
+// size_t *index: one entry per output, like the result of tensor_max_axes
+// tensor a: tensor to search
+// size_t naxes: number of axes to search over
+// size_t *axes: the axes, each at most once, in any order
+void tensor_argmax_axes(size_t *index, tensor a, size_t naxes, const size_t *axes)
+{
+    size_t buf[4*a.n + 1];
+    reduce_plan p;
+    tensor_reduce_plan(&p, a, naxes, axes, buf);
+    p.op = ARGMAX_REDUCE;
+    float *best = malloc((p.outputs + 1)*sizeof(float));
+    tensor_reduce_init(p.op, best, index, p.outputs);
+    tensor_reduce_run(&p, best, index);
+    free(best);
+}
+
+// Accumulate the sum of a over one dimension: t += sum(a, dim)
+// t must have a's shape without dim, optionally with leading size 1
+// dimensions (e.g. (1, n) for a bias), and must not overlap a
+// tensor t: tensor to add into
+// tensor a: tensor to sum
+// size_t dim: dimension to sum over
+void tensor_sum_dim_(tensor t, tensor a, size_t dim)
+{
+    tensor_sum_axes_(t, a, 1, &dim);
+}
+
+// Sum a over one dimension into an existing tensor: t = sum(a, dim)
+// Same shape and aliasing rules as tensor_sum_dim_
+// tensor t: output, overwritten
+// tensor a: tensor to sum
+// size_t dim: dimension to sum over
+void tensor_sum_dim_into(tensor t, tensor a, size_t dim)
+{
+    tensor_sum_axes_into(t, a, 1, &dim);
 }
 
 tensor tensor_sum_dim(tensor a, size_t dim)
@@ -390,28 +1180,20 @@ tensor tensor_sum_dim(tensor a, size_t dim)
         tensor none = {0};
         return none;
     }
-    size_t n = a.n - 1;
-    size_t *size = calloc(n, sizeof(size_t));
-    size_t i = 0;
-    size_t ri = 0;
-    for(i = 0; i < a.n; ++i){
-        if (i == dim) continue;
-        size[ri++] = a.size[i];
-    }
-    tensor result = tensor_make(n, size);
-    tensor_sum_dim_(a, dim, result);
-    free(size);
-    return result;
+    return tensor_sum_axes(a, 1, &dim);
 }
 
 void tensor_write(tensor t, FILE *fp)
 {
     size_t len = tensor_len(t);
-    fwrite(t.data, sizeof(float), len, fp);
+    tensor c = tensor_contiguous(t);
+    fwrite(c.data, sizeof(float), len, fp);
+    tensor_free(c);
 }
 
 void tensor_read(tensor t, FILE *fp)
 {
+    assert(tensor_is_contiguous(t));
     size_t len = tensor_len(t);
     assert(fread(t.data, sizeof(float), len, fp) == len);
 }
@@ -444,7 +1226,7 @@ tensor tensor_load(char *fname)
         assert(fread(&s, sizeof(uint64_t), 1, fp) == 1);
         size[i] = (size_t) s;
     }
-    tensor t = tensor_make((size_t) n, size);
+    tensor t = tensor_empty((size_t) n, size);
     tensor_read(t, fp);
     fclose(fp);
     free(size);
@@ -463,7 +1245,7 @@ tensor matrix_load(char *fname)
         assert(fread(&s, sizeof(int), 1, fp) == 1);
         size[i] = (size_t) s;
     }
-    tensor t = tensor_make((size_t) n, size);
+    tensor t = tensor_empty((size_t) n, size);
     tensor_read(t, fp);
     fclose(fp);
     free(size);
@@ -2,23 +2,44 @@
 #ifndef TENSOR_H
 #define TENSOR_H
 #include <stdio.h>
+#include "arena.h"
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// The elementwise operations of the broadcasting engine
+typedef enum{ADD_OP, SUB_OP, MUL_OP, DIV_OP} BINARY_OP;
+
+// Reference counted buffer shared by a tensor and all views of it
+typedef struct tensor_storage {
+    float *data;
+    size_t len;
+    int refs;
+    arena *arena; // set when the buffer is scratch memory from an arena
+} tensor_storage;
+
 typedef struct tensor {
     size_t n;
     size_t *size;
+    size_t *stride;
     float *data;
+    tensor_storage *storage; // 0 for views borrowed with tensor_get_
 } tensor;
 
 tensor tensor_make(const size_t n, const size_t *size);
 tensor tensor_vmake(const size_t n, ...);
+tensor tensor_empty(const size_t n, const size_t *size);
+tensor tensor_vempty(const size_t n, ...);
+tensor tensor_make_in(arena *a, const size_t n, const size_t *size);
+tensor tensor_vmake_in(arena *a, const size_t n, ...);
 
 tensor tensor_copy(tensor t);
+tensor tensor_ref(tensor t);
+void tensor_unshare(tensor *t);
 
 tensor tensor_scale(float s, tensor t);
 void tensor_scale_(float s, tensor t);
+void tensor_scale_into(tensor t, float s, tensor a);
 void tensor_axpy_(float a, tensor x, tensor y);
 
 tensor tensor_random(const float s, const size_t n, const size_t *size);
@@ -31,6 +52,9 @@ size_t    tensor_len(const tensor t);
 
 tensor tensor_view(tensor t, const size_t n, const size_t* size);
 tensor tensor_vview(tensor t, const size_t n, ...);
+tensor tensor_transpose_view(tensor t, const size_t d1, const size_t d2);
+tensor tensor_contiguous(tensor t);
+int tensor_is_contiguous(const tensor t);
 
 void tensor_print(tensor t);
 
@@ -40,7 +64,33 @@ tensor tensor_sub(tensor a, tensor b);
 tensor tensor_mul(tensor a, tensor b);
 tensor tensor_div(tensor a, tensor b);
 
+// Output-parameter versions write into t, which must already have the
+// broadcast shape. t may be one of the operands but must not partially
+// overlap them. The in-place versions compute a = a op b.
+void tensor_add_into(tensor t, tensor a, tensor b);
+void tensor_sub_into(tensor t, tensor a, tensor b);
+void tensor_mul_into(tensor t, tensor a, tensor b);
+void tensor_div_into(tensor t, tensor a, tensor b);
+void tensor_add_(tensor a, tensor b);
+void tensor_sub_(tensor a, tensor b);
+void tensor_mul_(tensor a, tensor b);
+void tensor_div_(tensor a, tensor b);
+
 tensor tensor_sum_dim(tensor a, size_t dim);
+void tensor_sum_dim_into(tensor t, tensor a, size_t dim);
+void tensor_sum_dim_(tensor t, tensor a, size_t dim);
+
+// Reductions over a set of axes in one pass, threaded for large inputs
+// Results have a's shape without the reduced axes. tensor_sum_axes_
+// accumulates into t, argmax gives row-major positions in the reduced axes.
+tensor tensor_sum_axes(tensor a, size_t naxes, const size_t *axes);
+tensor tensor_mean_axes(tensor a, size_t naxes, const size_t *axes);
+tensor tensor_max_axes(tensor a, size_t naxes, const size_t *axes);
+void tensor_sum_axes_into(tensor t, tensor a, size_t naxes, const size_t *axes);
+void tensor_mean_axes_into(tensor t, tensor a, size_t naxes, const size_t *axes);
+void tensor_max_axes_into(tensor t, tensor a, size_t naxes, const size_t *axes);
+void tensor_sum_axes_(tensor t, tensor a, size_t naxes, const size_t *axes);
+void tensor_argmax_axes(size_t *index, tensor a, size_t naxes, const size_t *axes);
 float tensor_sum(tensor a);
 
 void tensor_save(tensor t, char *fname);
@@ -1,11 +1,18 @@
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include "dubnet.h"
 #include "test.h"
 #include "tensor.h"
 #include "matrix.h"
+#include "pool.h"
+#include "simd.h"
+#include "parallel.h"
+#include "gemm.h"
+#include "tune.h"
+#include "sparse.h"
 
 int tests_total = 0;
 int tests_fail = 0;
@@ -113,6 +120,139 @@ void test_tensor_make_get()
     tensor_free(j);
 }
 
+void test_tensor_view()
+{
+    tensor t = tensor_vrandom(1, 3, 4, 6, 5);
+    tensor v = tensor_vview(t, 2, 4, 30);
+    TEST(v.data == t.data);
+    TEST(tensor_is_contiguous(v));
+    v.data[7] = 42;
+    TEST(within_eps(t.data[7], 42));
+
+    tensor g = tensor_get_(t, 2);
+    TEST(g.data == t.data + 2*30);
+    TEST(g.stride[0] == 5);
+
+    tensor m = tensor_vrandom(1, 2, 29, 13);
+    tensor mt = tensor_transpose_view(m, 0, 1);
+    tensor truth_mt = matrix_transpose(m);
+    TEST(mt.data == m.data);
+    TEST(!tensor_is_contiguous(mt));
+    tensor c = tensor_copy(mt);
+    TEST(same_tensor(truth_mt, c));
+    tensor r = tensor_vview(mt, 1, 29*13);
+    tensor truth_r = tensor_vview(truth_mt, 1, 29*13);
+    TEST(r.data != m.data);
+    TEST(same_tensor(truth_r, r));
+
+    tensor b = tensor_vrandom(1, 2, 29, 7);
+    tensor mtb = matrix_multiply(mt, b);
+    tensor truth_mtb = matrix_multiply(truth_mt, b);
+    TEST(same_tensor(truth_mtb, mtb));
+
+    tensor_free(v);
+    tensor_free(t);
+    tensor_free(mt);
+    tensor_free(m);
+    tensor_free(truth_mt);
+    tensor_free(c);
+    tensor_free(r);
+    tensor_free(truth_r);
+    tensor_free(b);
+    tensor_free(mtb);
+    tensor_free(truth_mtb);
+}
+
+void test_tensor_ref()
+{
+    tensor t = tensor_vrandom(1, 2, 3, 5);
+    tensor r = tensor_ref(t);
+    TEST(r.data == t.data);
+    TEST(t.storage->refs == 2);
+
+    tensor truth = tensor_copy(t);
+    tensor_unshare(&r);
+    TEST(r.data != t.data);
+    TEST(t.storage->refs == 1);
+    tensor_scale_(2, r);
+    TEST(same_tensor(truth, t));
+
+    tensor v = tensor_vview(t, 1, 15);
+    tensor_free(t);
+    TEST(v.storage->refs == 1);
+    TEST(within_eps(v.data[4], truth.data[4]));
+
+    tensor g = tensor_ref(tensor_get_(truth, 1));
+    TEST(g.data != truth.data + 5);
+    TEST(within_eps(g.data[0], truth.data[5]));
+
+    tensor_free(r);
+    tensor_free(v);
+    tensor_free(g);
+    tensor_free(truth);
+}
+
+void test_arena()
+{
+    arena *a = make_arena(256);
+    tensor t = tensor_vmake_in(a, 2, 16, 16);
+    TEST(t.storage->arena == a);
+    TEST((size_t)t.data % 64 == 0);
+    TEST(tensor_sum(t) == 0);
+    TEST(a->used > 256);
+    TEST(a->overflow != 0);
+
+    tensor v = tensor_vview(t, 1, 256);
+    TEST(v.data == t.data);
+    tensor r = tensor_ref(t);
+    TEST(r.storage->arena == 0);
+    tensor_free(v);
+    tensor_free(t);
+
+    size_t peak = a->peak;
+    arena_reset(a);
+    TEST(a->used == 0);
+    TEST(a->overflow == 0);
+    TEST(a->size >= peak);
+    tensor u = tensor_vmake_in(a, 2, 16, 16);
+    TEST(a->overflow == 0);
+    TEST(u.data >= (float *)a->data && u.data < (float *)(a->data + a->size));
+
+    tensor h = tensor_vmake_in(0, 1, 4);
+    TEST(h.storage && h.storage->arena == 0);
+
+    tensor_free(u);
+    tensor_free(h);
+    tensor_free(r);
+    free_arena(a);
+}
+
+void test_pool()
+{
+    tensor a = tensor_vrandom(1, 2, 100, 30);
+    float *data = a.data;
+    tensor_free(a);
+    pool_stats before = pool_get_stats();
+    tensor b = tensor_vmake(2, 30, 100);
+    pool_stats after = pool_get_stats();
+    TEST(after.hits == before.hits + 1);
+    TEST(b.data == data);
+    TEST(tensor_sum(b) == 0);
+    TEST((size_t)b.data % 64 == 0);
+
+    tensor c = tensor_vempty(1, 3000);
+    TEST(c.data != b.data);
+    tensor_free(b);
+    tensor_free(c);
+    pool_stats held = pool_get_stats();
+    TEST(held.buffers_held >= 2);
+    TEST(held.bytes_held >= 2*3000*sizeof(float));
+
+    pool_trim();
+    TEST(pool_get_stats().bytes_held == 0);
+    pool_print_stats(stderr);
+}
+
 void test_matmul()
 {
     {
@@ -195,6 +335,31 @@ void test_invert()
     tensor_free(isq);
 }
 
+// LU inversion across several panels, and of a matrix it can't invert
+void test_invert_lu()
+{
+    tensor m = tensor_vrandom(1, 2, 300, 300);
+    tensor inv = matrix_invert_lu(m);
+    tensor id = matrix_multiply(m, inv);
+    tensor eye = tensor_vmake(2, 300, 300);
+    size_t i;
+    for(i = 0; i < 300; ++i) eye.data[i*301] = 1;
+    TEST(same_tensor(id, eye));
+
+    tensor gj = matrix_invert_gauss_jordan(m);
+    TEST(same_tensor(inv, gj));
+
+    for(i = 0; i < 300; ++i) m.data[i*300 + 7] = 0;
+    tensor none = matrix_invert_lu(m);
+    TEST(!none.data);
+
+    tensor_free(m);
+    tensor_free(inv);
+    tensor_free(id);
+    tensor_free(eye);
+    tensor_free(gj);
+}
+
 void test_solve_system()
 {
     /* Testing solving system of equations:
@@ -241,6 +406,54 @@ See: https://www.wolframalpha.com/input/?i=systems+of+equations+calculator&assum
     tensor_free(t);
 }
 
+// Cholesky and QR agree with a known solution, and refuse what they can't solve
+void test_solve_factored()
+{
+    tensor M = tensor_vrandom(1, 2, 300, 150);
+    tensor truth = tensor_vrandom(1, 2, 150, 3);
+    tensor b = matrix_multiply(M, truth);
+    tensor chol = solve_system_cholesky(M, b);
+    tensor qr = solve_system_qr(M, b);
+    tensor mt = tensor_transpose_view(M, 0, 1);
+    tensor mtt = tensor_transpose_view(mt, 0, 1);
+    tensor qrt = solve_system_qr(mtt, b);
+    TEST(same_tensor(chol, truth));
+    TEST(same_tensor(qr, truth));
+    TEST(same_tensor(qrt, truth));
+
+    // two equal columns: singular normal equations, rank deficient M
+    size_t i;
+    for(i = 0; i < M.size[0]; ++i) M.data[i*M.size[1] + 1] = M.data[i*M.size[1]];
+    tensor bad_chol = solve_system_cholesky(M, b);
+    tensor bad_qr = solve_system_qr(M, b);
+    TEST(!bad_chol.data);
+    TEST(!bad_qr.data);
+
+    // badly conditioned but full rank: too much for Cholesky, so the
+    // factored solve has to fall back to QR
+    tensor N = tensor_vrandom(1, 2, 200, 4);
+    for(i = 0; i < N.size[0]; ++i) N.data[i*4 + 1] = N.data[i*4] + 1e-3f*N.data[i*4 + 1];
+    tensor nt = tensor_vrandom(1, 2, 4, 1);
+    tensor nb = matrix_multiply(N, nt);
+    tensor ill_chol = solve_system_cholesky(N, nb);
+    tensor ill = solve_system_factored(N, nb);
+    TEST(!ill_chol.data);
+    TEST(same_tensor(ill, nt));
+
+    tensor_free(M);
+    tensor_free(truth);
+    tensor_free(b);
+    tensor_free(chol);
+    tensor_free(qr);
+    tensor_free(mt);
+    tensor_free(mtt);
+    tensor_free(qrt);
+    tensor_free(N);
+    tensor_free(nt);
+    tensor_free(nb);
+    tensor_free(ill);
+}
+
 void test_copy()
 {
     size_t s[2] = {3, 5};
@@ -316,6 +529,716 @@ void test_elementwise()
     TEST(same_tensor(a2, t2));
 }
 
+void test_reduce()
+{
+    size_t i, k;
+    tensor a = tensor_vrandom(1, 3, 3, 4, 5);
+    size_t ax1[1] = {1};
+    size_t ax02[2] = {2, 0};
+    tensor s = tensor_sum_axes(a, 2, ax02);
+    tensor mx = tensor_max_axes(a, 1, ax1);
+    size_t arg[15];
+    tensor_argmax_axes(arg, a, 1, ax1);
+    TEST(s.n == 1 && s.size[0] == 4);
+    TEST(mx.n == 2 && mx.size[0] == 3 && mx.size[1] == 5);
+    for(k = 0; k < 4; ++k){
+        float sum = 0;
+        for(i = 0; i < 15; ++i) sum += a.data[(i/5)*20 + k*5 + i%5];
+        TEST(within_eps(sum, s.data[k]));
+    }
+    for(i = 0; i < 15; ++i){
+        size_t best = 0;
+        for(k = 1; k < 4; ++k){
+            if(a.data[(i/5)*20 + k*5 + i%5] > a.data[(i/5)*20 + best*5 + i%5]) best = k;
+        }
+        TEST(arg[i] == best);
+        TEST(mx.data[i] == a.data[(i/5)*20 + best*5 + i%5]);
+    }
+
+    // big enough to be split over threads, by kept and by reduced axes
+    int threads = parallel_threads();
+    parallel_set_threads(4);
+    tensor x = tensor_vrandom(1, 4, 8, 16, 32, 32);
+    size_t bias[3] = {0, 2, 3};
+    size_t all[4] = {0, 1, 2, 3};
+    tensor db = tensor_sum_axes(x, 3, bias);
+    tensor truth = tensor_vmake(1, 16);
+    for(i = 0; i < tensor_len(x); ++i) truth.data[(i/1024)%16] += x.data[i];
+    TEST(same_tensor(truth, db));
+    tensor m = tensor_mean_axes(x, 4, all);
+    TEST(within_eps(m.data[0]*tensor_len(x), tensor_sum(x)));
+    x.data[77777] = 10;
+    x.data[99999] = 10;
+    tensor_argmax_axes(arg, x, 4, all);
+    TEST(arg[0] == 77777);
+    parallel_set_threads(threads);
+
+    tensor_free(a);
+    tensor_free(s);
+    tensor_free(mx);
+    tensor_free(x);
+    tensor_free(db);
+    tensor_free(truth);
+    tensor_free(m);
+}
+
+// Straightforward C = alpha*a*b + beta*c to check the blocked GEMM against
+void naive_gemm(float alpha, tensor a, tensor b, float beta, tensor c)
+{
+    size_t i, j, k;
+    for(i = 0; i < c.size[0]; ++i){
+        for(j = 0; j < c.size[1]; ++j){
+            float sum = 0;
+            for(k = 0; k < a.size[1]; ++k){
+                sum += a.data[i*a.stride[0] + k*a.stride[1]]*b.data[k*b.stride[0] + j*b.stride[1]];
+            }
+            float *cij = c.data + i*c.stride[0] + j*c.stride[1];
+            *cij = alpha*sum + beta*(*cij);
+        }
+    }
+}
+
+void test_gemm()
+{
+    // shapes around the micro-tile and block edges, with small blocks so
+    // every loop of the blocking runs more than once
+    size_t shapes[5][3] = {{1, 1, 1}, {7, 17, 5}, {13, 33, 300}, {64, 64, 64}, {50, 70, 530}};
+    gemm_blocking saved = gemm_get_blocking();
+    gemm_blocking small = {12, 64, 64};
+    ISA isa = simd()->isa;
+    int level, s, blocked;
+    for(level = ISA_SCALAR; level <= (int)isa; ++level){
+        simd_set_isa(level);
+        for(blocked = 0; blocked < 2; ++blocked){
+            gemm_set_blocking(blocked ? small : saved);
+            for(s = 0; s < 5; ++s){
+                size_t m = shapes[s][0], n = shapes[s][1], k = shapes[s][2];
+                tensor a = tensor_vrandom(1, 2, m, k);
+                tensor bt = tensor_vrandom(1, 2, n, k);
+                tensor b = tensor_transpose_view(bt, 0, 1);
+                tensor c = tensor_vrandom(1, 2, m, n);
+                tensor truth = tensor_copy(c);
+                naive_gemm(.5, a, b, 2, truth);
+                gemm_strided(m, n, k, .5, a.data, a.stride[0], a.stride[1],
+                        b.data, b.stride[0], b.stride[1], 2, c.data, c.stride[0], c.stride[1]);
+                TEST(same_tensor(truth, c));
+
+                // strided output
+                tensor ct = tensor_vmake(2, n, m);
+                tensor ctt = tensor_transpose_view(ct, 0, 1);
+                matrix_multiply_into(ctt, a, b);
+                naive_gemm(1, a, b, 0, truth);
+                tensor cc = tensor_contiguous(ctt);
+                TEST(same_tensor(truth, cc));
+                tensor_free(cc);
+
+                tensor_free(a);
+                tensor_free(bt);
+                tensor_free(b);
+                tensor_free(c);
+                tensor_free(truth);
+                tensor_free(ct);
+                tensor_free(ctt);
+            }
+        }
+    }
+    gemm_set_blocking(saved);
+    simd_set_isa(isa);
+
+    // transpose flags read the operands transposed in place
+    {
+        tensor at = tensor_vrandom(1, 2, 9, 7);
+        tensor bt = tensor_vrandom(1, 2, 11, 9);
+        tensor c = tensor_vrandom(1, 2, 7, 11);
+        tensor truth = tensor_copy(c);
+        tensor a = tensor_transpose_view(at, 0, 1);
+        tensor b = tensor_transpose_view(bt, 0, 1);
+        naive_gemm(-1, a, b, 1, truth);
+        gemm(1, 1, -1, at, bt, 1, c);
+        TEST(same_tensor(truth, c));
+        tensor_free(at);
+        tensor_free(bt);
+        tensor_free(a);
+        tensor_free(b);
+        tensor_free(c);
+        tensor_free(truth);
+    }
+
+    // big enough to be cut up between threads
+    int threads = parallel_threads();
+    parallel_set_threads(3);
+    tensor a = tensor_vrandom(1, 2, 200, 150);
+    tensor b = tensor_vrandom(1, 2, 150, 301);
+    tensor c = matrix_multiply(a, b);
+    tensor truth = tensor_vmake(2, 200, 301);
+    naive_gemm(1, a, b, 0, truth);
+    TEST(same_tensor(truth, c));
+    parallel_set_threads(threads);
+    tensor_free(a);
+    tensor_free(b);
+    tensor_free(c);
+    tensor_free(truth);
+}
+
+void test_gemm_batched()
+{
+    // small batches cut up each multiply, big ones share out whole ones
+    size_t shapes[3][4] = {{3, 5, 7, 9}, {2, 64, 200, 150}, {5, 32, 200, 150}};
+    int threads = parallel_threads();
+    int t, s;
+    size_t i;
+    for(t = 1; t <= 3; t += 2){
+        parallel_set_threads(t);
+        for(s = 0; s < 3; ++s){
+            size_t batch = shapes[s][0], m = shapes[s][1], n = shapes[s][2], k = shapes[s][3];
+            tensor w = tensor_vrandom(1, 2, m, k);
+            tensor x = tensor_vrandom(1, 3, batch, k, n);
+            tensor y = tensor_vrandom(1, 3, batch, m, n);
+            tensor truth = tensor_copy(y);
+            for(i = 0; i < batch; ++i){
+                naive_gemm(2, w, tensor_get_(x, i), -1, tensor_get_(truth, i));
+            }
+            gemm_batched(0, 0, 2, w, x, -1, y);
+            TEST(same_tensor(truth, y));
+
+            // per-image A against a shared, transposed B
+            tensor xt = tensor_vrandom(1, 3, batch, k, m);
+            tensor wt = tensor_vrandom(1, 2, n, k);
+            tensor wtt = tensor_transpose_view(wt, 0, 1);
+            for(i = 0; i < batch; ++i){
+                tensor xi = tensor_transpose_view(tensor_get_(xt, i), 0, 1);
+                naive_gemm(1, xi, wtt, 0, tensor_get_(truth, i));
+                tensor_free(xi);
+            }
+            gemm_batched(1, 1, 1, xt, wt, 0, y);
+            TEST(same_tensor(truth, y));
+
+            tensor_free(w);
+            tensor_free(x);
+            tensor_free(y);
+            tensor_free(truth);
+            tensor_free(xt);
+            tensor_free(wt);
+            tensor_free(wtt);
+        }
+    }
+    parallel_set_threads(threads);
+}
+
+void test_tune_cache()
+{
+    const char *path = "test_tune.cache";
+    FILE *fp = fopen(path, "w");
+    fprintf(fp, "some other cpu\tscalar 4x8\t1 2 3\n");
+    fclose(fp);
+
+    gemm_tuning t = {"scalar 4x8", {96, 128, 1024}};
+    gemm_tuning u = {{0}};
+    TEST(tune_save(path, t));
+    TEST(tune_load(path, &u));
+    TEST(0 == strcmp(u.kernel, t.kernel));
+    TEST(u.blocking.mc == 96 && u.blocking.kc == 128 && u.blocking.nc == 1024);
+
+    // saving again replaces this cpu's line and keeps the others
+    t.blocking.kc = 384;
+    TEST(tune_save(path, t));
+    TEST(tune_load(path, &u) && u.blocking.kc == 384);
+    char line[256];
+    int lines = 0, other = 0;
+    fp = fopen(path, "r");
+    while(fgets(line, sizeof(line), fp)){
+        if(line[0] == '#') continue;
+        ++lines;
+        other += (0 == strncmp(line, "some other cpu\t", 15));
+    }
+    fclose(fp);
+    TEST(lines == 2 && other == 1);
+    remove(path);
+    TEST(!tune_load(path, &u));
+
+    // every kernel the cpu lists can be picked by name
+    const char *saved = gemm_kernel_name();
+    const char *name;
+    size_t i;
+    for(i = 0; (name = gemm_kernel_list(i)); ++i){
+        TEST(gemm_set_kernel(name) && 0 == strcmp(gemm_kernel_name(), name));
+    }
+    TEST(i > 0);
+    TEST(!gemm_set_kernel("no such kernel"));
+    gemm_set_kernel(saved);
+}
+
+// Every backend agrees with the plain loops
+void test_matrix_backends()
+{
+    const char *saved = matrix_backend_get()->name;
+    const char *name;
+    size_t i;
+    for(i = 0; (name = matrix_backend_list(i)); ++i){
+        TEST(matrix_set_backend(name));
+        tensor at = tensor_vrandom(1, 2, 37, 21);
+        tensor b = tensor_vrandom(1, 2, 37, 45);
+        tensor a = tensor_transpose_view(at, 0, 1);
+        tensor c = tensor_vrandom(1, 2, 21, 45);
+        tensor truth = tensor_copy(c);
+        naive_gemm(.5, a, b, -1, truth);
+        gemm(1, 0, .5, at, b, -1, c);
+        TEST(same_tensor(truth, c));
+
+        tensor x = tensor_vrandom(1, 3, 3, 37, 45);
+        tensor y = tensor_vmake(3, 3, 21, 45);
+        gemm_batched(0, 0, 1, a, x, 0, y);
+        naive_gemm(1, a, tensor_get_(x, 2), 0, truth);
+        TEST(same_tensor(truth, tensor_get_(y, 2)));
+
+        tensor t = matrix_transpose(a);
+        TEST(same_tensor(t, at));
+
+        tensor m = tensor_vrandom(1, 2, 20, 20);
+        tensor inv = matrix_invert(m);
+        tensor id = matrix_multiply(m, inv);
+        tensor eye = tensor_vmake(2, 20, 20);
+        size_t j;
+        for(j = 0; j < 20; ++j) eye.data[j*21] = 1;
+        TEST(same_tensor(id, eye));
+
+        tensor M = tensor_vrandom(1, 2, 30, 5);
+        tensor truth_a = tensor_vrandom(1, 2, 5, 2);
+        tensor rhs = matrix_multiply(M, truth_a);
+        tensor sol = solve_system(M, rhs);
+        TEST(same_tensor(sol, truth_a));
+
+        tensor_free(at);
+        tensor_free(b);
+        tensor_free(a);
+        tensor_free(c);
+        tensor_free(truth);
+        tensor_free(x);
+        tensor_free(y);
+        tensor_free(t);
+        tensor_free(m);
+        tensor_free(inv);
+        tensor_free(id);
+        tensor_free(eye);
+        tensor_free(M);
+        tensor_free(truth_a);
+        tensor_free(rhs);
+        tensor_free(sol);
+    }
+    TEST(!matrix_set_backend("no such backend"));
+    matrix_set_backend(saved);
+}
+
+// Whether t is the transpose of a, element by element through the strides
+int is_transpose(tensor t, tensor a)
+{
+    size_t i, j;
+    if(t.size[0] != a.size[1] || t.size[1] != a.size[0]) return 0;
+    for(i = 0; i < a.size[0]; ++i){
+        for(j = 0; j < a.size[1]; ++j){
+            if(t.data[j*t.stride[0] + i*t.stride[1]] != a.data[i*a.stride[0] + j*a.stride[1]]) return 0;
+        }
+    }
+    return 1;
+}
+
+void test_blocked_transpose()
+{
+    size_t shapes[5][2] = {{1, 1}, {13, 29}, {64, 200}, {203, 67}, {600, 500}};
+    int threads = parallel_threads();
+    parallel_set_threads(3);
+    ISA isa = simd()->isa;
+    int level, s;
+    for(level = ISA_SCALAR; level <= (int)isa; ++level){
+        simd_set_isa(level);
+        for(s = 0; s < 5; ++s){
+            tensor a = tensor_vrandom(1, 2, shapes[s][0], shapes[s][1]);
+            tensor t = matrix_transpose(a);
+            TEST(is_transpose(t, a));
+            // strided source goes the slow way
+            tensor at = tensor_transpose_view(a, 0, 1);
+            tensor tt = matrix_transpose(at);
+            TEST(is_transpose(tt, at));
+
+            if(shapes[s][0] == shapes[s][1] || s == 4){
+                size_t n = shapes[s][0];
+                tensor sq = tensor_vrandom(1, 2, n, n);
+                tensor c = tensor_copy(sq);
+                matrix_transpose_(c);
+                TEST(is_transpose(c, sq));
+                tensor_free(sq);
+                tensor_free(c);
+            }
+            tensor_free(a);
+            tensor_free(t);
+            tensor_free(at);
+            tensor_free(tt);
+        }
+        tensor sq = tensor_vrandom(1, 2, 37, 37);
+        tensor c = tensor_copy(sq);
+        matrix_transpose_(c);
+        TEST(is_transpose(c, sq));
+        tensor_free(sq);
+        tensor_free(c);
+    }
+    simd_set_isa(isa);
+    parallel_set_threads(threads);
+}
+
+// The final layer is refit in closed form on top of frozen features
+void test_fit_final_layer()
+{
+    net m = {0};
+    m.n = 4;
+    m.layers = calloc(m.n, sizeof(layer));
+    m.layers[0] = make_connected_layer(6, 8);
+    m.layers[1] = make_activation_layer(RELU);
+    m.layers[2] = make_connected_layer(8, 3);
+    m.layers[3] = make_activation_layer(SOFTMAX);
+    net frozen = {2, m.layers};
+
+    // targets exactly linear in the frozen features
+    data d;
+    d.x = tensor_vrandom(1, 2, 500, 6);
+    tensor h = forward_net(frozen, d.x);
+    tensor w = tensor_vrandom(1, 2, 8, 3);
+    tensor b = tensor_vrandom(1, 2, 1, 3);
+    d.y = matrix_multiply(h, w);
+    tensor_add_(d.y, b);
+    tensor first = tensor_copy(m.layers[0].w);
+
+    TEST(fit_final_layer(m, d, 64, 0));
+    TEST(same_tensor(m.layers[2].w, w));
+    TEST(same_tensor(m.layers[2].b, b));
+    TEST(same_tensor(m.layers[0].w, first));
+
+    // a penalty shrinks the weights
+    TEST(fit_final_layer(m, d, 500, 10));
+    tensor fit2 = tensor_mul(m.layers[2].w, m.layers[2].w);
+    tensor w2 = tensor_mul(w, w);
+    TEST(tensor_sum(fit2) < tensor_sum(w2));
+
+    net no_fc = {1, m.layers + 1};
+    TEST(!fit_final_layer(no_fc, d, 64, 0));
+
+    tensor_free(h);
+    tensor_free(w);
+    tensor_free(b);
+    tensor_free(first);
+    tensor_free(fit2);
+    tensor_free(w2);
+    free_data(d);
+    free_net(m);
+}
+
+// Sparse multiplies agree with dense ones, pruning keeps what it should
+void test_sparse()
+{
+    tensor a = tensor_vrandom(1, 2, 37, 50);
+    size_t i;
+    for(i = 0; i < 37*50; ++i) if(i % 3) a.data[i] = 0;
+    sparse_matrix *s = sparse_from_dense(a);
+    TEST(s->nnz == (37*50 + 2)/3);
+    tensor back = sparse_to_dense(s);
+    TEST(same_tensor(a, back));
+
+    size_t batches[2] = {3, 64};
+    int k;
+    for(k = 0; k < 2; ++k){
+        tensor x = tensor_vrandom(1, 2, batches[k], 50);
+        tensor y = tensor_vmake(2, batches[k], 37);
+        tensor truth = tensor_vmake(2, batches[k], 37);
+        sparse_multiply_t_into(y, x, s);
+        gemm(0, 1, 1, x, a, 0, truth);
+        TEST(same_tensor(y, truth));
+        tensor_free(x);
+        tensor_free(y);
+        tensor_free(truth);
+    }
+
+    layer l = make_connected_layer(50, 20);
+    tensor x = tensor_vrandom(1, 2, 16, 50);
+    prune_connected_layer(&l, .9);
+    size_t zeros = 0;
+    for(i = 0; i < 50*20; ++i) zeros += l.w.data[i] == 0;
+    TEST(zeros == 900);
+    TEST(l.sw->nnz == 100);
+    tensor y = l.forward(&l, x);
+    tensor truth = matrix_multiply(x, l.w);
+    tensor_add_(truth, l.b);
+    TEST(same_tensor(y, truth));
+
+    // training keeps the pruned weights at zero
+    tensor dx = l.backward(&l, y);
+    l.update(&l, .1, 0, 0);
+    zeros = 0;
+    for(i = 0; i < 50*20; ++i) zeros += l.w.data[i] == 0;
+    TEST(zeros >= 900);
+    tensor dense = sparse_to_dense(l.sw);
+    tensor wt = matrix_transpose(l.w);
+    TEST(same_tensor(dense, wt));
+
+    tensor_free(a);
+    tensor_free(back);
+    free_sparse(s);
+    tensor_free(x);
+    tensor_free(y);
+    tensor_free(truth);
+    tensor_free(dx);
+    tensor_free(dense);
+    tensor_free(wt);
+    free_layer(l);
+}
+
+// The SVD reconstructs its input, compression keeps what the rank allows
+void test_svd()
+{
+    size_t shapes[3][2] = {{40, 12}, {12, 40}, {33, 33}};
+    int k;
+    for(k = 0; k < 3; ++k){
+        tensor a = tensor_vrandom(1, 2, shapes[k][0], shapes[k][1]);
+        tensor u, s, v;
+        matrix_svd(a, &u, &s, &v);
+        size_t r = s.size[0], i;
+        for(i = 1; i < r; ++i) TEST(s.data[i-1] >= s.data[i]);
+        tensor us = tensor_copy(u);
+        tensor_mul_(us, s);
+        tensor b = tensor_vmake(2, shapes[k][0], shapes[k][1]);
+        gemm(0, 1, 1, us, v, 0, b);
+        TEST(same_tensor(a, b));
+        tensor utu = tensor_vmake(2, r, r);
+        gemm(1, 0, 1, u, u, 0, utu);
+        tensor eye = tensor_vmake(2, r, r);
+        for(i = 0; i < r; ++i) eye.data[i*(r + 1)] = 1;
+        TEST(same_tensor(utu, eye));
+        tensor_free(a);
+        tensor_free(u);
+        tensor_free(s);
+        tensor_free(v);
+        tensor_free(us);
+        tensor_free(b);
+        tensor_free(utu);
+        tensor_free(eye);
+    }
+
+    // a rank 4 layer survives compression to rank 4 unchanged
+    net m = {2, calloc(2, sizeof(layer))};
+    m.layers[0] = make_connected_layer(30, 20);
+    m.layers[1] = make_activation_layer(RELU);
+    tensor left = tensor_vrandom(1, 2, 30, 4);
+    tensor right = tensor_vrandom(1, 2, 4, 20);
+    matrix_multiply_into(m.layers[0].w, left, right);
+    m.layers[0].b.data[3] = 1;
+    tensor x = tensor_vrandom(1, 2, 5, 30);
+    tensor y = forward_net(m, x);
+    layer *old = m.layers;
+    net c = compress_connected_layer(m, 0, 0, .9999);
+    free(old);
+    TEST(c.n == 3);
+    TEST(c.layers[0].w.size[1] == 4);
+    tensor yc = forward_net(c, x);
+    TEST(same_tensor(y, yc));
+    net c2 = compress_connected_layer(c, 0, 2, 1);
+    free(c.layers);
+    TEST(c2.n == 4);
+    TEST(c2.layers[0].w.size[1] == 2);
+
+    tensor_free(left);
+    tensor_free(right);
+    tensor_free(x);
+    tensor_free(y);
+    tensor_free(yc);
+    free_net(c2);
+}
+
+void test_connected_4d_input()
+{
+    // e.g. a connected layer right after a conv layer
+    layer l = make_connected_layer(3*4*5, 6);
+    tensor x = tensor_vrandom(1, 4, 2, 3, 4, 5);
+    tensor y = l.forward(&l, x);
+    tensor dx = l.backward(&l, y);
+    TEST(dx.n == 4 && dx.size[1] == 3 && dx.size[3] == 5);
+    tensor_free(x);
+    tensor_free(y);
+    tensor_free(dx);
+    free_layer(l);
+}
+
+void test_broadcast_ops()
+{
+    {
+        // bias-style broadcast over NCHW
+        tensor x = tensor_vrandom(1, 4, 3, 4, 5, 6);
+        tensor b = tensor_vrandom(1, 4, 1, 4, 1, 1);
+        tensor y = tensor_add(x, b);
+        tensor truth = tensor_copy(x);
+        size_t i;
+        for(i = 0; i < tensor_len(x); ++i){
+            truth.data[i] += b.data[(i / 30) % 4];
+        }
+        TEST(same_tensor(truth, y));
+        tensor_free(x);
+        tensor_free(b);
+        tensor_free(y);
+        tensor_free(truth);
+    }
+    {
+        // both sides broadcast: (4, 1, 3) / (2, 1) -> (4, 2, 3)
+        tensor a = tensor_vrandom(1, 3, 4, 1, 3);
+        tensor b = tensor_vrandom(1, 2, 2, 1);
+        tensor_scale_(.5, b);
+        b.data[0] += 2;
+        b.data[1] += 2;
+        tensor y = tensor_div(a, b);
+        TEST(y.n == 3 && y.size[0] == 4 && y.size[1] == 2 && y.size[2] == 3);
+        tensor truth = tensor_vmake(3, 4, 2, 3);
+        size_t i, j, k;
+        for(i = 0; i < 4; ++i){
+            for(j = 0; j < 2; ++j){
+                for(k = 0; k < 3; ++k){
+                    truth.data[i*6 + j*3 + k] = a.data[i*3 + k] / b.data[j];
+                }
+            }
+        }
+        TEST(same_tensor(truth, y));
+        tensor_free(a);
+        tensor_free(b);
+        tensor_free(y);
+        tensor_free(truth);
+    }
+    {
+        // strided operand and scalar on the left
+        tensor m = tensor_vrandom(1, 2, 7, 9);
+        tensor mt = tensor_transpose_view(m, 0, 1);
+        tensor c = tensor_copy(mt);
+        tensor s = tensor_vmake(0);
+        s.data[0] = 3;
+        tensor y = tensor_sub(s, mt);
+        tensor truth = tensor_sub(s, c);
+        tensor z = tensor_mul(mt, c);
+        tensor truth_z = tensor_mul(c, c);
+        TEST(same_tensor(truth, y));
+        TEST(same_tensor(truth_z, z));
+        TEST(within_eps(y.data[1], 3 - m.data[9]));
+        tensor_free(m);
+        tensor_free(mt);
+        tensor_free(c);
+        tensor_free(s);
+        tensor_free(y);
+        tensor_free(truth);
+        tensor_free(z);
+        tensor_free(truth_z);
+    }
+}
+
+void test_tensor_into()
+{
+    tensor a = tensor_vrandom(1, 3, 4, 3, 5);
+    tensor b = tensor_vrandom(1, 2, 3, 1);
+    tensor truth = tensor_mul(a, b);
+
+    // output parameter, then the same thing with the output aliasing a
+    tensor t = tensor_vempty(3, 4, 3, 5);
+    tensor_mul_into(t, a, b);
+    TEST(same_tensor(truth, t));
+    tensor c = tensor_copy(a);
+    tensor_mul_(c, b);
+    TEST(same_tensor(truth, c));
+    tensor_div_into(c, c, b);
+    TEST(same_tensor(a, c));
+
+    // strided output
+    tensor at = tensor_transpose_view(a, 1, 2);
+    tensor tt = tensor_transpose_view(t, 1, 2);
+    tensor_sub_into(tt, at, at);
+    TEST(tensor_sum(t) == 0);
+    tensor_add_into(tt, at, at);
+    tensor_scale_into(c, 2, a);
+    TEST(same_tensor(t, c));
+    tensor_scale_(.5, tt);
+    TEST(same_tensor(t, a));
+
+    // sum over a dimension, into a buffer and accumulated into a (1, n) one
+    tensor s = tensor_sum_dim(a, 1);
+    tensor st = tensor_vrandom(1, 2, 4, 5);
+    tensor_sum_dim_into(st, a, 1);
+    TEST(same_tensor(s, st));
+    tensor m = tensor_vview(a, 2, 12, 5);
+    tensor acc = tensor_vmake(2, 1, 5);
+    tensor_sum_dim_(acc, m, 0);
+    tensor_sum_dim_(acc, m, 0);
+    tensor s0 = tensor_sum_dim(m, 0);
+    TEST(within_eps(acc.data[3], 2*s0.data[3]));
+
+    tensor_free(a);
+    tensor_free(b);
+    tensor_free(truth);
+    tensor_free(t);
+    tensor_free(c);
+    tensor_free(at);
+    tensor_free(tt);
+    tensor_free(s);
+    tensor_free(st);
+    tensor_free(m);
+    tensor_free(acc);
+    tensor_free(s0);
+}
+
+void test_simd()
+{
+    ISA best = simd_detect();
+    ISA isa;
+    BINARY_OP op;
+    size_t n = 77;
+    tensor a = tensor_vrandom(1, 1, n);
+    tensor b = tensor_vrandom(1, 1, n);
+    size_t i;
+    for(i = 0; i < n; ++i) b.data[i] += 3;
+    for(isa = ISA_SCALAR; isa <= best; ++isa){
+        int ok = 1;
+        for(op = ADD_OP; op <= DIV_OP; ++op){
+            simd_set_isa(ISA_SCALAR);
+            tensor t1 = tensor_vempty(1, n), t2 = tensor_vempty(1, n), t3 = tensor_vempty(1, n);
+            simd()->binary(op, n, a.data, 1, b.data, 1, t1.data);
+            simd()->binary(op, n, a.data, 1, b.data, 0, t2.data);
+            simd()->binary(op, n, a.data, 0, b.data, 1, t3.data);
+            simd_set_isa(isa);
+            tensor v1 = tensor_vempty(1, n), v2 = tensor_vempty(1, n), v3 = tensor_vempty(1, n);
+            simd()->binary(op, n, a.data, 1, b.data, 1, v1.data);
+            simd()->binary(op, n, a.data, 1, b.data, 0, v2.data);
+            simd()->binary(op, n, a.data, 0, b.data, 1, v3.data);
+            ok = ok && same_tensor(t1, v1) && same_tensor(t2, v2) && same_tensor(t3, v3);
+            tensor_free(t1); tensor_free(t2); tensor_free(t3);
+            tensor_free(v1); tensor_free(v2); tensor_free(v3);
+        }
+        TEST(ok);
+
+        simd_set_isa(isa);
+        size_t len;
+        for(len = 0; len < n; len += 13){
+            tensor x = tensor_vrandom(1, 1, len);
+            tensor y = tensor_vrandom(1, 1, len);
+            tensor truth = tensor_copy(y);
+            float sum = 0;
+            for(i = 0; i < len; ++i){
+                truth.data[i] = 1.5*(truth.data[i] + .25*x.data[i]);
+                sum += x.data[i];
+            }
+            tensor_axpy_(.25, x, y);
+            tensor_scale_(1.5, y);
+            TEST(same_tensor(truth, y));
+            TEST(within_eps(sum, tensor_sum(x)));
+            tensor_free(x);
+            tensor_free(y);
+            tensor_free(truth);
+        }
+    }
+    simd_set_isa(best);
+    tensor_free(a);
+    tensor_free(b);
+}
+
 void test_tensor_sum()
 {
     size_t s1[3] = {3, 2, 5};
@@ -336,16 +1259,131 @@ void time_matrix_multiply()
 {
     size_t i;
     size_t n = 100;
+    int t;
+    int threads = parallel_threads();
+    double base = 0;
     tensor a = tensor_vrandom(1, 2, 512, 768);
     tensor b = tensor_vrandom(1, 2, 768, 384);
-    double start = currtime();
-    for(i = 0; i < n; ++i){
-        tensor c = matrix_multiply(a, b);
-        tensor_free(c);
+    for(t = 1; t <= threads; ++t){
+        parallel_set_threads(t);
+        double start = currtime();
+        for(i = 0; i < n; ++i){
+            tensor c = matrix_multiply(a, b);
+            tensor_free(c);
+        }
+        double end = currtime();
+        if(t == 1) base = end - start;
+        printf("matrix_multiply (%s, %d threads) took %f sec, %.2fx\n",
+                gemm_kernel_name(), t, end - start, base/(end - start));
+        printf("%g gflops\n", gflops(1.0*n*a.size[0]*b.size[0]*b.size[1], (end-start)));
+    }
+    parallel_set_threads(threads);
+
+    // the same multiply on every backend, the reference one only briefly
+    const char *saved = matrix_backend_get()->name;
+    const char *name;
+    int k;
+    for(k = 0; (name = matrix_backend_list(k)); ++k){
+        size_t runs = strcmp(name, "reference") ? n : 2;
+        matrix_set_backend(name);
+        double start = currtime();
+        for(i = 0; i < runs; ++i){
+            tensor c = matrix_multiply(a, b);
+            tensor_free(c);
+        }
+        double end = currtime();
+        printf("%s backend: %g gflops\n", name,
+                gflops(1.0*runs*a.size[0]*b.size[0]*b.size[1], end - start));
+    }
+    matrix_set_backend(saved);
+    tensor_free(a);
+    tensor_free(b);
+
+    // least squares: the old normal equations and inverse against the
+    // factorizations solve_system picks from
+    tensor M = tensor_vrandom(1, 2, 8192, 512);
+    tensor rhs = tensor_vrandom(1, 2, 8192, 10);
+    tensor sq = tensor_vrandom(1, 2, 1024, 1024);
+    tensor (*inverters[])(tensor) = {matrix_invert_gauss_jordan, matrix_invert_lu};
+    const char *inverter_names[] = {"gauss-jordan", "lu"};
+    for(k = 0; k < 2; ++k){
+        double start = currtime();
+        tensor inv = inverters[k](sq);
+        double end = currtime();
+        printf("matrix_invert (%s) took %f sec\n", inverter_names[k], end - start);
+        tensor_free(inv);
+    }
+    tensor_free(sq);
+
+    tensor (*solvers[])(tensor, tensor) = {solve_system_normal, solve_system_cholesky, solve_system_qr};
+    const char *solver_names[] = {"normal equations", "cholesky", "qr"};
+    for(k = 0; k < 3; ++k){
+        double start = currtime();
+        tensor x = solvers[k](M, rhs);
+        double end = currtime();
+        printf("solve_system (%s) took %f sec\n", solver_names[k], end - start);
+        tensor_free(x);
+    }
+    tensor_free(M);
+    tensor_free(rhs);
+
+    // a connected layer before and after pruning 90% of its weights
+    layer l = make_connected_layer(1024, 1024);
+    tensor x = tensor_vrandom(1, 2, 128, 1024);
+    for(k = 0; k < 2; ++k){
+        if(k) prune_connected_layer(&l, .9);
+        double start = currtime();
+        for(i = 0; i < n; ++i){
+            tensor y = l.forward(&l, x);
+            tensor_free(y);
+        }
+        double end = currtime();
+        printf("connected forward (%s) took %f sec\n", k ? "90% pruned" : "dense", end - start);
+    }
+    tensor_free(x);
+    free_layer(l);
+
+    // a wide convolution lowered with im2col and gathered inside the GEMM
+    layer c = make_convolutional_layer(256, 256, 3, 1, 1);
+    x = tensor_vrandom(1, 4, 16, 256, 28, 28);
+    printf("implicit convolution saves %zu bytes of columns\n", conv_lowered_bytes(&c, x));
+    const char *conv_names[] = {"im2col", "implicit", "winograd 2x2", "winograd 4x4"};
+    for(k = 0; k < 4; ++k){
+        conv_set_implicit(&c, k == 1);
+        if(k >= 2) conv_set_winograd(&c, 2*(k - 1));
+        double start = currtime();
+        tensor y = c.forward(&c, x);
+        double mid = currtime();
+        tensor dx = c.backward(&c, y);
+        double end = currtime();
+        printf("conv (%s) forward took %f sec, backward %f sec\n", conv_names[k],
+                mid - start, end - mid);
+        tensor_free(y);
+        tensor_free(dx);
+    }
+    tensor_free(x);
+    free_layer(c);
+
+    // a 1x1 convolution lowered with im2col and multiplied directly
+    c = make_convolutional_layer(256, 256, 1, 1, 0);
+    x = tensor_vrandom(1, 4, 16, 256, 28, 28);
+    layer d = make_convolutional_layer(256, 256, 1, 1, 0);
+    conv_set_winograd(&c, 0);
+    layer *convs[] = {&c, &d};
+    for(k = 0; k < 2; ++k){
+        double start = currtime();
+        tensor y = convs[k]->forward(convs[k], x);
+        double mid = currtime();
+        tensor dx = convs[k]->backward(convs[k], y);
+        double end = currtime();
+        printf("1x1 conv (%s) forward took %f sec, backward %f sec\n", k ? "direct" : "im2col",
+                mid - start, end - mid);
+        tensor_free(y);
+        tensor_free(dx);
     }
-    double end = currtime();
-    printf("matrix_multiply took %f sec\n", end - start);
-    printf("%g gflops\n", gflops(1.0*n*a.size[0]*b.size[0]*b.size[1], (end-start)));
+    tensor_free(x);
+    free_layer(c);
+    free_layer(d);
 }
 
 void time_tensor()
@@ -394,7 +1432,7 @@ void time_tensor()
             tensor_free(c);
         }
         end = currtime();
-        printf("matrix_multiply took %f sec\n", end - start);
+        printf("matrix_multiply (%s) took %f sec\n", gemm_kernel_name(), end - start);
         printf("%g gflops\n", gflops(1.0 * n * s[0] * s[1] * s[1], (end - start)));
     }
     {
@@ -473,6 +1511,38 @@ void time_tensor()
         printf("tensor_mul took %f sec\n", end - start);
         printf("%g gflops\n", gflops(n * s[0] * s[1], (end - start)));
     }
+    {
+        // transpose bandwidth, counting one read and one write per element
+        size_t i, j, k;
+        size_t n = 10;
+        size_t s = 4096;
+        tensor a = tensor_vrandom(1, 2, s, s);
+        tensor t = tensor_vempty(2, s, s);
+        double gb = 2.0 * n * s * s * sizeof(float) / 1e9;
+
+        double start = currtime();
+        for (k = 0; k < n; ++k)
+        {
+            for (i = 0; i < s; ++i)
+                for (j = 0; j < s; ++j)
+                    t.data[j * s + i] = a.data[i * s + j];
+        }
+        double end = currtime();
+        printf("naive transpose took %f sec, %g GB/s\n", end - start, gb / (end - start));
+
+        start = currtime();
+        for (k = 0; k < n; ++k) matrix_transpose_into(t, a);
+        end = currtime();
+        printf("matrix_transpose_into took %f sec, %g GB/s\n", end - start, gb / (end - start));
+
+        start = currtime();
+        for (k = 0; k < n; ++k) matrix_transpose_(a);
+        end = currtime();
+        printf("matrix_transpose_ took %f sec, %g GB/s\n", end - start, gb / (end - start));
+        tensor_free(a);
+        tensor_free(t);
+    }
+    pool_print_stats(stdout);
 }
 
 void test_activation_layer()
@@ -715,6 +1785,62 @@ void test_col2im()
     tensor_free(truth_col2im2);
 }
 
+// Naive lowering of one image, one element at a time, to check the fast
+// im2col and col2im against
+tensor naive_im2col(tensor im, size_t size_y, size_t size_x, size_t stride, size_t pad)
+{
+    long c = im.size[0], h = im.size[1], w = im.size[2];
+    long res_h = (h + 2*pad - size_y)/stride + 1;
+    long res_w = (w + 2*pad - size_x)/stride + 1;
+    tensor col = tensor_vmake(2, c*size_y*size_x, res_h*res_w);
+    long i, j;
+    for(i = 0; i < (long)col.size[0]; ++i){
+        long ch = i/(size_y*size_x), ky = i/size_x%size_y, kx = i%size_x;
+        for(j = 0; j < res_h*res_w; ++j){
+            long y = j/res_w*stride + ky - pad, x = j%res_w*stride + kx - pad;
+            if(y >= 0 && y < h && x >= 0 && x < w) col.data[i*col.size[1] + j] = im.data[(ch*h + y)*w + x];
+        }
+    }
+    return col;
+}
+
+void test_im2col_shapes()
+{
+    size_t shapes[][7] = {
+        // c, h, w, size_y, size_x, stride, pad
+        {3, 7, 9, 3, 3, 1, 1},
+        {2, 8, 8, 3, 3, 2, 1},
+        {4, 5, 6, 1, 1, 1, 0},
+        {1, 9, 7, 5, 3, 3, 2},
+        {2, 4, 4, 5, 5, 1, 3},
+        {3, 11, 10, 2, 4, 2, 0},
+        {1, 2, 3, 3, 3, 1, 2},
+    };
+    int k;
+    for(k = 0; k < 7; ++k){
+        size_t *s = shapes[k];
+        tensor im = tensor_vrandom(1, 3, s[0], s[1], s[2]);
+        tensor col = im2col(im, s[3], s[4], s[5], s[6]);
+        tensor truth = naive_im2col(im, s[3], s[4], s[5], s[6]);
+        TEST(same_tensor(truth, col));
+        TEST(0 == memcmp(truth.data, col.data, tensor_len(col)*sizeof(float)));
+
+        // col2im is the adjoint: <im2col(x), d> == <x, col2im(d)>
+        tensor d = tensor_random(1, col.n, col.size);
+        tensor back = col2im(d, s[0], s[1], s[2], s[3], s[4], s[5], s[6]);
+        double lhs = 0, rhs = 0;
+        size_t i;
+        for(i = 0; i < tensor_len(col); ++i) lhs += (double)col.data[i]*d.data[i];
+        for(i = 0; i < tensor_len(im); ++i) rhs += (double)im.data[i]*back.data[i];
+        TEST(within_eps(lhs, rhs));
+        tensor_free(im);
+        tensor_free(col);
+        tensor_free(truth);
+        tensor_free(d);
+        tensor_free(back);
+    }
+}
+
 
 void test_convolutional_layer()
 {
@@ -773,6 +1899,252 @@ void test_convolutional_layer()
     tensor_free(y);
 }
 
+// Cutting the batch into chunks of columns doesn't change a thing
+void test_conv_chunks()
+{
+    tensor xt = tensor_load("data/test/conv_x.tensor");
+    tensor dyt = tensor_load("data/test/conv_dy.tensor");
+    tensor truth_yt = tensor_load("data/test/conv_y.tensor");
+    tensor truth_dxt = tensor_load("data/test/conv_dx.tensor");
+    tensor dwt = tensor_load("data/test/conv_dw.tensor");
+    size_t per_image = 16*3*3*xt.size[2]*xt.size[3];
+    size_t workspace[2] = {1, 2*per_image};
+    int k;
+    for(k = 0; k < 2; ++k){
+        conv_set_workspace(workspace[k]);
+        layer l = make_convolutional_layer(16, 8, 3, 1, 1);
+        conv_set_winograd(&l, 0);
+        tensor_free(l.w);
+        tensor_free(l.b);
+        l.w = tensor_load("data/test/conv_w.tensor");
+        l.b = tensor_load("data/test/conv_b.tensor");
+        tensor y = l.forward(&l, xt);
+        tensor dx = l.backward(&l, dyt);
+        TEST(same_tensor(truth_yt, y));
+        TEST(same_tensor(truth_dxt, dx));
+        TEST(same_tensor(dwt, l.dw));
+        tensor_free(y);
+        tensor_free(dx);
+        free_layer(l);
+    }
+    conv_set_workspace(0);
+    tensor_free(xt);
+    tensor_free(dyt);
+    tensor_free(truth_yt);
+    tensor_free(truth_dxt);
+    tensor_free(dwt);
+}
+
+void test_conv_implicit()
+{
+    tensor xt = tensor_load("data/test/conv_x.tensor");
+    tensor dyt = tensor_load("data/test/conv_dy.tensor");
+    tensor truth_yt = tensor_load("data/test/conv_y.tensor");
+    tensor truth_dxt = tensor_load("data/test/conv_dx.tensor");
+    layer l = make_convolutional_layer(16, 8, 3, 1, 1);
+    tensor_free(l.w);
+    tensor_free(l.b);
+    l.w = tensor_load("data/test/conv_w.tensor");
+    l.b = tensor_load("data/test/conv_b.tensor");
+    conv_set_implicit(&l, 1);
+    tensor y = l.forward(&l, xt);
+    tensor dx = l.backward(&l, dyt);
+    TEST(same_tensor(truth_yt, y));
+    TEST(same_tensor(truth_dxt, dx));
+    TEST(conv_lowered_bytes(&l, xt) == 16*3*3*y.size[0]*y.size[2]*y.size[3]*sizeof(float));
+    tensor_free(y);
+    tensor_free(dx);
+    free_layer(l);
+
+    // odd shapes, strides and padding, matching the lowered path exactly
+    // on the blocked backend, where both go through the same kernels
+    const char *saved = matrix_backend_get()->name;
+    matrix_set_backend("blocked");
+    size_t shapes[][6] = {
+        // c, n, size, stride, pad, batch
+        {3, 5, 3, 2, 1, 3},
+        {7, 4, 1, 1, 0, 2},
+        {2, 9, 5, 3, 2, 1},
+        {20, 6, 3, 1, 0, 4},
+    };
+    int k;
+    for(k = 0; k < 4; ++k){
+        size_t *s = shapes[k];
+        layer c = make_convolutional_layer(s[0], s[1], s[2], s[3], s[4]);
+        conv_set_winograd(&c, 0);
+        tensor_free(c.b);
+        c.b = tensor_vrandom(1, 1, s[1]);
+        tensor x = tensor_vrandom(1, 4, s[5], s[0], 11, 13);
+        tensor lowered = c.forward(&c, x);
+        conv_set_implicit(&c, 1);
+        tensor implicit = c.forward(&c, x);
+        TEST(same_tensor(lowered, implicit));
+        TEST(0 == memcmp(lowered.data, implicit.data, tensor_len(lowered)*sizeof(float)));
+        tensor_free(x);
+        tensor_free(lowered);
+        tensor_free(implicit);
+        free_layer(c);
+    }
+    matrix_set_backend(saved);
+    tensor_free(xt);
+    tensor_free(dyt);
+    tensor_free(truth_yt);
+    tensor_free(truth_dxt);
+}
+
+void test_conv_winograd()
+{
+    tensor xt = tensor_load("data/test/conv_x.tensor");
+    tensor dyt = tensor_load("data/test/conv_dy.tensor");
+    tensor truth_yt = tensor_load("data/test/conv_y.tensor");
+    tensor truth_dxt = tensor_load("data/test/conv_dx.tensor");
+    tensor dwt = tensor_load("data/test/conv_dw.tensor");
+    tensor dbt = tensor_load("data/test/conv_db.tensor");
+    size_t m;
+    for(m = 2; m <= 4; m += 2){
+        layer l = make_convolutional_layer(16, 8, 3, 1, 1);
+        conv_set_winograd(&l, m);
+        tensor_free(l.w);
+        tensor_free(l.b);
+        l.w = tensor_load("data/test/conv_w.tensor");
+        l.b = tensor_load("data/test/conv_b.tensor");
+        tensor y = l.forward(&l, xt);
+        tensor dx = l.backward(&l, dyt);
+        TEST(same_tensor(truth_yt, y));
+        TEST(same_tensor(truth_dxt, dx));
+        TEST(same_tensor(dwt, l.dw));
+        TEST(same_tensor(dbt, l.db));
+        tensor_free(y);
+        tensor_free(dx);
+        free_layer(l);
+    }
+
+    // against the lowered path: padding, ragged tiles, chunks, and
+    // filters changed by an update between passes
+    size_t shapes[][6] = {
+        // c, n, h, w, pad, batch
+        {3, 5, 11, 13, 1, 3},
+        {7, 4, 9, 6, 0, 2},
+        {2, 9, 5, 7, 2, 1},
+        {20, 6, 17, 17, 1, 4},
+    };
+    int k;
+    for(k = 0; k < 4; ++k){
+        size_t *s = shapes[k];
+        for(m = 2; m <= 4; m += 2){
+            conv_set_workspace(k == 3 ? 1 : 0);
+            layer w = make_convolutional_layer(s[0], s[1], 3, 1, s[4]);
+            layer c = make_convolutional_layer(s[0], s[1], 3, 1, s[4]);
+            conv_set_winograd(&w, m);
+            conv_set_winograd(&c, 0);
+            tensor_free(c.w);
+            tensor_free(c.b);
+            c.w = tensor_ref(w.w);
+            c.b = tensor_ref(w.b);
+            tensor x = tensor_vrandom(1, 4, s[5], s[0], s[2], s[3]);
+            int pass;
+            for(pass = 0; pass < 2; ++pass){
+                tensor yw = w.forward(&w, x);
+                tensor yc = c.forward(&c, x);
+                TEST(same_tensor(yc, yw));
+                tensor dxw = w.backward(&w, yw);
+                tensor dxc = c.backward(&c, yc);
+                TEST(same_tensor(dxc, dxw));
+                TEST(same_tensor(c.dw, w.dw));
+                TEST(same_tensor(c.db, w.db));
+                tensor_free(yw);
+                tensor_free(yc);
+                tensor_free(dxw);
+                tensor_free(dxc);
+                // the update gives w new weights, c keeps the old ones
+                w.update(&w, .01, 0, 0);
+                tensor_free(c.w);
+                tensor_free(c.b);
+                c.w = tensor_ref(w.w);
+                c.b = tensor_ref(w.b);
+                tensor_scale_(0, c.dw);
+                tensor_scale_(0, c.db);
+            }
+            tensor_free(x);
+            free_layer(w);
+            free_layer(c);
+        }
+    }
+    conv_set_workspace(0);
+
+    // other shapes fall back to the lowered path
+    layer w = make_convolutional_layer(3, 4, 3, 2, 1);
+    layer c = make_convolutional_layer(3, 4, 3, 2, 1);
+    conv_set_winograd(&w, 4);
+    tensor_free(c.w);
+    c.w = tensor_ref(w.w);
+    tensor x = tensor_vrandom(1, 4, 2, 3, 9, 9);
+    tensor yw = w.forward(&w, x);
+    tensor yc = c.forward(&c, x);
+    TEST(0 == memcmp(yc.data, yw.data, tensor_len(yc)*sizeof(float)));
+    tensor_free(x);
+    tensor_free(yw);
+    tensor_free(yc);
+    free_layer(w);
+    free_layer(c);
+
+    tensor_free(xt);
+    tensor_free(dyt);
+    tensor_free(truth_yt);
+    tensor_free(truth_dxt);
+    tensor_free(dwt);
+    tensor_free(dbt);
+}
+
+void test_conv_1x1()
+{
+    // bit for bit against the lowered path only holds on the blocked
+    // backend, where both go through the same kernels
+    const char *saved = matrix_backend_get()->name;
+    matrix_set_backend("blocked");
+    size_t shapes[][5] = {
+        // c, n, h, w, batch
+        {3, 5, 7, 9, 2},
+        {16, 8, 1, 1, 4},
+        {20, 33, 5, 5, 3},
+    };
+    int k;
+    for(k = 0; k < 4; ++k){
+        size_t *s = shapes[k < 3 ? k : 0];
+        // the last run moves the padding after the layer is made, which
+        // has to fall back to lowering
+        size_t pad = k == 3;
+        layer d = make_convolutional_layer(s[0], s[1], 1, 1, 0);
+        layer c = make_convolutional_layer(s[0], s[1], 1, 1, pad);
+        d.pad = pad;
+        conv_set_winograd(&c, 0);
+        tensor_free(c.w);
+        tensor_free(d.b);
+        c.w = tensor_ref(d.w);
+        d.b = tensor_vrandom(1, 1, s[1]);
+        tensor_free(c.b);
+        c.b = tensor_ref(d.b);
+        tensor x = tensor_vrandom(1, 4, s[4], s[0], s[2], s[3]);
+        tensor yd = d.forward(&d, x);
+        tensor yc = c.forward(&c, x);
+        TEST(same_tensor(yc, yd));
+        TEST(0 == memcmp(yc.data, yd.data, tensor_len(yc)*sizeof(float)));
+        tensor dxd = d.backward(&d, yd);
+        tensor dxc = c.backward(&c, yc);
+        TEST(same_tensor(dxc, dxd));
+        TEST(same_tensor(c.dw, d.dw));
+        TEST(same_tensor(c.db, d.db));
+        tensor_free(x);
+        tensor_free(yd);
+        tensor_free(yc);
+        tensor_free(dxd);
+        tensor_free(dxc);
+        free_layer(d);
+        free_layer(c);
+    }
+    matrix_set_backend(saved);
+}
+
 void test_maxpool_layer()
 {
     tensor xt = tensor_load("data/test/max_x.tensor");
@@ -936,11 +2308,35 @@ void test_hw2()
 void test()
 {
     test_tensor_make_get();
+    test_tensor_view();
+    test_tensor_ref();
+    test_arena();
+    test_pool();
     test_transpose();
     test_invert();
+    test_invert_lu();
     test_solve_system();
+    test_solve_factored();
     test_broadcastable();
     test_elementwise();
+    test_broadcast_ops();
+    test_tensor_into();
+    test_reduce();
+    test_gemm();
+    test_gemm_batched();
+    test_tune_cache();
+    test_matrix_backends();
+    test_connected_4d_input();
+    test_fit_final_layer();
+    test_sparse();
+    test_svd();
+    test_im2col_shapes();
+    test_conv_chunks();
+    test_conv_implicit();
+    test_conv_winograd();
+    test_conv_1x1();
+    test_blocked_transpose();
+    test_simd();
     test_tensor_sum();
     time_tensor();
     // printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
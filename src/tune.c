@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "tune.h"
+#include "gemm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define TUNE_X86
+#endif
+
+// Each setting is run for at least this long, and at least TUNE_MIN_RUNS
+// times, and the fastest run counts
+#define TUNE_MIN_SEC .05
+#define TUNE_MIN_RUNS 3
+
+// Block sizes tried, one dimension at a time
+static const size_t tune_kc[] = {64, 128, 192, 256, 384, 512};
+static const size_t tune_mc[] = {48, 96, 144, 192, 240, 336, 480};
+static const size_t tune_nc[] = {512, 1024, 2048, 4096, 8192};
+
+// Where the tuning cache lives
+// returns: path of the cache file, "" when caching is turned off
+const char *tune_cache_path()
+{
+    char *env = getenv("DUBNET_TUNE_CACHE");
+    return env ? env : "dubnet.tune";
+}
+
+// Name of the cpu model, the key of its line in the cache
+// char *name: buffer to fill
+// size_t len: size of the buffer
+void tune_cpu(char *name, size_t len)
+{
+    char brand[49] = {0};
+#ifdef TUNE_X86
+    unsigned int r[4];
+    unsigned int i;
+    if(__get_cpuid(0x80000000, &r[0], &r[1], &r[2], &r[3]) && r[0] >= 0x80000004){
+        for(i = 0; i < 3; ++i){
+            __get_cpuid(0x80000002 + i, &r[0], &r[1], &r[2], &r[3]);
+            memcpy(brand + 16*i, r, 16);
+        }
+    }
+#endif
+    char *b = brand;
+    while(*b == ' ') ++b;
+    if(*b == 0) b = "unknown";
+    snprintf(name, len, "%s", b);
+    // tabs and newlines separate the fields of the cache
+    for(b = name; *b; ++b){
+        if(*b == '\t' || *b == '\n') *b = ' ';
+    }
+}
+
+// Read the tuning for this cpu from a cache file
+// const char *path: cache file
+// gemm_tuning *t: filled in when there is a line for this cpu
+// returns: 1 if there was one, 0 otherwise
+int tune_load(const char *path, gemm_tuning *t)
+{
+    if(!path || !*path) return 0;
+    FILE *fp = fopen(path, "r");
+    if(!fp) return 0;
+    char cpu[64];
+    char line[256];
+    int found = 0;
+    tune_cpu(cpu, sizeof(cpu));
+    while(!found && fgets(line, sizeof(line), fp)){
+        if(line[0] == '#') continue;
+        char *kernel = strchr(line, '\t');
+        if(!kernel) continue;
+        *kernel++ = 0;
+        char *sizes = strchr(kernel, '\t');
+        if(!sizes || strcmp(line, cpu)) continue;
+        *sizes++ = 0;
+        gemm_blocking b;
+        if(3 != sscanf(sizes, "%zu %zu %zu", &b.mc, &b.kc, &b.nc)){
+            fprintf(stderr, "Bad line in tuning cache %s\n", path);
+            continue;
+        }
+        snprintf(t->kernel, sizeof(t->kernel), "%s", kernel);
+        t->blocking = b;
+        found = 1;
+    }
+    fclose(fp);
+    return found;
+}
+
+// Write the tuning for this cpu into a cache file
+// Lines for other cpus are kept, the one for this cpu is replaced
+// const char *path: cache file, created if it doesn't exist
+// gemm_tuning t: settings to store
+// returns: 1 on success, 0 if the file couldn't be written
+int tune_save(const char *path, gemm_tuning t)
+{
+    if(!path || !*path) return 0;
+    char cpu[64];
+    char line[256];
+    tune_cpu(cpu, sizeof(cpu));
+    size_t len = strlen(cpu);
+
+    // keep everyone else's lines
+    char *kept = 0;
+    size_t used = 0;
+    FILE *fp = fopen(path, "r");
+    if(fp){
+        while(fgets(line, sizeof(line), fp)){
+            if(line[0] == '#') continue;
+            if(0 == strncmp(line, cpu, len) && line[len] == '\t') continue;
+            size_t n = strlen(line);
+            kept = realloc(kept, used + n + 1);
+            memcpy(kept + used, line, n + 1);
+            used += n;
+        }
+        fclose(fp);
+    }
+
+    fp = fopen(path, "w");
+    if(!fp){
+        free(kept);
+        return 0;
+    }
+    fprintf(fp, "# dubnet gemm tuning: cpu, kernel, mc kc nc\n");
+    if(kept) fputs(kept, fp);
+    fprintf(fp, "%s\t%s\t%zu %zu %zu\n", cpu, t.kernel, t.blocking.mc, t.blocking.kc, t.blocking.nc);
+    free(kept);
+    return 0 == fclose(fp);
+}
+
+typedef struct tune_shape {
+    size_t batch, m, n, k;
+    size_t count;   // times the net runs it per iteration
+    float *a, *b, *c;
+} tune_shape;
+
+typedef struct tune_shapes {
+    tune_shape *s;
+    size_t n;
+} tune_shapes;
+
+void tune_record(void *ctx, size_t batch, size_t m, size_t n, size_t k)
+{
+    tune_shapes *shapes = ctx;
+    size_t i;
+    for(i = 0; i < shapes->n; ++i){
+        tune_shape *s = &shapes->s[i];
+        if(s->batch == batch && s->m == m && s->n == n && s->k == k){
+            ++s->count;
+            return;
+        }
+    }
+    shapes->s = realloc(shapes->s, (shapes->n + 1)*sizeof(tune_shape));
+    tune_shape s = {batch, m, n, k, 1};
+    shapes->s[shapes->n++] = s;
+}
+
+float *tune_random(size_t n)
+{
+    float *x = malloc(n*sizeof(float));
+    size_t i;
+    for(i = 0; i < n; ++i) x[i] = (float)rand()/RAND_MAX*2 - 1;
+    return x;
+}
+
+double tune_now()
+{
+    struct timeval time;
+    if(gettimeofday(&time, NULL)) return 0;
+    return (double)time.tv_sec + (double)time.tv_usec * .000001;
+}
+
+// Time one iteration's worth of the net's multiplies with the current settings
+// returns: fastest time in seconds
+double tune_time(tune_shapes shapes)
+{
+    double best = -1;
+    double total = 0;
+    int runs;
+    for(runs = 0; runs < TUNE_MIN_RUNS || total < TUNE_MIN_SEC; ++runs){
+        double start = tune_now();
+        size_t i, j;
+        for(i = 0; i < shapes.n; ++i){
+            tune_shape s = shapes.s[i];
+            for(j = 0; j < s.count; ++j){
+                gemm_strided_batched(s.batch, s.m, s.n, s.k, 1,
+                        s.a, s.k, 1, s.m*s.k,
+                        s.b, s.n, 1, s.k*s.n,
+                        0, s.c, s.n, 1, s.m*s.n);
+            }
+        }
+        double t = tune_now() - start;
+        total += t;
+        if(best < 0 || t < best) best = t;
+    }
+    return best;
+}
+
+// Try each size in turn for one block dimension, keeping the fastest
+double tune_dimension(tune_shapes shapes, gemm_blocking *b, size_t *dim,
+        const size_t *sizes, size_t n, double best)
+{
+    size_t i;
+    size_t keep = *dim;
+    for(i = 0; i < n; ++i){
+        if(sizes[i] == keep) continue;
+        *dim = sizes[i];
+        gemm_set_blocking(*b);
+        double t = tune_time(shapes);
+        if(t < best){
+            best = t;
+            keep = sizes[i];
+        }
+    }
+    *dim = keep;
+    gemm_set_blocking(*b);
+    return best;
+}
+
+// Find the fastest GEMM settings for the multiplies a workload runs
+// One call of run records the shapes, then each kernel the cpu supports
+// is timed while the block sizes are tuned one at a time. The winner is
+// left in use.
+// run: one iteration of the workload, e.g. a forward and backward pass
+// void *ctx: passed to run
+// returns: the fastest settings
+gemm_tuning tune_gemm(void (*run)(void *ctx), void *ctx)
+{
+    tune_shapes shapes = {0};
+    gemm_set_observer(tune_record, &shapes);
+    run(ctx);
+    gemm_set_observer(0, 0);
+
+    size_t i;
+    double flops = 0;
+    for(i = 0; i < shapes.n; ++i){
+        tune_shape *s = &shapes.s[i];
+        s->a = tune_random(s->batch*s->m*s->k);
+        s->b = tune_random(s->batch*s->k*s->n);
+        s->c = calloc(s->batch*s->m*s->n, sizeof(float));
+        flops += 2.*s->batch*s->m*s->n*s->k*s->count;
+        fprintf(stderr, "shape %zu x (%zu x %zu x %zu) run %zu times\n", s->batch, s->m, s->n, s->k, s->count);
+    }
+
+    gemm_tuning best = {{0}, gemm_get_blocking()};
+    snprintf(best.kernel, sizeof(best.kernel), "%s", gemm_kernel_name());
+    double base = tune_time(shapes);
+    double best_time = base;
+    fprintf(stderr, "default %s, %zu %zu %zu: %f ms, %.2f GFLOP/s\n", best.kernel,
+            best.blocking.mc, best.blocking.kc, best.blocking.nc, 1000*base, flops/base/1e9);
+
+    const char *name;
+    for(i = 0; (name = gemm_kernel_list(i)); ++i){
+        gemm_blocking b = best.blocking;
+        gemm_set_kernel(name);
+        gemm_set_blocking(b);
+        double t = tune_time(shapes);
+        t = tune_dimension(shapes, &b, &b.kc, tune_kc, sizeof(tune_kc)/sizeof(tune_kc[0]), t);
+        t = tune_dimension(shapes, &b, &b.mc, tune_mc, sizeof(tune_mc)/sizeof(tune_mc[0]), t);
+        t = tune_dimension(shapes, &b, &b.nc, tune_nc, sizeof(tune_nc)/sizeof(tune_nc[0]), t);
+        fprintf(stderr, "%s, %zu %zu %zu: %f ms, %.2f GFLOP/s\n", name,
+                b.mc, b.kc, b.nc, 1000*t, flops/t/1e9);
+        if(t < best_time){
+            best_time = t;
+            best.blocking = b;
+            snprintf(best.kernel, sizeof(best.kernel), "%s", name);
+        }
+    }
+    gemm_set_kernel(best.kernel);
+    gemm_set_blocking(best.blocking);
+    fprintf(stderr, "best %s, %zu %zu %zu: %.2fx the default\n", best.kernel,
+            best.blocking.mc, best.blocking.kc, best.blocking.nc, base/best_time);
+
+    for(i = 0; i < shapes.n; ++i){
+        free(shapes.s[i].a);
+        free(shapes.s[i].b);
+        free(shapes.s[i].c);
+    }
+    free(shapes.s);
+    return best;
+}
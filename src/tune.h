@@ -0,0 +1,29 @@
+// Include guards and C++ compatibility
+#ifndef TUNE_H
+#define TUNE_H
+#include <stddef.h>
+#include "gemm.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// GEMM settings that won the tuning on one cpu
+// The cache file holds one line per cpu model, so machines of different
+// generations can share it, and gemm picks up the line for its cpu the
+// first time it runs. The file is DUBNET_TUNE_CACHE, or dubnet.tune in
+// the working directory, and setting DUBNET_TUNE_CACHE empty ignores it.
+typedef struct gemm_tuning {
+    char kernel[32];
+    gemm_blocking blocking;
+} gemm_tuning;
+
+const char *tune_cache_path();
+void tune_cpu(char *name, size_t len);
+int tune_load(const char *path, gemm_tuning *t);
+int tune_save(const char *path, gemm_tuning t);
+gemm_tuning tune_gemm(void (*run)(void *ctx), void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
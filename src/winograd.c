@@ -0,0 +1,436 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "winograd.h"
+#include "matrix.h"
+#include "parallel.h"
+
+// Largest tile, F(4x4, 3x3) works on 6x6
+#define WINO_ALPHA_MAX 6
+
+// Tiles transformed together, one vector of them per element
+#define WINO_LANES 8
+
+// Transforms of F(m, 3): y = at*((g*f) .* (bt*d)) for a filter f of 3,
+// an input d of m+2 and an output y of m, applied along both axes in 2-D
+typedef struct wino_tables {
+    size_t m;
+    size_t alpha;
+    const float *bt;    // alpha x alpha
+    const float *g;     // alpha x 3
+    const float *at;    // m x alpha
+} wino_tables;
+
+static const float wino_bt2[] = {
+    1,  0, -1,  0,
+    0,  1,  1,  0,
+    0, -1,  1,  0,
+    0,  1,  0, -1,
+};
+static const float wino_g2[] = {
+    1,   0,  0,
+    .5, .5, .5,
+    .5,-.5, .5,
+    0,   0,  1,
+};
+static const float wino_at2[] = {
+    1, 1,  1,  0,
+    0, 1, -1, -1,
+};
+
+static const float wino_bt4[] = {
+    4,  0, -5,  0, 1, 0,
+    0, -4, -4,  1, 1, 0,
+    0,  4, -4, -1, 1, 0,
+    0, -2, -1,  2, 1, 0,
+    0,  2, -1, -2, 1, 0,
+    0,  4,  0, -5, 0, 1,
+};
+static const float wino_g4[] = {
+     1/4.f,      0,      0,
+    -1/6.f, -1/6.f, -1/6.f,
+    -1/6.f,  1/6.f, -1/6.f,
+    1/24.f, 1/12.f,  1/6.f,
+    1/24.f,-1/12.f,  1/6.f,
+         0,      0,      1,
+};
+static const float wino_at4[] = {
+    1, 1,  1, 1,  1, 0,
+    0, 1, -1, 2, -2, 0,
+    0, 1,  1, 4,  4, 0,
+    0, 1, -1, 8, -8, 1,
+};
+
+static const wino_tables wino_f2 = {2, 4, wino_bt2, wino_g2, wino_at2};
+static const wino_tables wino_f4 = {4, 6, wino_bt4, wino_g4, wino_at4};
+
+// out = L*d*R^T for small matrices, L is p x q and R is pr x qr, both
+// read through row and column strides so the tables serve transposed too
+// Every element holds WINO_LANES tiles side by side, so each coefficient
+// is applied to all of them at once and zeros of the tables cost a test
+// per lane group instead of per element
+void wino_sandwich(float *out, const float *d,
+        const float *l, size_t p, size_t q, size_t rl, size_t cl,
+        const float *r, size_t pr, size_t qr, size_t rr, size_t cr)
+{
+    float tmp[WINO_ALPHA_MAX*WINO_ALPHA_MAX*WINO_LANES];
+    size_t i, j, a, k;
+    for(i = 0; i < p*qr*WINO_LANES; ++i) tmp[i] = 0;
+    for(i = 0; i < p; ++i){
+        for(a = 0; a < q; ++a){
+            float la = l[i*rl + a*cl];
+            if(la == 0) continue;
+            for(j = 0; j < qr; ++j){
+                float *t = tmp + (i*qr + j)*WINO_LANES;
+                const float *v = d + (a*qr + j)*WINO_LANES;
+                for(k = 0; k < WINO_LANES; ++k) t[k] += la*v[k];
+            }
+        }
+    }
+    for(i = 0; i < p; ++i){
+        for(j = 0; j < pr; ++j){
+            float *o = out + (i*pr + j)*WINO_LANES;
+            for(k = 0; k < WINO_LANES; ++k) o[k] = 0;
+            for(a = 0; a < qr; ++a){
+                float ra = r[j*rr + a*cr];
+                if(ra == 0) continue;
+                const float *t = tmp + (i*qr + a)*WINO_LANES;
+                for(k = 0; k < WINO_LANES; ++k) o[k] += ra*t[k];
+            }
+        }
+    }
+}
+
+// Make an engine for F(m x m, 3 x 3)
+// size_t m: outputs per side of a tile, 2 or 4
+// returns: engine, release with free_winograd
+winograd *make_winograd(size_t m)
+{
+    assert(m == 2 || m == 4);
+    winograd *wg = calloc(1, sizeof(winograd));
+    wg->m = m;
+    return wg;
+}
+
+void free_winograd(winograd *wg)
+{
+    if(!wg) return;
+    tensor_free(wg->w);
+    tensor_free(wg->u);
+    free(wg);
+}
+
+// Whether filters w at this stride are ones Winograd can run
+int winograd_fits(const tensor w, size_t stride)
+{
+    return w.n == 4 && w.size[2] == 3 && w.size[3] == 3 && stride == 1;
+}
+
+static const wino_tables *wino_get(const winograd *wg)
+{
+    return wg->m == 2 ? &wino_f2 : &wino_f4;
+}
+
+// Everything a pass needs to know about the chunk and its tiles
+typedef struct wino_job {
+    const wino_tables *t;
+    const float *src;
+    float *dst;
+    size_t n, c, f;     // images, channels and filters
+    size_t h, w, pad;   // input
+    size_t oh, ow;      // output
+    size_t th, tw;      // tiles per column and row of an image
+    size_t T;           // tiles in the chunk, columns of the multiplies
+} wino_job;
+
+// G*g*G^T for filter pairs start to end of w
+void wino_filter_part(void *ctx, size_t start, size_t end)
+{
+    wino_job *j = ctx;
+    const wino_tables *t = j->t;
+    size_t aa = t->alpha*t->alpha;
+    float g[9*WINO_LANES] = {0};
+    float u[WINO_ALPHA_MAX*WINO_ALPHA_MAX*WINO_LANES];
+    size_t r, e, k;
+    for(r = start; r < end; r += WINO_LANES){
+        size_t lanes = (end - r < WINO_LANES) ? end - r : WINO_LANES;
+        for(k = 0; k < lanes; ++k){
+            for(e = 0; e < 9; ++e) g[e*WINO_LANES + k] = j->src[(r + k)*9 + e];
+        }
+        wino_sandwich(u, g, t->g, t->alpha, 3, 3, 1, t->g, t->alpha, 3, 3, 1);
+        for(e = 0; e < aa; ++e){
+            memcpy(j->dst + e*j->f*j->c + r, u + e*WINO_LANES, lanes*sizeof(float));
+        }
+    }
+}
+
+// Transformed filters for w, made again only when w is a different tensor
+const float *wino_filters(winograd *wg, const tensor w)
+{
+    const wino_tables *t = wino_get(wg);
+    if(wg->w.storage && wg->w.storage == w.storage && wg->w.data == w.data) return wg->u.data;
+    tensor_free(wg->w);
+    tensor_free(wg->u);
+    wg->w = tensor_ref(w);
+    wg->u = tensor_vempty(3, t->alpha*t->alpha, w.size[0], w.size[1]);
+    tensor g = tensor_contiguous(w);
+    wino_job j = {t, g.data, wg->u.data, 0, w.size[1], w.size[0]};
+    parallel_for(w.size[0]*w.size[1], 16, wino_filter_part, &j);
+    tensor_free(g);
+    return wg->u.data;
+}
+
+// Bt*d*B for every tile of image channels start to end
+void wino_input_part(void *ctx, size_t start, size_t end)
+{
+    wino_job *j = ctx;
+    const wino_tables *t = j->t;
+    size_t a = t->alpha, aa = a*a, tiles = j->th*j->tw;
+    float d[WINO_ALPHA_MAX*WINO_ALPHA_MAX*WINO_LANES] = {0};
+    float v[WINO_ALPHA_MAX*WINO_ALPHA_MAX*WINO_LANES];
+    long h = j->h, w = j->w;
+    size_t r, q, k, e, y, x;
+    for(r = start; r < end; ++r){
+        size_t i = r / j->c, ch = r % j->c;
+        const float *im = j->src + r*j->h*j->w;
+        float *dst = j->dst + ch*j->T + i*tiles;
+        for(q = 0; q < tiles; q += WINO_LANES){
+            size_t lanes = (tiles - q < WINO_LANES) ? tiles - q : WINO_LANES;
+            for(k = 0; k < lanes; ++k){
+                long y0 = (long)((q + k)/j->tw*t->m) - (long)j->pad;
+                long x0 = (long)((q + k)%j->tw*t->m) - (long)j->pad;
+                for(y = 0; y < a; ++y){
+                    long iy = y0 + (long)y;
+                    for(x = 0; x < a; ++x){
+                        long ix = x0 + (long)x;
+                        d[(y*a + x)*WINO_LANES + k] =
+                            (iy >= 0 && iy < h && ix >= 0 && ix < w) ? im[iy*w + ix] : 0;
+                    }
+                }
+            }
+            wino_sandwich(v, d, t->bt, a, a, a, 1, t->bt, a, a, a, 1);
+            for(e = 0; e < aa; ++e){
+                memcpy(dst + e*j->c*j->T + q, v + e*WINO_LANES, lanes*sizeof(float));
+            }
+        }
+    }
+}
+
+// At*M*A for every tile of output channels start to end
+void wino_output_part(void *ctx, size_t start, size_t end)
+{
+    wino_job *j = ctx;
+    const wino_tables *t = j->t;
+    size_t a = t->alpha, aa = a*a, m = t->m, tiles = j->th*j->tw;
+    float mt[WINO_ALPHA_MAX*WINO_ALPHA_MAX*WINO_LANES] = {0};
+    float yt[WINO_ALPHA_MAX*WINO_ALPHA_MAX*WINO_LANES];
+    size_t r, q, k, e, y, x;
+    for(r = start; r < end; ++r){
+        size_t i = r / j->f, fo = r % j->f;
+        const float *src = j->src + fo*j->T + i*tiles;
+        float *out = j->dst + r*j->oh*j->ow;
+        for(q = 0; q < tiles; q += WINO_LANES){
+            size_t lanes = (tiles - q < WINO_LANES) ? tiles - q : WINO_LANES;
+            for(e = 0; e < aa; ++e){
+                memcpy(mt + e*WINO_LANES, src + e*j->f*j->T + q, lanes*sizeof(float));
+            }
+            wino_sandwich(yt, mt, t->at, m, a, a, 1, t->at, m, a, a, 1);
+            for(k = 0; k < lanes; ++k){
+                size_t oy = (q + k)/j->tw*m, ox = (q + k)%j->tw*m;
+                for(y = 0; y < m && oy + y < j->oh; ++y){
+                    for(x = 0; x < m && ox + x < j->ow; ++x){
+                        out[(oy + y)*j->ow + ox + x] = yt[(y*m + x)*WINO_LANES + k];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// A*dy*At for every tile of output channels start to end, the adjoint of
+// wino_output_part
+void wino_grad_part(void *ctx, size_t start, size_t end)
+{
+    wino_job *j = ctx;
+    const wino_tables *t = j->t;
+    size_t a = t->alpha, aa = a*a, m = t->m, tiles = j->th*j->tw;
+    float dt[WINO_ALPHA_MAX*WINO_ALPHA_MAX*WINO_LANES] = {0};
+    float z[WINO_ALPHA_MAX*WINO_ALPHA_MAX*WINO_LANES];
+    size_t r, q, k, e, y, x;
+    for(r = start; r < end; ++r){
+        size_t i = r / j->f, fo = r % j->f;
+        const float *dy = j->src + r*j->oh*j->ow;
+        float *dst = j->dst + fo*j->T + i*tiles;
+        for(q = 0; q < tiles; q += WINO_LANES){
+            size_t lanes = (tiles - q < WINO_LANES) ? tiles - q : WINO_LANES;
+            for(k = 0; k < lanes; ++k){
+                size_t oy = (q + k)/j->tw*m, ox = (q + k)%j->tw*m;
+                for(y = 0; y < m; ++y){
+                    for(x = 0; x < m; ++x){
+                        dt[(y*m + x)*WINO_LANES + k] = (oy + y < j->oh && ox + x < j->ow) ?
+                            dy[(oy + y)*j->ow + ox + x] : 0;
+                    }
+                }
+            }
+            wino_sandwich(z, dt, t->at, a, m, 1, a, t->at, a, m, 1, a);
+            for(e = 0; e < aa; ++e){
+                memcpy(dst + e*j->f*j->T + q, z + e*WINO_LANES, lanes*sizeof(float));
+            }
+        }
+    }
+}
+
+// B*E*Bt added back into image channels start to end, the adjoint of
+// wino_input_part. Tiles overlap but each part has its own channels.
+void wino_dx_part(void *ctx, size_t start, size_t end)
+{
+    wino_job *j = ctx;
+    const wino_tables *t = j->t;
+    size_t a = t->alpha, aa = a*a, tiles = j->th*j->tw;
+    float et[WINO_ALPHA_MAX*WINO_ALPHA_MAX*WINO_LANES] = {0};
+    float d[WINO_ALPHA_MAX*WINO_ALPHA_MAX*WINO_LANES];
+    long h = j->h, w = j->w;
+    size_t r, q, k, e, y, x;
+    for(r = start; r < end; ++r){
+        size_t i = r / j->c, ch = r % j->c;
+        const float *src = j->src + ch*j->T + i*tiles;
+        float *im = j->dst + r*j->h*j->w;
+        memset(im, 0, j->h*j->w*sizeof(float));
+        for(q = 0; q < tiles; q += WINO_LANES){
+            size_t lanes = (tiles - q < WINO_LANES) ? tiles - q : WINO_LANES;
+            for(e = 0; e < aa; ++e){
+                memcpy(et + e*WINO_LANES, src + e*j->c*j->T + q, lanes*sizeof(float));
+            }
+            wino_sandwich(d, et, t->bt, a, a, 1, a, t->bt, a, a, 1, a);
+            for(k = 0; k < lanes; ++k){
+                long y0 = (long)((q + k)/j->tw*t->m) - (long)j->pad;
+                long x0 = (long)((q + k)%j->tw*t->m) - (long)j->pad;
+                for(y = 0; y < a; ++y){
+                    long iy = y0 + (long)y;
+                    if(iy < 0 || iy >= h) continue;
+                    for(x = 0; x < a; ++x){
+                        long ix = x0 + (long)x;
+                        if(ix >= 0 && ix < w) im[iy*w + ix] += d[(y*a + x)*WINO_LANES + k];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Gt*dU*G added into the gradient of filter pairs start to end
+void wino_dw_part(void *ctx, size_t start, size_t end)
+{
+    wino_job *j = ctx;
+    const wino_tables *t = j->t;
+    size_t a = t->alpha, aa = a*a;
+    float du[WINO_ALPHA_MAX*WINO_ALPHA_MAX*WINO_LANES] = {0};
+    float dg[9*WINO_LANES];
+    size_t r, e, k;
+    for(r = start; r < end; r += WINO_LANES){
+        size_t lanes = (end - r < WINO_LANES) ? end - r : WINO_LANES;
+        for(e = 0; e < aa; ++e){
+            memcpy(du + e*WINO_LANES, j->src + e*j->f*j->c + r, lanes*sizeof(float));
+        }
+        wino_sandwich(dg, du, t->g, 3, a, 1, 3, t->g, 3, a, 1, 3);
+        for(k = 0; k < lanes; ++k){
+            for(e = 0; e < 9; ++e) j->dst[(r + k)*9 + e] += dg[e*WINO_LANES + k];
+        }
+    }
+}
+
+static wino_job wino_setup(const winograd *wg, const tensor w, size_t n,
+        size_t h, size_t width, size_t pad)
+{
+    const wino_tables *t = wino_get(wg);
+    wino_job j = {t, 0, 0, n, w.size[1], w.size[0], h, width, pad};
+    j.oh = h + 2*pad - 2;
+    j.ow = width + 2*pad - 2;
+    j.th = (j.oh + t->m - 1)/t->m;
+    j.tw = (j.ow + t->m - 1)/t->m;
+    j.T = n*j.th*j.tw;
+    return j;
+}
+
+// Floats of scratch a pass needs per image
+size_t winograd_floats(const winograd *wg, const tensor w, size_t h, size_t width, size_t pad)
+{
+    wino_job j = wino_setup(wg, w, 1, h, width, pad);
+    return j.t->alpha*j.t->alpha*(j.c + j.f)*j.T;
+}
+
+// Convolve a chunk of images with 3x3 filters, stride 1
+// Per element of the tile, one multiply of the transformed filters by the
+// transformed input tiles of the whole chunk
+// tensor w: (filters, channels, 3, 3) weights
+// float *x: (n, channels, h, width) images
+// float *y: (n, filters, h + 2*pad - 2, width + 2*pad - 2) output to fill
+void winograd_forward(winograd *wg, const tensor w, const float *x, size_t n,
+        size_t h, size_t width, size_t pad, float *y, arena *scratch)
+{
+    assert(winograd_fits(w, 1));
+    const float *u = wino_filters(wg, w);
+    wino_job j = wino_setup(wg, w, n, h, width, pad);
+    size_t aa = j.t->alpha*j.t->alpha;
+    tensor v = tensor_vmake_in(scratch, 3, aa, j.c, j.T);
+    tensor mt = tensor_vmake_in(scratch, 3, aa, j.f, j.T);
+
+    j.src = x;
+    j.dst = v.data;
+    parallel_for(n*j.c, 1, wino_input_part, &j);
+
+    matrix_backend_get()->gemm(aa, j.f, j.T, j.c, 1, u, j.c, 1, j.f*j.c,
+            v.data, j.T, 1, j.c*j.T, 0, mt.data, j.T, 1, j.f*j.T);
+
+    j.src = mt.data;
+    j.dst = y;
+    parallel_for(n*j.f, 1, wino_output_part, &j);
+
+    tensor_free(v);
+    tensor_free(mt);
+}
+
+// Run the convolution of winograd_forward backward through the same
+// transforms: the input and output transforms have adjoints that carry
+// dy back to the tiles, and both gradients are multiplies there
+// float *dy: (n, filters, out_h, out_w) gradient of the output
+// float *dx: (n, channels, h, width) gradient of x to fill
+// float *dw: (filters, channels, 3, 3) gradient of w to add to
+void winograd_backward(winograd *wg, const tensor w, const float *x, const float *dy, size_t n,
+        size_t h, size_t width, size_t pad, float *dx, float *dw, arena *scratch)
+{
+    assert(winograd_fits(w, 1));
+    const float *u = wino_filters(wg, w);
+    wino_job j = wino_setup(wg, w, n, h, width, pad);
+    size_t aa = j.t->alpha*j.t->alpha;
+    tensor v = tensor_vmake_in(scratch, 3, aa, j.c, j.T);
+    tensor z = tensor_vmake_in(scratch, 3, aa, j.f, j.T);
+    tensor du = tensor_vmake_in(scratch, 3, aa, j.f, j.c);
+    const matrix_backend *be = matrix_backend_get();
+
+    j.src = x;
+    j.dst = v.data;
+    parallel_for(n*j.c, 1, wino_input_part, &j);
+    j.src = dy;
+    j.dst = z.data;
+    parallel_for(n*j.f, 1, wino_grad_part, &j);
+
+    // dU = Z*V^T summed over the tiles, then back to 3x3
+    be->gemm(aa, j.f, j.c, j.T, 1, z.data, j.T, 1, j.f*j.T,
+            v.data, 1, j.T, j.c*j.T, 0, du.data, j.c, 1, j.f*j.c);
+    j.src = du.data;
+    j.dst = dw;
+    parallel_for(j.f*j.c, 16, wino_dw_part, &j);
+
+    // E = U^T*Z, the input tiles are done with so E takes their place
+    be->gemm(aa, j.c, j.T, j.f, 1, u, 1, j.c, j.f*j.c,
+            z.data, j.T, 1, j.f*j.T, 0, v.data, j.T, 1, j.c*j.T);
+    j.src = v.data;
+    j.dst = dx;
+    parallel_for(n*j.c, 1, wino_dx_part, &j);
+
+    tensor_free(v);
+    tensor_free(z);
+    tensor_free(du);
+}
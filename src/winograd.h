@@ -0,0 +1,32 @@
+// Include guards and C++ compatibility
+#ifndef WINOGRAD_H
+#define WINOGRAD_H
+#include "tensor.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Winograd F(m x m, 3 x 3) convolution for 3x3 stride 1 filters
+// Each m x m tile of output comes from an (m+2) x (m+2) tile of input
+// with (m+2)^2 multiplies per channel instead of 9*m^2. The transformed
+// filters are kept between calls for as long as w is the same tensor,
+// writers of w call tensor_unshare first so an update gets them redone.
+typedef struct winograd {
+    size_t m;   // outputs per side of a tile, 2 or 4
+    tensor w;   // reference to the weights the filters came from
+    tensor u;   // (alpha*alpha, filters, channels) transformed filters
+} winograd;
+
+winograd *make_winograd(size_t m);
+void free_winograd(winograd *wg);
+int winograd_fits(const tensor w, size_t stride);
+size_t winograd_floats(const winograd *wg, const tensor w, size_t h, size_t width, size_t pad);
+void winograd_forward(winograd *wg, const tensor w, const float *x, size_t n,
+        size_t h, size_t width, size_t pad, float *y, arena *scratch);
+void winograd_backward(winograd *wg, const tensor w, const float *x, const float *dy, size_t n,
+        size_t h, size_t width, size_t pad, float *dx, float *dw, arena *scratch);
+
+#ifdef __cplusplus
+}
+#endif
+#endif